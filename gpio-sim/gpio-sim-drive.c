@@ -0,0 +1,177 @@
+/*
+ * gpio-sim-drive, plays an edge trace on a gpio-sim line for make gpio-sim-test.
+ * Copyright (C) 2023 Claude Warren, https://inzown.com
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; version 2 of the
+ * License.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+// Both modes stamp with CLOCK_MONOTONIC, so the edges and the handler starts can be subtracted.
+static unsigned long long get_timestamp_ns(void)
+{
+	struct timespec tp;
+	clock_gettime(CLOCK_MONOTONIC, &tp);
+	return tp.tv_sec * 1000000000ull + tp.tv_nsec;
+}
+
+static void print_usage(void)
+{
+	printf("Usage: gpio-sim-drive <pull> <trace>\n"
+		"       gpio-sim-drive --stamp <log> <action>\n"
+		"\n"
+		"Plays the \"<ms> <0|1>\" edge trace of inzown-btn --replay on a gpio-sim line, writing pull-up for 1 and\n"
+		"pull-down for 0 to the line's sim_gpio<n>/pull file at the trace's times. Every edge is printed as\n"
+		"\"edge <ns> <0|1>\", the CLOCK_MONOTONIC time just before its pull was written.\n"
+		"\n"
+		"With --stamp, appends \"action <ns> <action>\" to log, the time this process started, and exits. The test\n"
+		"configures it as the handler of every action.\n");
+}
+
+static int stamp(const char *path, const char *action)
+{
+	unsigned long long now = get_timestamp_ns();
+
+	char line[128];
+	int n = snprintf(line, sizeof(line), "action %llu %s\n", now, action);
+	if (n < 0 || (size_t)n >= sizeof(line))
+	{
+		fprintf(stderr, "The action name %s is too long!\n", action);
+		return 1;
+	}
+
+	// One O_APPEND write, so that handlers running at the same time do not mix their lines.
+	int fd = open(path, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0644);
+	if (fd == -1)
+	{
+		fprintf(stderr, "Opening %s failed. Error %d.\n", path, errno);
+		return 1;
+	}
+	if (write(fd, line, n) != n)
+	{
+		fprintf(stderr, "Writing %s failed. Error %d.\n", path, errno);
+		close(fd);
+		return 1;
+	}
+	close(fd);
+	return 0;
+}
+
+static int set_pull(int fd, unsigned int value)
+{
+	static const char *const PULLS[] = { "pull-down", "pull-up" };
+
+	size_t len = strlen(PULLS[value]);
+	ssize_t n;
+	do
+		n = pwrite(fd, PULLS[value], len, 0);
+	while (n == -1 && errno == EINTR);
+	return n == (ssize_t)len ? 0 : -1;
+}
+
+static int drive(const char *pull, const char *path)
+{
+	FILE *f = fopen(path, "r");
+	if (f == NULL)
+	{
+		fprintf(stderr, "Opening %s failed. Error %d.\n", path, errno);
+		return 1;
+	}
+
+	int fd = open(pull, O_WRONLY | O_CLOEXEC);
+	if (fd == -1)
+	{
+		fprintf(stderr, "Opening %s failed. Error %d.\n", pull, errno);
+		fclose(f);
+		return 1;
+	}
+
+	// The trace starts released, so that its first edge is a press the daemon sees.
+	int result = 0;
+	if (set_pull(fd, 0) != 0)
+	{
+		fprintf(stderr, "Writing %s failed. Error %d.\n", pull, errno);
+		result = 1;
+	}
+
+	// The edges are due at absolute times from the start, so the time spent writing one does not delay the next.
+	struct timespec start;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	unsigned long long last_ms = 0;
+	unsigned int line = 0;
+	char buffer[128];
+	while (result == 0 && fgets(buffer, sizeof(buffer), f) != NULL)
+	{
+		++line;
+		const char *p = buffer;
+		while (*p == ' ' || *p == '\t')
+			++p;
+		if (*p == '#' || *p == '\n' || *p == '\0')
+			continue;
+
+		unsigned long long ms;
+		unsigned int value;
+		if (sscanf(p, "%llu %u", &ms, &value) != 2 || value > 1 || ms < last_ms)
+		{
+			fprintf(stderr, "%s:%u: expected \"<ms> <0|1>\" in increasing time order.\n", path, line);
+			result = 1;
+			break;
+		}
+		last_ms = ms;
+
+		struct timespec due = start;
+		due.tv_sec += ms / 1000;
+		due.tv_nsec += (ms % 1000) * 1000000;
+		if (due.tv_nsec >= 1000000000)
+		{
+			++due.tv_sec;
+			due.tv_nsec -= 1000000000;
+		}
+		while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &due, NULL) == EINTR)
+			;
+
+		printf("edge %llu %u\n", get_timestamp_ns(), value);
+		if (set_pull(fd, value) != 0)
+		{
+			fprintf(stderr, "Writing %s failed. Error %d.\n", pull, errno);
+			result = 1;
+		}
+	}
+
+	// Leave the line released.
+	set_pull(fd, 0);
+	close(fd);
+	fclose(f);
+	return result;
+}
+
+int main(int argc, char **argv)
+{
+	if (argc == 4 && strcmp(argv[1], "--stamp") == 0)
+		return stamp(argv[2], argv[3]);
+	if (argc == 3 && argv[1][0] != '-')
+		return drive(argv[1], argv[2]);
+
+	print_usage();
+	return argc == 2 && strcmp(argv[1], "--help") == 0 ? 0 : 1;
+}
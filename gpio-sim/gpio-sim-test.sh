@@ -0,0 +1,143 @@
+#!/bin/sh
+#
+# End to end test of inzown-btn on a simulated GPIO chip, run by make gpio-sim-test as root.
+#
+# Creates a gpio-sim chip through configfs, starts the daemon on its line 0 with every action handled by
+# gpio-sim-drive --stamp, plays the edge trace on the line with gpio-sim-drive and checks the actions the daemon
+# ran. DOWN and UP are paired with the edges they came from for the edge to dispatch latency: from the write of
+# the line's pull until the handler process started, through the kernel, sysfs, the event loop and the spawn.
+#
+# Usage: gpio-sim-test.sh <inzown-btn> <gpio-sim-drive> <trace> [<latency limit us>]
+#
+# The trace is in the format of inzown-btn --replay, with a "# Gestures: <name>..." line listing the clicks and
+# holds it has to be classified into. A latency limit of 0 only reports the latency.
+
+set -u
+
+DAEMON=$(realpath "$1")
+DRIVE=$(realpath "$2")
+TRACE=$(realpath "$3")
+LATENCY_LIMIT_US=${4:-0}
+EXPECTED=$(sed -n 's/^# Gestures: *//p' "$TRACE")
+
+CHIP=/sys/kernel/config/gpio-sim/inzown-test
+LABEL=inzown-gpio-sim-test
+WORK=$(mktemp -d)
+PID=
+
+fail()
+{
+	echo "gpio-sim-test: FAIL: $*" >&2
+	exit 1
+}
+
+cleanup()
+{
+	[ -n "$PID" ] && kill "$PID" 2> /dev/null && wait "$PID" 2> /dev/null
+	if [ -d "$CHIP" ]; then
+		echo 0 > "$CHIP/live" 2> /dev/null
+		rmdir "$CHIP/gpio-bank0" "$CHIP" 2> /dev/null
+	fi
+	rm -rf "$WORK"
+}
+trap cleanup EXIT
+trap 'exit 1' INT TERM
+
+[ -n "$EXPECTED" ] || fail "$TRACE has no \"# Gestures:\" line."
+[ "$(id -u)" = 0 ] || fail "needs root, for configfs and the sysfs GPIO interface."
+modprobe gpio-sim 2> /dev/null
+[ -d /sys/kernel/config/gpio-sim ] || fail "no /sys/kernel/config/gpio-sim, the kernel needs CONFIG_GPIO_SIM" \
+	"and configfs mounted."
+[ -w /sys/class/gpio/export ] || fail "no /sys/class/gpio/export, the kernel needs CONFIG_GPIO_SYSFS."
+[ -d "$CHIP" ] && fail "$CHIP exists, remove the chip of an earlier run."
+
+# One bank of 8 lines, labelled so that its GPIO base can be found in /sys/class/gpio.
+mkdir "$CHIP" "$CHIP/gpio-bank0" || fail "creating $CHIP."
+echo 8 > "$CHIP/gpio-bank0/num_lines"
+echo "$LABEL" > "$CHIP/gpio-bank0/label"
+echo 1 > "$CHIP/live" || fail "enabling $CHIP."
+
+DEV=$(cat "$CHIP/dev_name")
+PULL=$(echo /sys/devices/platform/"$DEV"/"$(cat "$CHIP/gpio-bank0/chip_name")"/sim_gpio0/pull)
+[ -w "$PULL" ] || fail "no $PULL."
+
+BASE=
+for chip in /sys/class/gpio/gpiochip*; do
+	[ "$(cat "$chip/label")" = "$LABEL" ] && BASE=$(cat "$chip/base")
+done
+[ -n "$BASE" ] || fail "no /sys/class/gpio/gpiochip* labelled $LABEL."
+echo "gpio-sim-test: $DEV, GPIO $BASE, driven through $PULL."
+
+# The handlers record the action name, resolved by the daemon, and the time they started.
+echo pull-down > "$PULL"
+cat > "$WORK/test.conf" << EOF
+DOWN        $DRIVE --stamp $WORK/actions DOWN
+UP          $DRIVE --stamp $WORK/actions UP
+CLICK_OTHER $DRIVE --stamp $WORK/actions CLICK_{clicks}
+HOLD_OTHER  $DRIVE --stamp $WORK/actions HOLD_{hold_s}S
+EOF
+
+"$DAEMON" --gpio "$BASE" --conf "$WORK/test.conf" --conf-dir "" > "$WORK/daemon.log" 2>&1 &
+PID=$!
+
+# The daemon listens once it has set the edge of the line.
+tries=50
+while [ "$(cat /sys/class/gpio/gpio"$BASE"/edge 2> /dev/null)" != both ]; do
+	kill -0 "$PID" 2> /dev/null || fail "the daemon exited: $(cat "$WORK/daemon.log")"
+	tries=$((tries - 1))
+	[ $tries -gt 0 ] || fail "the daemon did not listen on GPIO $BASE within 5 s."
+	sleep 0.1
+done
+sleep 0.2
+
+"$DRIVE" "$PULL" "$TRACE" > "$WORK/edges" || fail "driving $PULL."
+
+# The last gesture is classified when its click window closes.
+sleep 1
+kill -0 "$PID" 2> /dev/null || fail "the daemon exited: $(cat "$WORK/daemon.log")"
+kill "$PID"
+wait "$PID" 2> /dev/null
+PID=
+
+[ -s "$WORK/actions" ] || fail "the daemon ran no handler."
+sort -n -k 2 "$WORK/actions" > "$WORK/sorted"
+
+# UP and the HOLD it ends are dispatched together, so the gestures are checked apart from DOWN and UP.
+GESTURES=$(awk '$3 != "DOWN" && $3 != "UP" { printf "%s%s", sep, $3; sep = " " }' "$WORK/sorted")
+echo "gpio-sim-test: gestures $GESTURES."
+[ "$GESTURES" = "$EXPECTED" ] || fail "expected the gestures $EXPECTED."
+
+# Every press and release runs its DOWN and UP handler, in order. The latency is reported in us.
+awk -v limit="$LATENCY_LIMIT_US" '
+	FILENAME == ARGV[1] { edges[++n] = $2; values[n] = $3 }
+	FILENAME == ARGV[2] && ($3 == "DOWN" || $3 == "UP") { actions[++m] = $2; names[m] = $3 }
+	END {
+		if (n != m)
+		{
+			printf "gpio-sim-test: FAIL: %d edges but %d DOWN and UP handlers.\n", n, m
+			exit 1
+		}
+		for (i = 1; i <= n; ++i)
+		{
+			if (names[i] != (values[i] ? "DOWN" : "UP"))
+			{
+				printf "gpio-sim-test: FAIL: edge %d to %d ran %s.\n", i, values[i], names[i]
+				exit 1
+			}
+			us = (actions[i] - edges[i]) / 1000
+			if (i == 1 || us < min)
+				min = us
+			if (i == 1 || us > max)
+				max = us
+			total += us
+		}
+		printf "gpio-sim-test: edge to dispatch latency of %d edges: min %.0f us, avg %.0f us, max %.0f us.\n",
+			n, min, total / n, max
+		if (limit > 0 && max > limit)
+		{
+			printf "gpio-sim-test: FAIL: the latency exceeds %d us.\n", limit
+			exit 1
+		}
+	}' "$WORK/edges" "$WORK/sorted" >&2 || exit 1
+
+echo "gpio-sim-test: PASS"
@@ -0,0 +1,137 @@
+/*
+ * inzown-btn-ctl, control client of the inzown-btn daemon.
+ * Copyright (C) 2023 Claude Warren, https://inzown.com
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; version 2 of the
+ * License.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include <errno.h>
+
+static const char *const DEFAULT_SOCKET_PATH = "/run/inzown-btn.ctl";
+
+enum { MAX_COMMAND_SIZE = 127 }; // The daemon's line limit.
+
+static void print_usage(void)
+{
+	printf("Usage: inzown-btn-ctl [--socket <path>] <command>\n"
+		"Sends a command to an inzown-btn started with --control-socket and prints the reply.\n"
+		"Options:\n"
+		"\t--socket <path>          The daemon's control socket. Default is /run/inzown-btn.ctl.\n"
+		"Commands:\n"
+		"\tstats                    Dump the metrics in the Prometheus text format.\n"
+		"\ttail                     Stream the classified actions, mode switches and store changes with their timestamps until\n"
+		"\t                           interrupted.\n"
+		"\tinject edge <0|1> [gpio] Classify a button release or press as if read from the GPIO, the first one by default.\n"
+		"\tinject <ACTION>          Dispatch an action, e.g. CLICK_2, HOLD_3S or CHORD_17+27_CLICK_1, skipping the\n"
+		"\t                           classification.\n"
+		"\tmode [<name>]            Print the current mode, or switch to another one.\n"
+		"\tkv                       List the key/value store.\n"
+		"\tkv get <key>             Print the value of a key.\n"
+		"\tkv set <key> <value>     Set a key.\n"
+		"\tkv del <key>             Remove a key.\n"
+		"\treload                   Reload the configuration.\n"
+		"\tlatency                  Print the spawn, handler runtime and action completion latencies.\n"
+		);
+}
+
+int main(int argc, char **argv)
+{
+	const char *path = DEFAULT_SOCKET_PATH;
+	int i = 1;
+
+	if (i < argc && strcmp(argv[i], "--help") == 0)
+	{
+		print_usage();
+		return 0;
+	}
+	if (i + 1 < argc && strcmp(argv[i], "--socket") == 0)
+	{
+		path = argv[i+1];
+		i += 2;
+	}
+	if (i == argc)
+	{
+		print_usage();
+		return 1;
+	}
+
+	// The command is the remaining arguments, separated by spaces.
+	char command[MAX_COMMAND_SIZE + 2];
+	size_t len = 0;
+	for (; i<argc; ++i)
+	{
+		size_t n = strlen(argv[i]);
+		if (len + n + 1 > MAX_COMMAND_SIZE)
+		{
+			fprintf(stderr, "The command is too long!\n");
+			return 1;
+		}
+		if (len != 0)
+			command[len++] = ' ';
+		memcpy(command + len, argv[i], n);
+		len += n;
+	}
+	command[len++] = '\n';
+	command[len] = '\0';
+
+	struct sockaddr_un addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	if (strlen(path) >= sizeof(addr.sun_path))
+	{
+		fprintf(stderr, "Socket path %s is too long!\n", path);
+		return 1;
+	}
+	strcpy(addr.sun_path, path);
+
+	int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (fd == -1)
+	{
+		fprintf(stderr, "Creating a socket failed. Error %d.\n", errno);
+		return 1;
+	}
+	if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0)
+	{
+		fprintf(stderr, "Connecting to %s failed. Error %d.\n", path, errno);
+		close(fd);
+		return 1;
+	}
+
+	if (write(fd, command, len) != (ssize_t)len)
+	{
+		fprintf(stderr, "Sending the command failed. Error %d.\n", errno);
+		close(fd);
+		return 1;
+	}
+
+	// The daemon closes the connection after its reply, or when tail's client goes away.
+	char buf[4096];
+	ssize_t n;
+	while ((n = read(fd, buf, sizeof(buf))) > 0 || (n == -1 && errno == EINTR))
+	{
+		if (n > 0 && write(STDOUT_FILENO, buf, n) != n)
+			break;
+	}
+
+	close(fd);
+	return n == 0 ? 0 : 1;
+}
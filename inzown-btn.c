@@ -21,13 +21,25 @@
  * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
  */
 
+#define _GNU_SOURCE
+
 #include <stdarg.h>
 #include <stdio.h>
 #include <stdbool.h>
 #include <stdint.h>
 #include <stdlib.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/inotify.h>
+#include <sys/wait.h>
+#include <sys/resource.h>
 #include <sys/timerfd.h>
+#include <sys/epoll.h>
+#include <sys/signalfd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/prctl.h>
+#include <sys/syscall.h>
 #include <fcntl.h>
 #include <unistd.h>
 #include <errno.h>
@@ -37,9 +49,146 @@
 #include <assert.h>
 #include <signal.h>
 #include <libgen.h>
+#include <dirent.h>
+#include <sched.h>
+#include <pthread.h>
+
+#include "inzownbtn.h"
+
+// USDT probes for perf and bpftrace, compiled in when sys/sdt.h (systemtap-sdt-dev) is available.
+// Every probe's first argument is the sequence number of the button edge the work belongs to.
+#if !defined(INZOWN_NO_USDT) && defined(__has_include)
+#  if __has_include(<sys/sdt.h>)
+#    include <sys/sdt.h>
+#    define INZOWN_HAVE_USDT 1
+#  endif
+#endif
+
+#ifdef INZOWN_HAVE_USDT
+#  define PROBE2(name, a, b)             STAP_PROBE2(inzown, name, a, b)
+#  define PROBE3(name, a, b, c)          STAP_PROBE3(inzown, name, a, b, c)
+#  define PROBE4(name, a, b, c, d)       STAP_PROBE4(inzown, name, a, b, c, d)
+#  define PROBE5(name, a, b, c, d, e)    STAP_PROBE5(inzown, name, a, b, c, d, e)
+#else
+#  define PROBE2(name, a, b)             do {} while (0)
+#  define PROBE3(name, a, b, c)          do {} while (0)
+#  define PROBE4(name, a, b, c, d)       do {} while (0)
+#  define PROBE5(name, a, b, c, d, e)    do {} while (0)
+#endif
+
+// Fault injection into the reads of the event loop and the spawns of the dispatcher, built by make fault.
+// INZOWN_FAULTS lists name=n pairs, e.g. "eintr=7,short=5,enomem=3", and every n-th eligible call fails that way:
+//   eintr, eagain  Reads and epoll_wait fail without touching the descriptor.
+//   short          Reads return at most one byte, timerfd reads excepted as those are never partial.
+//   enomem         vfork fails with ENOMEM.
+//   slow_exec      The handler sleeps FAULT_SLOW_EXEC_MS before its execve, holding up the vforked daemon.
+#ifdef INZOWN_FAULT_INJECTION
+enum fault_e { FAULT_EINTR, FAULT_EAGAIN, FAULT_SHORT, FAULT_ENOMEM, FAULT_SLOW_EXEC, FAULT_COUNT };
+
+static const char *const FAULT_NAMES[FAULT_COUNT] = { "eintr", "eagain", "short", "enomem", "slow_exec" };
+
+enum { FAULT_SLOW_EXEC_MS = 100 };
+
+struct fault
+{
+	unsigned int       every; // 0 if not injected.
+	unsigned long long calls;
+	unsigned long long injected;
+};
+
+static struct fault g_faults[FAULT_COUNT];
+
+static bool fault_hit(enum fault_e f)
+{
+	struct fault *fault = &g_faults[f];
+	if (fault->every == 0 || ++fault->calls % fault->every != 0)
+		return false;
+	++fault->injected;
+	return true;
+}
+
+static void fault_init(void)
+{
+	const char *spec = getenv("INZOWN_FAULTS");
+	while (spec != NULL && *spec != '\0')
+	{
+		int f;
+		size_t len = 0;
+		for (f=0; f<FAULT_COUNT; ++f)
+		{
+			len = strlen(FAULT_NAMES[f]);
+			if (strncmp(spec, FAULT_NAMES[f], len) == 0 && spec[len] == '=')
+				break;
+		}
+		if (f == FAULT_COUNT)
+		{
+			fprintf(stderr, "Unknown fault in INZOWN_FAULTS at '%s'!\n", spec);
+			break;
+		}
+
+		char *end;
+		g_faults[f].every = strtoul(spec + len + 1, &end, 10);
+		spec = *end == ',' ? end + 1 : end;
+	}
+}
+
+static void fault_report(void)
+{
+	int f;
+	for (f=0; f<FAULT_COUNT; ++f)
+	{
+		if (g_faults[f].every != 0)
+			printf("Injected %llu %s fault(s) in %llu call(s).\n", g_faults[f].injected, FAULT_NAMES[f], g_faults[f].calls);
+	}
+}
+
+static ssize_t fault_read(int fd, void *buf, size_t count, bool whole)
+{
+	if (fault_hit(FAULT_EINTR))
+	{
+		errno = EINTR;
+		return -1;
+	}
+	if (fault_hit(FAULT_EAGAIN))
+	{
+		errno = EAGAIN;
+		return -1;
+	}
+	if (!whole && count > 1 && fault_hit(FAULT_SHORT))
+		count = 1;
+	return read(fd, buf, count);
+}
+
+static int fault_epoll_wait(int epfd, struct epoll_event *events, int maxevents, int timeout)
+{
+	if (fault_hit(FAULT_EINTR))
+	{
+		errno = EINTR;
+		return -1;
+	}
+	return epoll_wait(epfd, events, maxevents, timeout);
+}
+
+static void fault_exec_delay(void)
+{
+	struct timespec ts = { 0, FAULT_SLOW_EXEC_MS * 1000000l };
+	nanosleep(&ts, NULL);
+}
 
-enum { CLICK_TIMEOUT_MS        = 400    };
-enum { HOLD_PRESS_TIMEOUT_MS   = CLICK_TIMEOUT_MS };
+// A macro, vfork can not return through a function of ours.
+#  define fault_vfork()                  (fault_hit(FAULT_ENOMEM) ? (errno = ENOMEM, -1) : vfork())
+#  define fault_slow_exec()              fault_hit(FAULT_SLOW_EXEC)
+#else
+#  define fault_init()                   do {} while (0)
+#  define fault_report()                 do {} while (0)
+#  define fault_read(fd, buf, count, whole) read(fd, buf, count)
+#  define fault_epoll_wait(epfd, events, maxevents, timeout) epoll_wait(epfd, events, maxevents, timeout)
+#  define fault_exec_delay()             do {} while (0)
+#  define fault_vfork()                  vfork()
+#  define fault_slow_exec()              false
+#endif
+
+enum { CLICK_TIMEOUT_MS        = INZOWN_BTN_CLICK_TIMEOUT_MS };
 
 enum PinActivation
 {
@@ -48,44 +197,68 @@ enum PinActivation
 	PA_ACTIVE_HIGH = 2
 };
 
-static int g_button_pin = 17;
+enum { MAX_BUTTONS = 8 }; // Bits of the pressed buttons mask.
+enum { MAX_CHORDS  = 4 };
+enum { MAX_GPIO_NUMBER = 9999 }; // As the library accepts.
+
+// The GPIOs of --gpio, by button index.
+static int g_button_pins[MAX_BUTTONS] = { 17 };
+static unsigned int g_button_count = 1;
 static enum PinActivation g_pin_activation = PA_UNSPECIFIED;
-static bool g_button_exported = false;
+static unsigned int g_buttons_exported = 0; // Bit per button.
 
 enum action_e
 {
-	A_DOWN = 0, // Executed every time the button is pushed down.
-	A_UP,       // Executed every time the button is released up.
-	A_CLICK,    // Executed when the button is short-clicked one or multiple times in quick succession.
-	A_HOLD,     // Executed if the button was held for given time.
+	A_DOWN  = INZOWN_BTN_DOWN,  // Executed every time the button is pushed down.
+	A_UP    = INZOWN_BTN_UP,    // Executed every time the button is released up.
+	A_CLICK = INZOWN_BTN_CLICK, // Executed when the button is short-clicked one or multiple times in quick succession.
+	A_HOLD  = INZOWN_BTN_HOLD,  // Executed if the button was held for given time.
 
 	// Must be the last one!
 	A_COUNT
 };
 
-static const char *const DOWN_VALUE_NAME           = "DOWN";
-static const char *const UP_VALUE_NAME             = "UP";
+static const char *const DOWN_VALUE_NAME           = INZOWN_BTN_DOWN_NAME;
+static const char *const UP_VALUE_NAME             = INZOWN_BTN_UP_NAME;
 
-static const char *const CLICK_NAME="CLICK_%u";
-static const char *const CLICK_OTHER_VALUE_NAME    = "CLICK_OTHER";
+static const char *const CLICK_NAME                = INZOWN_BTN_CLICK_NAME;
+static const char *const CLICK_OTHER_VALUE_NAME    = INZOWN_BTN_CLICK_OTHER_NAME;
 
-static const char *const HOLD_NAME="HOLD_%uS";
-static const char *const HOLD_OTHER_VALUE_NAME     = "HOLD_OTHER";
+static const char *const HOLD_NAME                 = INZOWN_BTN_HOLD_NAME;
+static const char *const HOLD_OTHER_VALUE_NAME     = INZOWN_BTN_HOLD_OTHER_NAME;
 
 static const char *const CLICK_COUNT_LIMIT_VALUE_NAME = "CLICK_COUNT_LIMIT";
+static const char *const HIGH_LANE_LIMIT_VALUE_NAME   = "HIGH_LANE_LIMIT";
+static const char *const LOW_LANE_LIMIT_VALUE_NAME    = "LOW_LANE_LIMIT";
+static const char *const CHORD_WINDOW_MS_VALUE_NAME   = "CHORD_WINDOW_MS";
 
 
 // Arbitrarily chosen limit.
 enum { MAX_PATH_LENGTH = 4096 };
 
 static char g_config_path[MAX_PATH_LENGTH+1]  = "/etc/inzown/button.conf";
+// The fragments, whatever the configuration file. The packaged service's file is next to the directory.
+static char g_config_dir_path[MAX_PATH_LENGTH+1] = "/etc/inzown/button/conf.d";
+
+enum { MAX_KV_KEYS    = 32 };
+enum { MAX_KV_EXPORTS = 8 };
+enum { KV_KEY_SIZE    = 31 };
+enum { KV_VALUE_SIZE  = 63 };
+
+enum { MAX_PROBES = 16 };
+
+enum { MAX_CANCEL_RULES = 16 };
 
-// must hold the CLICK_OTHER_VALUE_NAME or HOLD_OTHER_VALUE_NAME values
-#define ACTION_NAME_SIZE 11
-// printf( CLICK_%u", ABSOLUTE_MAX_CLICK) must fit in ACTION_NAME_SIZE
-#define ABSOLUTE_MAX_CLICK 99
-// printf( HOLD_%uS", ABSOLUTE_MAX_HOLD) must fit in ACTION_NAME_SIZE
-#define ABSOLUTE_MAX_HOLD 99
+enum { MAX_MODES = 8 };
+enum { MODE_NAME_SIZE = 31 };
+static const char *const DEFAULT_MODE_NAME = "default";
+
+// "CHORD_" and the GPIOs of a chord joined by '+', up to four digits each, and the '_' before the action name.
+#define CHORD_PREFIX_SIZE (6 + 5 * MAX_BUTTONS)
+// must hold the CLICK_OTHER_VALUE_NAME or HOLD_OTHER_VALUE_NAME values, prefixed for chords
+#define ACTION_NAME_SIZE (CHORD_PREFIX_SIZE + INZOWN_BTN_ACTION_NAME_SIZE)
+#define ABSOLUTE_MAX_CLICK INZOWN_BTN_MAX_CLICK
+#define ABSOLUTE_MAX_HOLD INZOWN_BTN_MAX_HOLD
 // convert ticks to seconds based on global options g_full_time and g_centered_time
 #define TICK_2_SECONDS(x) seconds(x)
 
@@ -95,30 +268,13 @@ static bool g_offset_time = false;
 
 // converts ticks to seconds
 static int seconds( int ticks ) {
-
-	int result;
-
-	if (g_offset_time)  {
-		if (g_full_time) {  // f+o+
-			result = (ticks+500)/1000;
-
-		} else {		// f-o+
-			int sec = (ticks)/1000;
-			result = sec+((sec+1)%2);
-		}
-	} else {
-		if (g_full_time) { // f+o-
-			result = ticks/1000;
-		} else {		// f-o-
-			result = 1+( ((ticks-1000)/2000)* 2);
-		}
-	}
-	return result;
+	return inzown_btn_hold_seconds(ticks, (g_full_time ? INZOWN_BTN_FULL_TIME : 0) | (g_offset_time ? INZOWN_BTN_OFFSET_TIME : 0));
 }
 
 enum { DEFAULT_CLICK_COUNT_LIMIT = 8 };
 
 static unsigned int g_click_count_limit = DEFAULT_CLICK_COUNT_LIMIT;
+static bool g_click_count_limit_specified = false;
 static unsigned int g_debug = 1;
 
 static void debug( unsigned int level, const char *fmt, ...)
@@ -131,707 +287,4907 @@ static void debug( unsigned int level, const char *fmt, ...)
 	}
 }
 
+typedef unsigned long long timestamp_ms_t;
+typedef unsigned long long timestamp_ns_t;
 
-// Reads a line, truncates it if needed, seeks to the next line.
-static bool read_line(FILE *f, char *buffer, size_t n)
-{
-	memset(buffer, 0, n);
+// CLOCK_BOOTTIME with --suspend-safe, so that click and hold durations include time spent suspended.
+static clockid_t g_clock = CLOCK_MONOTONIC;
 
-	if (fgets(buffer, n, f) == NULL)
-		return false;
+static timestamp_ns_t get_timestamp_ns(void)
+{
+	struct timespec tp;
+	clock_gettime(g_clock, &tp);
+	return tp.tv_sec * 1000000000ull + tp.tv_nsec;
+}
 
-	if (buffer[n-2] != '\0' && buffer[n-2] != '\n')
-	{
-		// Whole line didn't fit into the buffer, seek until next line.
-		while (!feof(f))
-		{
-			int c = fgetc(f);
-			if (c == '\n')
-				break;
-		}
-	}
+static timestamp_ms_t get_timestamp_ms(void)
+{
+	return get_timestamp_ns() / 1000000;
+}
 
-	return true;
+// Starts fn in a thread with every signal blocked, so that they keep being delivered to the event loop.
+static int start_thread(pthread_t *thread, void *(*fn)(void *))
+{
+	sigset_t all, saved;
+	sigfillset(&all);
+	pthread_sigmask(SIG_SETMASK, &all, &saved);
+	int err = pthread_create(thread, NULL, fn, NULL);
+	pthread_sigmask(SIG_SETMASK, &saved, NULL);
+	return err;
 }
 
-static void read_config_value(const char *conf, const char *value_name, char *dst, char *args, size_t n, const char *default_value)
+// Trace Event Format output for --trace-out, loadable in chrome://tracing and Perfetto. The event loop
+// only formats events into the active buffer, a writer thread swaps the buffers and writes the full one.
+enum { TRACE_BUFFER_SIZE    = 64 * 1024 };
+enum { TRACE_FLUSH_SIZE     = TRACE_BUFFER_SIZE / 2 };
+enum { TRACE_FLUSH_INTERVAL = 1 }; // Seconds a partially filled buffer may wait for the writer.
+enum { TRACE_EVENT_SIZE     = 1024 };
+enum { TRACE_TIMER_SLACK_NS = 250000000 }; // The flush interval is not critical, let the kernel batch it.
+
+struct trace
 {
-	const size_t BUFFER_SIZE = 2 * MAX_PATH_LENGTH + 1;
-	char line[BUFFER_SIZE];
-	char name[BUFFER_SIZE];
-	char argument[BUFFER_SIZE];
-	char value[BUFFER_SIZE];
+	int                fd;         // -1 if tracing is off.
+	pid_t              pid;
+	pthread_t          thread;
+	pthread_mutex_t    lock;
+	pthread_cond_t     cond;
+	char               buffer[2][TRACE_BUFFER_SIZE];
+	size_t             length[2];
+	int                active;     // Buffer being appended to, the writer owns the other one.
+	bool               closing;
+	unsigned long long events;
+	unsigned long long dropped;
+};
 
-	size_t currentLine = 0;
+static struct trace g_trace = { .fd = -1, .lock = PTHREAD_MUTEX_INITIALIZER, .cond = PTHREAD_COND_INITIALIZER };
 
-	bool found = false;
+static bool trace_enabled(void)
+{
+	return g_trace.fd != -1;
+}
 
-	FILE *f = fopen(conf, "rt");
+static void *trace_writer(void *arg)
+{
+	(void)arg;
+	prctl(PR_SET_TIMERSLACK, TRACE_TIMER_SLACK_NS);
 
-	while (f && !feof(f))
+	pthread_mutex_lock(&g_trace.lock);
+	for (;;)
 	{
-		if (read_line(f, line, BUFFER_SIZE))
+		int i = g_trace.active;
+		if (g_trace.length[i] == 0)
 		{
-			++currentLine;
-
-			argument[0] = '\0';
-			value[0] = '\0';
-
-			char *commentMarker = strchr(line, '#');
-			if (commentMarker)
-				*commentMarker = '\0'; // Ignore comments.
-
-			char *endline = strchr(line, '\n');
-			if (endline)
-				*endline = '\0'; // Ignore endline.
+			if (g_trace.closing)
+				break;
+			pthread_cond_wait(&g_trace.cond, &g_trace.lock);
+			continue;
+		}
 
-			static const char *WHITESPACE_CHARS = " \t";
+		if (!g_trace.closing && g_trace.length[i] < TRACE_FLUSH_SIZE)
+		{
+			struct timespec deadline;
+			clock_gettime(CLOCK_REALTIME, &deadline);
+			deadline.tv_sec += TRACE_FLUSH_INTERVAL;
+			if (pthread_cond_timedwait(&g_trace.cond, &g_trace.lock, &deadline) != ETIMEDOUT)
+				continue;
+		}
 
-			// remove leading spaces
-			char *p = line + strspn(line, WHITESPACE_CHARS);
+		g_trace.active = !i;
+		pthread_mutex_unlock(&g_trace.lock);
 
-			if (strlen(p) > 1)
+		size_t written = 0;
+		while (written < g_trace.length[i])
+		{
+			ssize_t n = write(g_trace.fd, g_trace.buffer[i] + written, g_trace.length[i] - written);
+			if (n < 0)
 			{
-				char *t = strpbrk(p, WHITESPACE_CHARS);
-
-				// if there is whitespace after the name there may be a value
-				if (t)
-				{
-					strncpy(name, p, t - p);
-					name[t - p] = '\0';
-
-
-					t = t + strspn(t, WHITESPACE_CHARS);
-
-					if (args)
-					{
-						char *a1 = strpbrk(t, WHITESPACE_CHARS);
-						if (a1)
-						{
-							char *a2 = a1 + strspn(a1, WHITESPACE_CHARS);
-							if (a2)
-							{
-								strcpy(argument, a2);
-							}
-							*a1 = '\0';
-						}
-					}
-
-					strcpy(value, t);
-				} else {
-					strncpy(name, p, BUFFER_SIZE);
-				}
-				if (strlen(name) != 0)
-				{
-					if (strcmp(name, value_name) == 0)
-					{
-						debug( 4, "read_config_value located name %s\n", name );
-						size_t lenValue = strlen(value);
-						size_t lenArgs = strlen(argument);
-						if (lenValue < n && lenArgs < n)
-						{
-							found = true;
-
-							strncpy(dst, value, lenValue);
-							dst[lenValue] = '\0';
-
-							if (args)
-							{
-								strncpy(args, argument, lenArgs);
-								args[lenArgs] = '\0';
-							}
-							break;
-						}
-						else
-						{
-							fprintf(stderr, "Too long value set in %s on line %lu!\n", conf, currentLine);
-						}
-					}
-				}
-				else
-				{
-					fprintf(stderr, "Unexpected syntax in %s on line %lu!\n", conf, currentLine);
-				}
+				if (errno == EINTR)
+					continue;
+				fprintf(stderr, "Writing the trace failed. Error %d.\n", errno);
+				break;
 			}
+			written += n;
 		}
-	}
-
-	if (f)
-		fclose(f);
 
-	if (!found)
-	{
-		debug( 4, "read_config_value did not find name %s\n", value_name );
-		strcpy(dst, default_value);
-		if (args)
-			*args = '\0';
+		pthread_mutex_lock(&g_trace.lock);
+		g_trace.length[i] = 0;
 	}
+	pthread_mutex_unlock(&g_trace.lock);
+	return NULL;
 }
 
-static int get_action_name(enum action_e action, char * action_name, unsigned click_count, unsigned hold_time)
+// Appends one event. Never blocks on the file, the event is dropped if the writer fell behind.
+static void trace_append(const char *event, size_t n)
 {
-	memset( action_name, 0, ACTION_NAME_SIZE+1 );
-	switch (action)
+	pthread_mutex_lock(&g_trace.lock);
+	int i = g_trace.active;
+	if (g_trace.length[i] + n + 2 > TRACE_BUFFER_SIZE)
 	{
-	case A_DOWN:
-		strcpy( action_name,  DOWN_VALUE_NAME );
-		break;
-	case A_UP:
-		strcpy( action_name,  UP_VALUE_NAME);
-		break;
-	case A_CLICK:
-		strcpy( action_name,  CLICK_NAME);
-		if (click_count <= ABSOLUTE_MAX_CLICK)
-		{
-			sprintf( action_name, CLICK_NAME, click_count );
-		} else {
-			strcpy( action_name, CLICK_OTHER_VALUE_NAME );
-		}
-		break;
-	case A_HOLD:
-		strcpy( action_name, HOLD_NAME);
-		unsigned timer = TICK_2_SECONDS(hold_time);
-		if (timer <= ABSOLUTE_MAX_HOLD)
+		++g_trace.dropped;
+	}
+	else
+	{
+		char *dst = g_trace.buffer[i] + g_trace.length[i];
+		if (g_trace.events++ != 0)
 		{
-			sprintf( action_name, HOLD_NAME, timer );
-		} else {
-			strcpy( action_name, HOLD_OTHER_VALUE_NAME );
+			memcpy(dst, ",\n", 2);
+			dst += 2;
+			g_trace.length[i] += 2;
 		}
-		break;
-	default:
-		break;
+		memcpy(dst, event, n);
+		g_trace.length[i] += n;
+		if (g_trace.length[i] >= TRACE_FLUSH_SIZE)
+			pthread_cond_signal(&g_trace.cond);
 	}
-	debug(3, "action %u click count %u hold time %u (%u seconds) yields action name %s\n", action, click_count, hold_time, TICK_2_SECONDS(hold_time), action_name );
-	return 0;
+	pthread_mutex_unlock(&g_trace.lock);
 }
 
-/*
- * buff_length is the buffer length available for input, (actual length -1 )
- */
-static void get_action_script(enum action_e action, char* action_name, char *buffer, char* args, unsigned int buff_length)
+static void trace_printf(const char *fmt, ...)
 {
-	if (action_name[0] == '\0')
+	char event[TRACE_EVENT_SIZE];
+	va_list argp;
+	va_start(argp, fmt);
+	int n = vsnprintf(event, sizeof(event), fmt, argp);
+	va_end(argp);
+
+	if (n < 0 || n >= (int)sizeof(event))
 	{
-		buffer[0] = '\0';
+		++g_trace.dropped;
+		return;
 	}
-	read_config_value(g_config_path, action_name, buffer, args, buff_length, "#");
-	debug( 2, "read_config_value returned %s\n", buffer );
-	// if buffer[0] == '#' then the entry did not exist in the config file.
-	if (buffer[0] == '#')// entry was not specified -- use defaults.
+	trace_append(event, n);
+}
+
+// Copies src into dst as the contents of a JSON string, truncating it to fit.
+static const char *trace_escape(char *dst, size_t n, const char *src, size_t len)
+{
+	static const char HEX[] = "0123456789abcdef";
+	size_t j = 0;
+	size_t i;
+	for (i=0; i<len && j+7 < n; ++i)
 	{
-		buffer[buff_length] = 0;
-		bool found = false;
-		switch (action)
+		unsigned char c = src[i];
+		if (c == '"' || c == '\\')
 		{
-		case A_CLICK:
-			read_config_value(g_config_path, CLICK_OTHER_VALUE_NAME, buffer, args, buff_length, "#");
-			break;
-		case A_HOLD:
-			read_config_value(g_config_path, HOLD_OTHER_VALUE_NAME, buffer, args, buff_length, "#");
-		break;
-		default:
-			break;
+			dst[j++] = '\\';
+			dst[j++] = c;
+		}
+		else if (c < 0x20)
+		{
+			memcpy(dst + j, "\\u00", 4);
+			dst[j+4] = HEX[c >> 4];
+			dst[j+5] = HEX[c & 0xf];
+			j += 6;
+		}
+		else
+		{
+			dst[j++] = c;
 		}
 	}
-	// if there is a # at this point entry existed in the config file but had no value
-	if (buffer[0] == '#' ) {
-		buffer[0] = '\0';
-	}
+	dst[j] = '\0';
+	return dst;
 }
 
-// length of command or an error (negative number).
-static int get_action_script_path(enum action_e action, char * action_name, unsigned click_count, unsigned hold_time, char *script, char *args, size_t n)
-{
-	if (action < 0 || action >= A_COUNT) {
-		return -EINVAL;
-	}
+// Trace timestamps are microseconds, printed with "%llu.%03u".
+#define TRACE_US(ns) (ns) / 1000, (unsigned int)((ns) % 1000)
 
-	get_action_name(action, action_name, click_count, hold_time);
-	if (action_name[0] == '\0')
-	{
-		return -EINVAL;
-	}
+// A slice on the tid track, tid 0 being the event loop.
+static void trace_complete(const char *name, pid_t tid, timestamp_ns_t start, timestamp_ns_t end, unsigned long long seq)
+{
+	trace_printf("{\"name\":\"%s\",\"cat\":\"inzown\",\"ph\":\"X\",\"pid\":%d,\"tid\":%d,\"ts\":%llu.%03u,\"dur\":%llu.%03u,\"args\":{\"seq\":%llu}}",
+		name, g_trace.pid, tid ? tid : g_trace.pid, TRACE_US(start), TRACE_US(end - start), seq);
+}
 
-	char action_script[MAX_PATH_LENGTH + 1];
-	char arguments[MAX_PATH_LENGTH + 1];
+static void trace_instant(const char *name, pid_t tid, timestamp_ns_t ts, const char *text, size_t len)
+{
+	char escaped[TRACE_EVENT_SIZE / 2];
+	trace_printf("{\"name\":\"%s\",\"cat\":\"inzown\",\"ph\":\"i\",\"s\":\"t\",\"pid\":%d,\"tid\":%d,\"ts\":%llu.%03u,\"args\":{\"text\":\"%s\"}}",
+		name, g_trace.pid, tid, TRACE_US(ts), trace_escape(escaped, sizeof(escaped), text, len));
+}
 
-	get_action_script(action, action_name, action_script, arguments, MAX_PATH_LENGTH );
+// An async span of its own track, covering a whole button event.
+static void trace_span(const char *name, unsigned long long id, timestamp_ns_t start, timestamp_ns_t end, unsigned long long seq)
+{
+	trace_printf("{\"name\":\"%s\",\"cat\":\"event\",\"ph\":\"b\",\"id\":%llu,\"pid\":%d,\"tid\":%d,\"ts\":%llu.%03u,\"args\":{\"seq\":%llu}}",
+		name, id, g_trace.pid, g_trace.pid, TRACE_US(start), seq);
+	trace_printf("{\"name\":\"%s\",\"cat\":\"event\",\"ph\":\"e\",\"id\":%llu,\"pid\":%d,\"tid\":%d,\"ts\":%llu.%03u}",
+		name, id, g_trace.pid, g_trace.pid, TRACE_US(end));
+}
 
-	debug(1, "script = '%s', args = '%s'\n", action_script, arguments);
+static void trace_thread_name(pid_t tid, const char *name, size_t len)
+{
+	char escaped[TRACE_EVENT_SIZE / 2];
+	trace_printf("{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%d,\"tid\":%d,\"args\":{\"name\":\"%s\"}}",
+		g_trace.pid, tid, trace_escape(escaped, sizeof(escaped), name, len));
+}
 
-	if (action_script[0] == '\0')
+static int trace_open(const char *path)
+{
+	int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if (fd == -1)
 	{
-		return 0;
+		fprintf(stderr, "Opening trace file %s failed. Error %d.\n", path, errno);
+		return -1;
 	}
-	// The path is absolute.
-	if (action_script[0] == '/')
+
+	if (write(fd, "[\n", 2) != 2)
 	{
-		strncpy(script, action_script, n-2);
-		script[n-1] = '\0';
+		fprintf(stderr, "Writing trace file %s failed. Error %d.\n", path, errno);
+		close(fd);
+		return -1;
 	}
-	else // The path is relative to the config file location.
-	{
-		char tmp[MAX_PATH_LENGTH + 1];
 
-		size_t pathLength = strlen(g_config_path);
-		strncpy(tmp, g_config_path, sizeof(tmp)-1);
-		dirname(tmp);
-		strncat(tmp, "/", sizeof(tmp)-1 - strlen(tmp));
-		strncat(tmp, action_script, sizeof(tmp)-1 - strlen(tmp));
-		tmp[sizeof(tmp)-1] = '\0';
+	g_trace.fd = fd;
+	g_trace.pid = getpid();
 
-		strncpy(script, tmp, n-1);
-		script[n-1] = '\0';
+	int err = start_thread(&g_trace.thread, &trace_writer);
+	if (err != 0)
+	{
+		fprintf(stderr, "Starting the trace writer failed. Error %d.\n", err);
+		g_trace.fd = -1;
+		close(fd);
+		return -1;
 	}
 
-	strncpy(args, arguments, n-1);
-	args[n-1] = '\0';
-
-	return strlen(script);
+	trace_printf("{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":%d,\"args\":{\"name\":\"inzown-btn\"}}", g_trace.pid);
+	trace_thread_name(g_trace.pid, "event loop", 10);
+	return 0;
 }
 
-static void execute_action(enum action_e action, unsigned click_count, unsigned hold_time)
+// Flushes the buffers and terminates the JSON array. Runs from the atexit cleanup, which cannot interrupt a
+// trace_append: signals are read from the signalfd and the children leave with _exit.
+static void trace_close(void)
 {
-	char cmd[MAX_PATH_LENGTH + 64];
-	char arg[MAX_PATH_LENGTH + 64];
-	char action_name[ ACTION_NAME_SIZE+1 ];
-	int n = get_action_script_path(action, action_name, click_count, hold_time, cmd, arg, sizeof(cmd));
-	if (n < 0)
-	{
-		debug(1, "execute_action: getting script path for action %u click count %u hold time %u (%u seconds) resulted in error %d!\n", action, click_count, hold_time, TICK_2_SECONDS(hold_time), n);
+	if (!trace_enabled())
 		return;
-	}
 
-	if (n == 0)
-	{
-		debug(1, "execute_action: no command for action %s : click count %u hold time %u (%u seconds)\n", action_name, click_count, hold_time, TICK_2_SECONDS(hold_time));
-		return;
-	}
-	debug(2, "execute_action: action %u click count %u hold time %u (%u seconds)\ncmd %s\nargs %s\n", action, click_count, hold_time, TICK_2_SECONDS(hold_time), cmd, arg);
-	char *p = cmd + n;
-	size_t remainingSpace = sizeof(cmd) - n + 1;
-	int result = 0;
+	pthread_mutex_lock(&g_trace.lock);
+	g_trace.closing = true;
+	pthread_cond_signal(&g_trace.cond);
+	pthread_mutex_unlock(&g_trace.lock);
+	pthread_join(g_trace.thread, NULL);
 
-	switch (action)
-	{
-	case A_CLICK:
-		if (strlen(arg) == 0) result = snprintf(p, remainingSpace, " %u", click_count);
-		else result = snprintf(p, remainingSpace, " %s", arg);
-		break;
-	case A_HOLD:
-		if (strlen(arg) == 0) result = snprintf(p, remainingSpace, " %u %u", click_count, hold_time);
-		else result = snprintf(p, remainingSpace, " %s", arg);
-		break;
-	default:
-		break;
-	}
+	if (write(g_trace.fd, "\n]\n", 3) != 3)
+		fprintf(stderr, "Writing the trace failed. Error %d.\n", errno);
+	close(g_trace.fd);
+	g_trace.fd = -1;
 
-	if (result < 0 || result >= remainingSpace)
-	{
-		fprintf(stderr, "execute_action: failed setting up arguments for action %u, result: %d!\n", action, result);
-		return;
-	}
-	debug(2, "execute_action: executing %s\n", cmd );
-	system(cmd);
+	if (g_trace.dropped != 0)
+		debug(1, "Dropped %llu trace event(s).\n", g_trace.dropped);
 }
 
-static int gpio_is_pin_valid(int pin)
+
+// A run of characters inside the buffer a configuration file was read into. Not NUL terminated.
+struct slice
 {
-	return pin >= 0 && pin < 100;
-}
+	const char *ptr;
+	size_t      len;
+};
 
-enum edge_e
+// Index of every name the configuration file may define.
+enum config_slot_e
 {
-	E_NONE    = 0,
-	E_RISING  = 1,
-	E_FALLING = 2,
-	E_BOTH    = 3,
+	CS_DOWN = 0,
+	CS_UP,
+	CS_CLICK_0,
+	CS_CLICK_OTHER = CS_CLICK_0 + ABSOLUTE_MAX_CLICK + 1,
+	CS_HOLD_0,
+	CS_HOLD_OTHER = CS_HOLD_0 + ABSOLUTE_MAX_HOLD + 1,
+	CS_ACTION_COUNT,
+	// The same actions of every chord, chord c's at CS_CHORD_0 + c * CS_ACTION_COUNT.
+	CS_CHORD_0 = CS_ACTION_COUNT,
+	CS_CLICK_COUNT_LIMIT = CS_CHORD_0 + MAX_CHORDS * CS_ACTION_COUNT,
+	CS_HIGH_LANE_LIMIT,
+	CS_LOW_LANE_LIMIT,
+	CS_CHORD_WINDOW_MS,
+
+	// Must be the last one!
+	CS_COUNT
 };
 
-// Returns negative value on error, 0 if the pin is already exported, 1 if pin was just exported successfully.
-static int gpio_export(int pin)
+// Placeholders that may appear in the arguments, expanded for every event.
+enum template_slot_e
 {
-	if (!gpio_is_pin_valid(pin))
-	{
-		fprintf(stderr, "Invalid pin number %d!\n", pin);
-		return -1;
-	}
+	TS_LITERAL = 0,
+	TS_CLICKS,      // {clicks}  number of clicks.
+	TS_HOLD_MS,     // {hold_ms} milliseconds the button was held.
+	TS_HOLD_S,      // {hold_s}  hold time in reported seconds, as in HOLD_%uS.
+	TS_TS,          // {ts}      CLOCK_MONOTONIC timestamp of the event in milliseconds.
+	TS_BUTTON,      // {button}  GPIO number of the button.
+	TS_SEQ,         // {seq}     sequence number of the button edge that led to the event.
 
-	char gpio[64];
+	// Must be the last one!
+	TS_COUNT
+};
 
-	snprintf(gpio, sizeof(gpio), "/sys/class/gpio/gpio%d", pin);
+static const char *const TEMPLATE_SLOT_NAMES[TS_COUNT] =
+{
+	NULL,
+	"clicks",
+	"hold_ms",
+	"hold_s",
+	"ts",
+	"button",
+	"seq",
+};
 
-	struct stat s;
-	if (stat(gpio, &s) != 0)
-	{
-		int fd = open("/sys/class/gpio/export", O_WRONLY);
-		if (fd == -1)
-		{
-			fprintf(stderr, "Failed top open /sys/class/gpio/export!\n");
-			return -1;
-		}
-		char str_pin[4];
-		snprintf(str_pin, 3, "%d", pin);
-		str_pin[3] = '\0';
-		const int n = strlen(str_pin)+1;
-		int result = write(fd, str_pin, n);
-		if (result != n)
-		{
-			fprintf(stderr, "Failed writing to /sys/class/gpio/export! Error %d.\n",  errno);
-			close(fd);
-			return -1;
-		}
-		result = close(fd);
-		if (result != 0)
-		{
-			fprintf(stderr, "Failed closing /sys/class/gpio/export! Error %d.\n", errno);
-			return -1;
-		}
-		// Give some time for the pin to appear.
-		usleep(100000);
-		return 1;
-	}
+// Arguments used when CLICK_* and HOLD_* entries specify none.
+static const char *const DEFAULT_CLICK_ARGS = "{clicks}";
+static const char *const DEFAULT_HOLD_ARGS  = "{clicks} {hold_ms}";
 
-	// Already exported.
-	return 0;
-}
+struct template_segment
+{
+	enum template_slot_e slot;
+	struct slice         literal; // Only for TS_LITERAL.
+};
 
-static int gpio_unexport(int pin)
+// Handlers are started in one of two lanes, each with its own concurrency budget and queue.
+// Queued high lane handlers are always started first, low lane handlers run with SCHED_IDLE.
+enum lane_e
 {
-	if (!gpio_is_pin_valid(pin))
-	{
-		fprintf(stderr, "Invalid pin number %d!\n", pin);
-		return -1;
-	}
+	LANE_HIGH = 0, // @high: the default for DOWN and UP, which drive immediate feedback.
+	LANE_LOW,      // @low: the default for CLICK_* and HOLD_*.
 
-	char gpio[64];
+	// Must be the last one!
+	LANE_COUNT
+};
 
-	snprintf(gpio, sizeof(gpio), "/sys/class/gpio/gpio%d", pin);
+enum { DEFAULT_HIGH_LANE_LIMIT = 8 };
+enum { DEFAULT_LOW_LANE_LIMIT  = 2 };
 
-	struct stat s;
-	if (stat(gpio, &s) == 0)
-	{
-		int fd = open("/sys/class/gpio/unexport", O_WRONLY);
-		if (fd == -1)
-		{
-			fprintf(stderr, "Failed top open /sys/class/gpio/unexport!\n");
-			return -1;
-		}
-		char str_pin[4];
-		snprintf(str_pin, 3, "%d", pin);
-		str_pin[3] = '\0';
-		const int n = strlen(str_pin)+1;
-		int result = write(fd, str_pin, n);
-		if (result != n)
-		{
-			fprintf(stderr, "Failed writing to /sys/class/gpio/unexport! Error %d.\n",  errno);
-			close(fd);
-			return -1;
-		}
-		result = close(fd);
-		if (result != 0)
-		{
-			fprintf(stderr, "Failed closing /sys/class/gpio/unexport! Error %d.\n", errno);
-			return -1;
-		}
-		return 0;
-	}
+// Handlers of the lane allowed to run at the same time, 0 for no limit.
+static unsigned int g_lane_limit[LANE_COUNT] = { DEFAULT_HIGH_LANE_LIMIT, DEFAULT_LOW_LANE_LIMIT };
 
-	// Already unexported.
-	return 0;
-}
+enum concurrency_e
+{
+	CC_PARALLEL = 0, // @parallel: start a new instance even if earlier ones are still running.
+	CC_SINGLE,       // @single: skip the event while an earlier instance is still running.
+};
 
-static int gpio_set_edge(int pin, enum edge_e edge)
+// Handlers run by the daemon itself, named by a value starting with ':'.
+enum builtin_e
 {
-	if (!gpio_is_pin_valid(pin))
-	{
-		fprintf(stderr, "Invalid pin number %d!\n", pin);
-		return -1;
-	}
+	BUILTIN_NONE = 0,
+	BUILTIN_MODE,          // :mode <name> switches to the mode.
+	BUILTIN_SET,           // :set <key> <value> sets a key of the store.
+	BUILTIN_TOGGLE,        // :toggle <key> flips a key between 0 and 1.
+	BUILTIN_INCR,          // :incr <key> [<n>] adds n, 1 by default, to a key.
+};
 
-	char gpio[64];
+// @if [!]<kind>:<arg> options of a handler, all of which have to hold for it to run.
+enum condition_e
+{
+	COND_MODE = 0, // mode:<name>, the current mode.
+	COND_KV,       // kv:<key> set to anything but "" and 0, kv:<key>=<value> set to the value.
+	COND_EXISTS,   // exists:<path>, the file exists.
+	COND_RUNNING,  // running:<pidfile>, the process of the pid file is alive.
+};
 
-	snprintf(gpio, sizeof(gpio), "/sys/class/gpio/gpio%d/edge", pin);
+enum { MAX_HANDLER_CONDITIONS = 4 };
 
-	int fd = open(gpio, O_WRONLY);
-	if (fd == -1)
-	{
-		fprintf(stderr, "Failed to open %s! Error %d.\n", gpio, errno);
-		return -1;
-	}
+struct config_condition
+{
+	enum condition_e kind;
+	bool             negate;
+	struct slice     arg;   // The key or path.
+	struct slice     value; // COND_KV's value, NULL ptr for any.
+	unsigned int     mode;  // COND_MODE's mode.
+	int              probe; // COND_EXISTS and COND_RUNNING's cached result, see probes_bind.
+};
 
-	static const char *const edge2str[] =
+// One command of an action. An action may list several, all started for every event.
+struct config_handler
+{
+	struct slice value;    // The script to run.
+	struct slice args;     // Everything following the script on the line.
+	unsigned int template_first; // Compiled args, index into the segments of the config.
+	unsigned int template_count;
+	enum concurrency_e concurrency;
+	enum lane_e  lane;
+	enum builtin_e builtin;
+	unsigned int mode;     // BUILTIN_MODE's mode.
+	struct slice key;      // The key of the store's built-ins, their value or increment in args.
+	unsigned int condition_first; // Index into the conditions of the config.
+	unsigned int condition_count;
+	int          next;     // The entry's next handler, -1 if this is the last one.
+	unsigned int line;
+	unsigned long long identity; // Of its mode, name, position and command, the same across reloads, for @single.
+};
+
+struct config_entry
+{
+	struct slice value;    // Value of the first definition.
+	int          first_handler; // Index into the handlers of the config, -1 if none.
+	int          last_handler;
+	unsigned int handler_count;
+	unsigned int builtin_count; // Handlers of handler_count the daemon runs itself.
+	unsigned int file;     // Index of the file the entry was defined in.
+	unsigned int line;     // Line the entry was defined on, 0 if not defined.
+};
+
+struct config_file
+{
+	char   *path;
+	char   *data;          // A copy of the file, NULL if it is empty or missing.
+	size_t  size;
+};
+
+// Buttons pressed together within CHORD_WINDOW_MS, named by a CHORD_<gpio>+<gpio>..._<ACTION> entry.
+struct config_chord
+{
+	int          pins[MAX_BUTTONS]; // Ascending.
+	unsigned int pin_count;
+	char         prefix[CHORD_PREFIX_SIZE + 1]; // The canonical "CHORD_17+27_".
+};
+
+// CANCEL <trigger> <target>...: an action of the trigger range terminates the running handlers of the target
+// range's actions and drops their queued ones. Ranges are of action slots, CS_DOWN to CS_HOLD_OTHER, matching the
+// same actions of the buttons and every chord.
+struct config_cancel
+{
+	int trigger_first;
+	int trigger_last;
+	int target_first;
+	int target_last;
+};
+
+// A [name] section of the configuration, with its own table of the actions. The actions it does not set fall
+// back to the default mode's, which holds the entries outside of any section.
+struct config_mode
+{
+	char                 name[MODE_NAME_SIZE + 1];
+	struct config_entry *entries; // CS_CLICK_COUNT_LIMIT of them, NULL for the default mode.
+	unsigned int         file;    // Where the mode was first named, to report it if no section declares it.
+	unsigned int         line;
+	bool                 declared;
+};
+
+// The main configuration file followed by the conf.d fragments in lexical order.
+// Entries of a later file override the ones of the files before it.
+struct config
+{
+	struct config_file *files;
+	unsigned int        file_count;
+	bool                quiet;    // Count errors without printing them.
+	unsigned int        errors;
+	char                base_dir[MAX_PATH_LENGTH+1]; // Relative scripts are resolved against it.
+	struct template_segment *segments;
+	unsigned int        segment_count;
+	unsigned int        segment_capacity;
+	struct config_handler *handlers;
+	unsigned int        handler_count;
+	unsigned int        handler_capacity;
+	struct config_condition *conditions;
+	unsigned int        condition_count;
+	unsigned int        condition_capacity;
+	struct config_chord chords[MAX_CHORDS]; // In the order they first appear.
+	unsigned int        chord_count;
+	struct config_mode  modes[MAX_MODES]; // The default mode first.
+	unsigned int        mode_count;
+	char                kv_exports[MAX_KV_EXPORTS][KV_KEY_SIZE + 1]; // Keys of the store passed to the handlers.
+	unsigned int        kv_export_count;
+	struct config_cancel cancels[MAX_CANCEL_RULES];
+	unsigned int        cancel_count;
+	struct config_entry entries[CS_COUNT];
+};
+
+static struct config g_config;
+
+static void config_error(struct config *cfg, unsigned int file, unsigned int line, const char *fmt, ...)
+{
+	va_list argp;
+	++cfg->errors;
+	if (cfg->quiet)
+		return;
+	fprintf(stderr, "%s:%u: ", cfg->files[file].path, line);
+	va_start(argp, fmt);
+	vfprintf(stderr, fmt, argp);
+	va_end(argp);
+	fputc('\n', stderr);
+}
+
+static bool is_config_space(char c)
+{
+	return c == ' ' || c == '\t' || c == '\r';
+}
+
+static bool slice_equals(struct slice s, const char *str)
+{
+	size_t n = strlen(str);
+	return s.len == n && memcmp(s.ptr, str, n) == 0;
+}
+
+// Parses the decimal number in [p, end), rejecting leading zeroes and values above max.
+static bool parse_range_uint(const char *p, const char *end, unsigned int max, unsigned int *dst)
+{
+	if (p == end || (*p == '0' && end - p > 1))
+		return false;
+
+	unsigned int x = 0;
+	for (; p != end; ++p)
+	{
+		if (*p < '0' || *p > '9')
+			return false;
+		x = x * 10 + (*p - '0');
+		if (x > max)
+			return false;
+	}
+	*dst = x;
+	return true;
+}
+
+// Maps a value name to its slot, negative if the name is unknown.
+static int config_slot(struct slice name)
+{
+	const char *end = name.ptr + name.len;
+	unsigned int n;
+
+	if (slice_equals(name, DOWN_VALUE_NAME))
+		return CS_DOWN;
+	if (slice_equals(name, UP_VALUE_NAME))
+		return CS_UP;
+	if (slice_equals(name, CLICK_OTHER_VALUE_NAME))
+		return CS_CLICK_OTHER;
+	if (slice_equals(name, HOLD_OTHER_VALUE_NAME))
+		return CS_HOLD_OTHER;
+	if (slice_equals(name, CLICK_COUNT_LIMIT_VALUE_NAME))
+		return CS_CLICK_COUNT_LIMIT;
+	if (slice_equals(name, HIGH_LANE_LIMIT_VALUE_NAME))
+		return CS_HIGH_LANE_LIMIT;
+	if (slice_equals(name, LOW_LANE_LIMIT_VALUE_NAME))
+		return CS_LOW_LANE_LIMIT;
+	if (slice_equals(name, CHORD_WINDOW_MS_VALUE_NAME))
+		return CS_CHORD_WINDOW_MS;
+
+	// CLICK_%u
+	if (name.len > 6 && memcmp(name.ptr, "CLICK_", 6) == 0 && parse_range_uint(name.ptr + 6, end, ABSOLUTE_MAX_CLICK, &n))
+		return CS_CLICK_0 + n;
+
+	// HOLD_%uS
+	if (name.len > 6 && memcmp(name.ptr, "HOLD_", 5) == 0 && end[-1] == 'S' && parse_range_uint(name.ptr + 5, end - 1, ABSOLUTE_MAX_HOLD, &n))
+		return CS_HOLD_0 + n;
+
+	return -1;
+}
+
+// The action slot of a button or chord entry, CS_DOWN to CS_HOLD_OTHER.
+static int slot_action(int slot)
+{
+	return slot < CS_CHORD_0 ? slot : (slot - CS_CHORD_0) % CS_ACTION_COUNT;
+}
+
+// First slot of the actions the entry belongs to, 0 for the buttons' own.
+static int slot_base(int slot)
+{
+	return slot - slot_action(slot);
+}
+
+// Maps a CHORD_<gpio>+<gpio>..._<ACTION> name to its slot, negative if it is not one. With add, a chord named for
+// the first time is added to the config, otherwise only the chords of cfg are found.
+static int config_chord_slot(struct config *cfg, struct slice name, bool add)
+{
+	const char *p = name.ptr + 6;
+	const char *end = name.ptr + name.len;
+	if (name.len <= 6 || memcmp(name.ptr, "CHORD_", 6) != 0)
+		return -1;
+
+	struct config_chord chord;
+	memset(&chord, 0, sizeof(chord));
+	for (;;)
+	{
+		const char *q = p;
+		while (q != end && *q >= '0' && *q <= '9')
+			++q;
+		unsigned int pin;
+		if (chord.pin_count == MAX_BUTTONS || !parse_range_uint(p, q, MAX_GPIO_NUMBER, &pin) || q == end)
+			return -1;
+
+		// Insertion sort, the chord is the same whatever the order of its buttons.
+		unsigned int i = chord.pin_count++;
+		for (; i > 0 && chord.pins[i-1] >= (int)pin; --i)
+		{
+			if (chord.pins[i-1] == (int)pin)
+				return -1;
+			chord.pins[i] = chord.pins[i-1];
+		}
+		chord.pins[i] = pin;
+
+		p = q + 1;
+		if (*q == '_')
+			break;
+		if (*q != '+')
+			return -1;
+	}
+
+	struct slice action = { p, end - p };
+	int slot = config_slot(action);
+	if (chord.pin_count < 2 || slot < 0 || slot >= CS_ACTION_COUNT)
+		return -1;
+
+	unsigned int c;
+	for (c=0; c<cfg->chord_count; ++c)
+	{
+		if (cfg->chords[c].pin_count == chord.pin_count && memcmp(cfg->chords[c].pins, chord.pins, chord.pin_count * sizeof(int)) == 0)
+			break;
+	}
+	if (c == cfg->chord_count)
+	{
+		if (!add || c == MAX_CHORDS)
+			return -1;
+
+		size_t len = sprintf(chord.prefix, "CHORD_");
+		unsigned int i;
+		for (i=0; i<chord.pin_count; ++i)
+			len += sprintf(chord.prefix + len, "%d%c", chord.pins[i], i + 1 < chord.pin_count ? '+' : '_');
+		cfg->chords[cfg->chord_count++] = chord;
+	}
+	return CS_CHORD_0 + c * CS_ACTION_COUNT + slot;
+}
+
+// An empty configuration, in the default mode.
+static void config_init(struct config *cfg)
+{
+	memset(cfg, 0, sizeof(*cfg));
+	strcpy(cfg->modes[0].name, DEFAULT_MODE_NAME);
+	cfg->modes[0].declared = true;
+	cfg->mode_count = 1;
+}
+
+// The action table of mode m.
+static struct config_entry *config_mode_entries(struct config *cfg, unsigned int m)
+{
+	return m == 0 ? cfg->entries : cfg->modes[m].entries;
+}
+
+// Finds the mode by name, adding it if it is new. Returns negative if the name is not valid or there is no room.
+static int config_mode(struct config *cfg, unsigned int file, unsigned int line, struct slice name)
+{
+	unsigned int m;
+	for (m=0; m<cfg->mode_count; ++m)
+	{
+		if (slice_equals(name, cfg->modes[m].name))
+			return m;
+	}
+
+	size_t i;
+	for (i=0; i<name.len; ++i)
+	{
+		char c = name.ptr[i];
+		if (!((c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9') || c == '_' || c == '-'))
+			break;
+	}
+	if (name.len == 0 || name.len > MODE_NAME_SIZE || i != name.len)
+	{
+		config_error(cfg, file, line, "Invalid mode name '%.*s'.", (int)name.len, name.ptr);
+		return -1;
+	}
+	if (cfg->mode_count == MAX_MODES)
+	{
+		config_error(cfg, file, line, "More than %u modes, ignoring '%.*s'.", MAX_MODES, (int)name.len, name.ptr);
+		return -1;
+	}
+
+	struct config_mode *mode = &cfg->modes[cfg->mode_count];
+	mode->entries = calloc(CS_CLICK_COUNT_LIMIT, sizeof(struct config_entry));
+	if (mode->entries == NULL)
+	{
+		config_error(cfg, file, line, "Out of memory adding mode '%.*s'.", (int)name.len, name.ptr);
+		return -1;
+	}
+	memcpy(mode->name, name.ptr, name.len);
+	mode->name[name.len] = '\0';
+	mode->file = file;
+	mode->line = line;
+	return cfg->mode_count++;
+}
+
+// Keys of the store are names of letters, digits and '_', values any printable characters but whitespace.
+static bool kv_key_valid(struct slice key)
+{
+	size_t i;
+	for (i=0; i<key.len; ++i)
+	{
+		char c = key.ptr[i];
+		if (!((c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9') || c == '_'))
+			return false;
+	}
+	return key.len != 0 && key.len <= KV_KEY_SIZE;
+}
+
+static bool kv_value_valid(struct slice value)
+{
+	size_t i;
+	for (i=0; i<value.len; ++i)
+	{
+		if (value.ptr[i] <= ' ' || value.ptr[i] == 0x7f)
+			return false;
+	}
+	return value.len <= KV_VALUE_SIZE;
+}
+
+// Parses a signed decimal number of the whole slice.
+static bool parse_slice_ll(struct slice s, long long *dst)
+{
+	char buf[24];
+	if (s.len == 0 || s.len >= sizeof(buf))
+		return false;
+	memcpy(buf, s.ptr, s.len);
+	buf[s.len] = '\0';
+
+	char *end;
+	errno = 0;
+	*dst = strtoll(buf, &end, 10);
+	return errno == 0 && *end == '\0';
+}
+
+// Checks that every mode a :mode handler names has a section, and fills in the actions each mode falls back to.
+static void config_resolve_modes(struct config *cfg)
+{
+	unsigned int m;
+	for (m=1; m<cfg->mode_count; ++m)
+	{
+		struct config_mode *mode = &cfg->modes[m];
+		if (!mode->declared)
+			config_error(cfg, mode->file, mode->line, "Mode '%s' has no [%s] section.", mode->name, mode->name);
+
+		int slot;
+		for (slot=0; slot<CS_CLICK_COUNT_LIMIT; ++slot)
+		{
+			if (mode->entries[slot].line == 0)
+				mode->entries[slot] = cfg->entries[slot];
+		}
+	}
+}
+
+static bool config_add_segment(struct config *cfg, enum template_slot_e slot, const char *ptr, size_t len)
+{
+	if (slot == TS_LITERAL && len == 0)
+		return true;
+
+	if (cfg->segment_count == cfg->segment_capacity)
+	{
+		unsigned int capacity = cfg->segment_capacity ? 2 * cfg->segment_capacity : 64;
+		struct template_segment *segments = realloc(cfg->segments, capacity * sizeof(struct template_segment));
+		if (segments == NULL)
+			return false;
+		cfg->segments = segments;
+		cfg->segment_capacity = capacity;
+	}
+
+	struct template_segment *seg = &cfg->segments[cfg->segment_count++];
+	seg->slot = slot;
+	seg->literal.ptr = ptr;
+	seg->literal.len = len;
+	return true;
+}
+
+// Compiles the arguments into literal and placeholder segments, so events only need to copy and format numbers.
+// {{ and }} stand for literal braces.
+static bool config_compile_template(struct config *cfg, unsigned int file, unsigned int line, struct config_handler *handler, struct slice args)
+{
+	const char *p = args.ptr;
+	const char *end = p + args.len;
+	const char *literal = p;
+	bool ok = true;
+
+	handler->template_first = cfg->segment_count;
+
+	while (p != end)
+	{
+		if ((*p == '{' || *p == '}') && p + 1 != end && p[1] == *p)
+		{
+			ok = ok && config_add_segment(cfg, TS_LITERAL, literal, p + 1 - literal);
+			p += 2;
+			literal = p;
+			continue;
+		}
+
+		if (*p == '{')
+		{
+			const char *close = memchr(p, '}', end - p);
+			struct slice name = { p + 1, close ? close - p - 1 : 0 };
+			int slot;
+			for (slot = TS_LITERAL + 1; close && slot < TS_COUNT; ++slot)
+			{
+				if (slice_equals(name, TEMPLATE_SLOT_NAMES[slot]))
+					break;
+			}
+
+			if (close && slot < TS_COUNT)
+			{
+				ok = ok && config_add_segment(cfg, TS_LITERAL, literal, p - literal);
+				ok = ok && config_add_segment(cfg, slot, NULL, 0);
+				p = close + 1;
+				literal = p;
+				continue;
+			}
+
+			config_error(cfg, file, line, "Unknown placeholder '%.*s', keeping it as is.", (int)(close ? close + 1 - p : end - p), p);
+		}
+		++p;
+	}
+	ok = ok && config_add_segment(cfg, TS_LITERAL, literal, end - literal);
+
+	handler->template_count = cfg->segment_count - handler->template_first;
+	return ok;
+}
+
+// Skips whitespace and returns the token that follows, advancing p past it.
+static struct slice config_token(const char **p, const char *end)
+{
+	while (*p != end && is_config_space(**p))
+		++*p;
+
+	struct slice token = { *p, 0 };
+	while (*p != end && !is_config_space(**p))
+		++*p;
+	token.len = *p - token.ptr;
+	return token;
+}
+
+// FNV-1a, folding len bytes into hash.
+static unsigned long long identity_add(unsigned long long hash, const void *data, size_t len)
+{
+	const unsigned char *p = data;
+	size_t i;
+	for (i=0; i<len; ++i)
+		hash = (hash ^ p[i]) * 0x100000001b3ull;
+	return hash;
+}
+
+static int config_add_handler(struct config *cfg)
+{
+	if (cfg->handler_count == cfg->handler_capacity)
+	{
+		unsigned int capacity = cfg->handler_capacity ? 2 * cfg->handler_capacity : 32;
+		struct config_handler *handlers = realloc(cfg->handlers, capacity * sizeof(struct config_handler));
+		if (handlers == NULL)
+			return -1;
+		cfg->handlers = handlers;
+		cfg->handler_capacity = capacity;
+	}
+
+	struct config_handler *handler = &cfg->handlers[cfg->handler_count];
+	memset(handler, 0, sizeof(*handler));
+	handler->next = -1;
+	return cfg->handler_count++;
+}
+
+// Parses the [!]<kind>:<arg> of an @if option.
+static bool config_condition(struct config *cfg, unsigned int file, unsigned int line, struct slice token, struct config_condition *cond)
+{
+	memset(cond, 0, sizeof(*cond));
+	cond->probe = -1;
+	cond->negate = token.len != 0 && token.ptr[0] == '!';
+	if (cond->negate)
+	{
+		++token.ptr;
+		--token.len;
+	}
+
+	const char *colon = memchr(token.ptr, ':', token.len);
+	if (colon == NULL)
+		return false;
+	struct slice kind = { token.ptr, colon - token.ptr };
+	cond->arg.ptr = colon + 1;
+	cond->arg.len = token.ptr + token.len - cond->arg.ptr;
+
+	if (slice_equals(kind, "mode"))
+	{
+		int m = config_mode(cfg, file, line, cond->arg);
+		if (m < 0)
+			return false;
+		cond->kind = COND_MODE;
+		cond->mode = m;
+		return true;
+	}
+	if (slice_equals(kind, "kv"))
+	{
+		const char *eq = memchr(cond->arg.ptr, '=', cond->arg.len);
+		if (eq != NULL)
+		{
+			cond->value.ptr = eq + 1;
+			cond->value.len = cond->arg.ptr + cond->arg.len - cond->value.ptr;
+			cond->arg.len = eq - cond->arg.ptr;
+		}
+		cond->kind = COND_KV;
+		return kv_key_valid(cond->arg) && kv_value_valid(cond->value);
+	}
+	if (slice_equals(kind, "exists") || slice_equals(kind, "running"))
+	{
+		cond->kind = slice_equals(kind, "exists") ? COND_EXISTS : COND_RUNNING;
+		return cond->arg.len > 1 && cond->arg.len <= MAX_PATH_LENGTH && cond->arg.ptr[0] == '/';
+	}
+	return false;
+}
+
+static int config_add_conditions(struct config *cfg, const struct config_condition *conds, unsigned int count)
+{
+	if (cfg->condition_count + count > cfg->condition_capacity)
+	{
+		unsigned int capacity = cfg->condition_capacity ? 2 * cfg->condition_capacity : 16;
+		struct config_condition *conditions = realloc(cfg->conditions, capacity * sizeof(struct config_condition));
+		if (conditions == NULL)
+			return -1;
+		cfg->conditions = conditions;
+		cfg->condition_capacity = capacity;
+	}
+
+	memcpy(cfg->conditions + cfg->condition_count, conds, count * sizeof(struct config_condition));
+	cfg->condition_count += count;
+	return cfg->condition_count - count;
+}
+
+// KV_EXPORT <key>... passes the keys to the handlers as INZOWN_KV_<key>.
+static void config_kv_export(struct config *cfg, unsigned int file, unsigned int line, const char *p, const char *end)
+{
+	struct slice key;
+	for (key = config_token(&p, end); key.len != 0; key = config_token(&p, end))
+	{
+		unsigned int i;
+		for (i=0; i<cfg->kv_export_count && !slice_equals(key, cfg->kv_exports[i]); ++i)
+			;
+		if (!kv_key_valid(key))
+			config_error(cfg, file, line, "Invalid key '%.*s'.", (int)key.len, key.ptr);
+		else if (i == MAX_KV_EXPORTS)
+			config_error(cfg, file, line, "More than %u exported keys, ignoring '%.*s'.", MAX_KV_EXPORTS, (int)key.len, key.ptr);
+		else if (i == cfg->kv_export_count)
+		{
+			memcpy(cfg->kv_exports[i], key.ptr, key.len);
+			cfg->kv_exports[i][key.len] = '\0';
+			++cfg->kv_export_count;
+		}
+	}
+}
+
+// Maps an action name, or CLICK_*, HOLD_* or * for all of those actions, to its range of action slots.
+static bool config_action_range(struct slice name, int *first, int *last)
+{
+	int slot = config_slot(name);
+	if (slice_equals(name, "*"))
+	{
+		*first = CS_DOWN;
+		*last = CS_HOLD_OTHER;
+	}
+	else if (slice_equals(name, "CLICK_*"))
+	{
+		*first = CS_CLICK_0;
+		*last = CS_CLICK_OTHER;
+	}
+	else if (slice_equals(name, "HOLD_*"))
+	{
+		*first = CS_HOLD_0;
+		*last = CS_HOLD_OTHER;
+	}
+	else if (slot >= 0 && slot < CS_ACTION_COUNT)
+	{
+		*first = slot;
+		*last = slot;
+	}
+	else
+		return false;
+	return true;
+}
+
+// CANCEL <trigger> <target>... adds a rule for every target.
+static void config_cancel(struct config *cfg, unsigned int file, unsigned int line, const char *p, const char *end)
+{
+	struct config_cancel rule;
+	struct slice trigger = config_token(&p, end);
+	if (!config_action_range(trigger, &rule.trigger_first, &rule.trigger_last))
+	{
+		config_error(cfg, file, line, "Invalid action '%.*s' to cancel on.", (int)trigger.len, trigger.ptr);
+		return;
+	}
+
+	struct slice target = config_token(&p, end);
+	if (target.len == 0)
+		config_error(cfg, file, line, "Missing actions to cancel on '%.*s'.", (int)trigger.len, trigger.ptr);
+	for (; target.len != 0; target = config_token(&p, end))
+	{
+		if (!config_action_range(target, &rule.target_first, &rule.target_last))
+			config_error(cfg, file, line, "Invalid action '%.*s' to cancel.", (int)target.len, target.ptr);
+		else if (cfg->cancel_count == MAX_CANCEL_RULES)
+			config_error(cfg, file, line, "More than %u cancel rules, ignoring '%.*s'.", MAX_CANCEL_RULES, (int)target.len, target.ptr);
+		else
+			cfg->cancels[cfg->cancel_count++] = rule;
+	}
+}
+
+// Splits [p, end) of a comment-free line into name, options, value and arguments. A [name] line makes mode the
+// one the following lines of the file set the actions of.
+static void config_parse_line(struct config *cfg, unsigned int file, unsigned int line, const char *p, const char *end, unsigned int *mode)
+{
+	while (p != end && is_config_space(*p))
+		++p;
+	while (end != p && is_config_space(end[-1]))
+		--end;
+
+	if (end - p <= 1)
+		return;
+
+	if (*p == '[')
+	{
+		struct slice section = { p + 1, end - p - 2 };
+		int m = end[-1] == ']' ? config_mode(cfg, file, line, section) : -1;
+		if (end[-1] != ']')
+			config_error(cfg, file, line, "Expected ']' after the mode name.");
+		if (m >= 0)
+			cfg->modes[m].declared = true;
+		*mode = m >= 0 ? (unsigned int)m : 0;
+		return;
+	}
+
+	struct slice name = config_token(&p, end);
+	if (slice_equals(name, "KV_EXPORT"))
+	{
+		if (*mode != 0)
+			config_error(cfg, file, line, "'KV_EXPORT' can not be set in a mode, ignoring.");
+		else
+			config_kv_export(cfg, file, line, p, end);
+		return;
+	}
+	if (slice_equals(name, "CANCEL"))
+	{
+		if (*mode != 0)
+			config_error(cfg, file, line, "'CANCEL' can not be set in a mode, ignoring.");
+		else
+			config_cancel(cfg, file, line, p, end);
+		return;
+	}
+	struct slice value = config_token(&p, end);
+
+	int slot = config_slot(name);
+	if (slot < 0)
+		slot = config_chord_slot(cfg, name, true);
+	if (slot < 0)
+	{
+		if (name.len > 6 && memcmp(name.ptr, "CHORD_", 6) == 0 && cfg->chord_count == MAX_CHORDS)
+			config_error(cfg, file, line, "More than %u chords, ignoring '%.*s'.", MAX_CHORDS, (int)name.len, name.ptr);
+		else
+			config_error(cfg, file, line, "Unknown name '%.*s'.", (int)name.len, name.ptr);
+		return;
+	}
+
+	int action = slot_action(slot);
+	enum concurrency_e concurrency = CC_PARALLEL;
+	enum lane_e lane = action == CS_DOWN || action == CS_UP ? LANE_HIGH : LANE_LOW;
+	bool options = false;
+	struct config_condition conds[MAX_HANDLER_CONDITIONS];
+	unsigned int cond_count = 0;
+	for (; value.len != 0 && value.ptr[0] == '@'; value = config_token(&p, end), options = true)
+	{
+		if (slice_equals(value, "@if"))
+		{
+			struct slice token = config_token(&p, end);
+			if (cond_count == MAX_HANDLER_CONDITIONS)
+			{
+				config_error(cfg, file, line, "More than %u conditions for '%.*s'.", MAX_HANDLER_CONDITIONS, (int)name.len, name.ptr);
+				return;
+			}
+			if (!config_condition(cfg, file, line, token, &conds[cond_count++]))
+			{
+				config_error(cfg, file, line, "Invalid condition '%.*s'.", (int)token.len, token.ptr);
+				return;
+			}
+		}
+		else if (slice_equals(value, "@parallel"))
+			concurrency = CC_PARALLEL;
+		else if (slice_equals(value, "@single"))
+			concurrency = CC_SINGLE;
+		else if (slice_equals(value, "@high"))
+			lane = LANE_HIGH;
+		else if (slice_equals(value, "@low"))
+			lane = LANE_LOW;
+		else
+		{
+			config_error(cfg, file, line, "Unknown option '%.*s'.", (int)value.len, value.ptr);
+			return;
+		}
+	}
+
+	while (p != end && is_config_space(*p))
+		++p;
+
+	struct slice args = { p, end - p };
+
+	if (value.len > MAX_PATH_LENGTH || args.len > MAX_PATH_LENGTH)
+	{
+		config_error(cfg, file, line, "Too long value set for '%.*s'.", (int)name.len, name.ptr);
+		return;
+	}
+
+	if (*mode != 0 && slot >= CS_CLICK_COUNT_LIMIT)
+	{
+		config_error(cfg, file, line, "'%.*s' can not be set in a mode, ignoring.", (int)name.len, name.ptr);
+		return;
+	}
+
+	struct config_entry *entry = &config_mode_entries(cfg, *mode)[slot];
+	if (entry->line != 0 && entry->file != file)
+	{
+		debug(2, "%s:%u: '%.*s' overrides %s:%u\n", cfg->files[file].path, line, (int)name.len, name.ptr, cfg->files[entry->file].path, entry->line);
+		entry->first_handler = -1;
+		entry->last_handler = -1;
+		entry->handler_count = 0;
+		entry->builtin_count = 0;
+		entry->line = 0;
+	}
+
+	if (slot >= CS_CLICK_COUNT_LIMIT)
+	{
+		unsigned int x;
+		if (entry->line != 0)
+		{
+			config_error(cfg, file, line, "'%.*s' was already set on line %u, ignoring.", (int)name.len, name.ptr, entry->line);
+			return;
+		}
+		if (args.len != 0 || !parse_range_uint(value.ptr, value.ptr + value.len, UINT32_MAX, &x))
+		{
+			config_error(cfg, file, line, "Expected a number for '%.*s'.", (int)name.len, name.ptr);
+			return;
+		}
+		entry->value = value;
+		entry->file = file;
+		entry->line = line;
+		return;
+	}
+
+	if (entry->line == 0)
+	{
+		entry->first_handler = -1;
+		entry->last_handler = -1;
+		entry->handler_count = 0;
+		entry->builtin_count = 0;
+		entry->value = value;
+		entry->file = file;
+		entry->line = line;
+	}
+
+	// A name set without a value disables the action.
+	if (value.len == 0)
+	{
+		if (options)
+			config_error(cfg, file, line, "Missing script for '%.*s'.", (int)name.len, name.ptr);
+		return;
+	}
+
+	enum builtin_e builtin = BUILTIN_NONE;
+	int target = 0;
+	struct slice key = { NULL, 0 };
+	if (value.ptr[0] == ':')
+	{
+		struct slice arg = config_token(&p, end);
+		struct slice arg2 = config_token(&p, end);
+		long long n;
+		if (slice_equals(value, ":mode") && arg.len != 0 && arg2.len == 0)
+		{
+			builtin = BUILTIN_MODE;
+			target = config_mode(cfg, file, line, arg);
+			if (target < 0)
+				return;
+		}
+		else if (slice_equals(value, ":set") && kv_key_valid(arg) && arg2.len != 0 && kv_value_valid(arg2) && p == end)
+			builtin = BUILTIN_SET;
+		else if (slice_equals(value, ":toggle") && kv_key_valid(arg) && arg2.len == 0)
+			builtin = BUILTIN_TOGGLE;
+		else if (slice_equals(value, ":incr") && kv_key_valid(arg) && (arg2.len == 0 || parse_slice_ll(arg2, &n)) && p == end)
+			builtin = BUILTIN_INCR;
+		else
+		{
+			config_error(cfg, file, line, "Unknown built-in '%.*s' or wrong arguments for it.", (int)value.len, value.ptr);
+			return;
+		}
+		key = arg;
+		args = arg2;
+	}
+	else if (args.len == 0 && action >= CS_CLICK_0 && action <= CS_CLICK_OTHER)
+	{
+		args.ptr = DEFAULT_CLICK_ARGS;
+		args.len = strlen(DEFAULT_CLICK_ARGS);
+	}
+	else if (args.len == 0 && action >= CS_HOLD_0 && action <= CS_HOLD_OTHER)
+	{
+		args.ptr = DEFAULT_HOLD_ARGS;
+		args.len = strlen(DEFAULT_HOLD_ARGS);
+	}
+
+	int index = config_add_handler(cfg);
+	int cond_first = cond_count != 0 ? config_add_conditions(cfg, conds, cond_count) : 0;
+	if (index < 0 || cond_first < 0 || (builtin == BUILTIN_NONE && !config_compile_template(cfg, file, line, &cfg->handlers[index], args)))
+	{
+		config_error(cfg, file, line, "Out of memory adding a handler for '%.*s'.", (int)name.len, name.ptr);
+		return;
+	}
+
+	struct config_handler *handler = &cfg->handlers[index];
+	handler->value = value;
+	handler->args = args;
+	handler->concurrency = concurrency;
+	handler->lane = lane;
+	handler->builtin = builtin;
+	handler->mode = target;
+	handler->key = key;
+	handler->condition_first = cond_first;
+	handler->condition_count = cond_count;
+	handler->line = line;
+
+	// A reload builds a new handler table, so @single matches running handlers by what they are, not their index.
+	const char *mode_name = cfg->modes[*mode].name;
+	unsigned long long identity = identity_add(0xcbf29ce484222325ull, mode_name, strlen(mode_name) + 1);
+	identity = identity_add(identity, &slot, sizeof(slot));
+	identity = identity_add(identity, &entry->handler_count, sizeof(entry->handler_count));
+	identity = identity_add(identity, value.ptr, value.len);
+	identity = identity_add(identity, "", 1);
+	handler->identity = identity_add(identity, args.ptr, args.len);
+
+	// Repeating a name within a file adds handlers that run in parallel.
+	if (entry->last_handler < 0)
+		entry->first_handler = index;
+	else
+		cfg->handlers[entry->last_handler].next = index;
+	entry->last_handler = index;
+	++entry->handler_count;
+	if (builtin != BUILTIN_NONE)
+		++entry->builtin_count;
+}
+
+// Walks the whole file once, filling in the entries with slices of the buffer it was read into.
+static void config_parse(struct config *cfg, unsigned int file)
+{
+	const char *p = cfg->files[file].data;
+	const char *end = p + cfg->files[file].size;
+	unsigned int line = 0;
+	unsigned int mode = 0; // Every file starts outside of the sections.
+
+	while (p != end)
+	{
+		const char *eol = memchr(p, '\n', end - p);
+		if (eol == NULL)
+			eol = end;
+
+		const char *comment = memchr(p, '#', eol - p); // Ignore comments.
+		config_parse_line(cfg, file, ++line, p, comment ? comment : eol, &mode);
+
+		if (eol == end)
+			break;
+		p = eol + 1;
+	}
+}
+
+// Reads and parses the file as the next one of cfg. Returns 0 on success, negative errno on error.
+static int config_load_file(struct config *cfg, const char *path)
+{
+	struct config_file *file = &cfg->files[cfg->file_count];
+
+	file->path = strdup(path);
+	if (file->path == NULL)
+		return -ENOMEM;
+	++cfg->file_count;
+
+	int fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd == -1)
+	{
+		int err = errno;
+		debug(1, "Failed opening %s! Error %d.\n", path, err);
+		return -err;
+	}
+
+	struct stat s;
+	if (fstat(fd, &s) != 0)
+	{
+		int err = errno;
+		fprintf(stderr, "Failed to stat %s! Error %d.\n", path, err);
+		close(fd);
+		return -err;
+	}
+
+	if (!S_ISREG(s.st_mode))
+	{
+		fprintf(stderr, "%s is not a regular file!\n", path);
+		close(fd);
+		return -EINVAL;
+	}
+
+	// The entries are slices of the file's data for as long as the configuration is in use. A mapping would fault
+	// with SIGBUS once the file was truncated in place, so the data is read into memory of our own.
+	if (s.st_size > 0)
+	{
+		char *data = malloc(s.st_size);
+		if (data == NULL)
+		{
+			fprintf(stderr, "Failed allocating %lld bytes for %s!\n", (long long)s.st_size, path);
+			close(fd);
+			return -ENOMEM;
+		}
+
+		size_t size = 0;
+		while (size < (size_t)s.st_size)
+		{
+			ssize_t n = read(fd, data + size, s.st_size - size);
+			if (n == 0) // Truncated since the fstat.
+				break;
+			if (n < 0 && errno == EINTR)
+				continue;
+			if (n < 0)
+			{
+				int err = errno;
+				fprintf(stderr, "Failed reading %s! Error %d.\n", path, err);
+				free(data);
+				close(fd);
+				return -err;
+			}
+			size += n;
+		}
+		file->data = data;
+		file->size = size;
+	}
+	close(fd);
+
+	config_parse(cfg, cfg->file_count - 1);
+	return 0;
+}
+
+static bool config_fragment_filter_name(const char *name)
+{
+	size_t n = strlen(name);
+	return name[0] != '.' && n > 5 && strcmp(name + n - 5, ".conf") == 0;
+}
+
+static int config_fragment_filter(const struct dirent *d)
+{
+	return config_fragment_filter_name(d->d_name);
+}
+
+// Plain byte order, independent of the locale.
+static int config_fragment_compare(const struct dirent **a, const struct dirent **b)
+{
+	return strcmp((*a)->d_name, (*b)->d_name);
+}
+
+// Loads the main configuration file followed by every *.conf fragment in dir, in lexical order.
+// Returns 0 on success, negative errno if the main file could not be loaded.
+static int config_load(struct config *cfg, const char *path, const char *dir)
+{
+	config_init(cfg);
+
+	char tmp[MAX_PATH_LENGTH + 1];
+	strncpy(tmp, path, sizeof(tmp)-1);
+	tmp[sizeof(tmp)-1] = '\0';
+	snprintf(cfg->base_dir, sizeof(cfg->base_dir), "%s", dirname(tmp));
+
+	struct dirent **names = NULL;
+	int count = dir[0] != '\0' ? scandir(dir, &names, config_fragment_filter, config_fragment_compare) : 0;
+	if (count < 0)
+	{
+		if (errno != ENOENT)
+			debug(1, "Failed scanning %s! Error %d.\n", dir, errno);
+		count = 0;
+	}
+
+	int err = -ENOMEM;
+	cfg->files = calloc(count + 1, sizeof(struct config_file));
+	if (cfg->files != NULL)
+	{
+		err = config_load_file(cfg, path);
+
+		int i;
+		for (i=0; i<count; ++i)
+		{
+			int len = snprintf(tmp, sizeof(tmp), "%s/%s", dir, names[i]->d_name);
+			if (len > 0 && (size_t)len < sizeof(tmp))
+				config_load_file(cfg, tmp);
+		}
+	}
+
+	config_resolve_modes(cfg);
+
+	int i;
+	for (i=0; i<count; ++i)
+		free(names[i]);
+	free(names);
+
+	debug(2, "Loaded %s and %d fragment(s) from %s with %u error(s).\n", path, count, dir, cfg->errors);
+	return err;
+}
+
+static void config_free(struct config *cfg)
+{
+	unsigned int i;
+	for (i=0; i<cfg->file_count; ++i)
+	{
+		free(cfg->files[i].data);
+		free(cfg->files[i].path);
+	}
+	for (i=1; i<cfg->mode_count; ++i)
+		free(cfg->modes[i].entries);
+	free(cfg->files);
+	free(cfg->segments);
+	free(cfg->handlers);
+	free(cfg->conditions);
+	memset(cfg, 0, sizeof(*cfg));
+}
+
+enum { CONFIG_WATCH_EVENTS = IN_CLOSE_WRITE | IN_MOVED_TO | IN_MOVED_FROM | IN_CREATE | IN_DELETE };
+
+static int g_config_main_wd = -1;
+static int g_config_dir_wd  = -1;
+
+static const char *path_basename(const char *path)
+{
+	const char *slash = strrchr(path, '/');
+	return slash ? slash + 1 : path;
+}
+
+// (Re)adds the watches on the main file's directory and on the fragment directory, if it exists.
+static void config_watch(int fd, const char *path, const char *dir)
+{
+	char tmp[MAX_PATH_LENGTH + 1];
+	strncpy(tmp, path, sizeof(tmp)-1);
+	tmp[sizeof(tmp)-1] = '\0';
+
+	g_config_main_wd = inotify_add_watch(fd, dirname(tmp), CONFIG_WATCH_EVENTS);
+	if (g_config_main_wd == -1)
+		debug(1, "Failed watching %s! Error %d.\n", tmp, errno);
+
+	g_config_dir_wd = dir[0] != '\0' ? inotify_add_watch(fd, dir, CONFIG_WATCH_EVENTS | IN_ONLYDIR) : -1;
+}
+
+// Drains the pending inotify events, returns true if any of them touches the configuration.
+static bool config_watch_changed(int fd, const char *path, const char *dir)
+{
+	char buffer[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+	bool changed = false;
+
+	for (;;)
+	{
+		ssize_t n = read(fd, buffer, sizeof(buffer));
+		if (n <= 0)
+			break;
+
+		const char *p = buffer;
+		while (p < buffer + n)
+		{
+			const struct inotify_event *ev = (const struct inotify_event *)p;
+			p += sizeof(struct inotify_event) + ev->len;
+
+			if (ev->mask & IN_Q_OVERFLOW)
+			{
+				changed = true;
+			}
+			else if (ev->wd == g_config_dir_wd)
+			{
+				// The directory itself going away also counts.
+				if (ev->len == 0 || config_fragment_filter_name(ev->name))
+					changed = true;
+			}
+			else if (ev->wd == g_config_main_wd && ev->len != 0)
+			{
+				if (strcmp(ev->name, path_basename(path)) == 0 || strcmp(ev->name, path_basename(dir)) == 0)
+					changed = true;
+			}
+		}
+	}
+
+	return changed;
+}
+
+// Value of a numeric entry validated by config_parse_line.
+static unsigned int config_uint(const struct config *cfg, enum config_slot_e slot, unsigned int default_value)
+{
+	const struct config_entry *entry = &cfg->entries[slot];
+	unsigned int x;
+	if (entry->line == 0 || !parse_range_uint(entry->value.ptr, entry->value.ptr + entry->value.len, UINT32_MAX, &x))
+		return default_value;
+	return x;
+}
+
+// Counters and histograms exported in the Prometheus text format by --metrics-socket and --metrics-file.
+// Only the event loop writes them, so a relaxed store of the incremented value is enough for the metrics
+// thread to read them untorn.
+enum { HISTOGRAM_BUCKETS = 14 };
+
+static const timestamp_ns_t HISTOGRAM_BOUNDS_NS[HISTOGRAM_BUCKETS] =
+{
+	100000, 250000, 500000, 1000000, 2500000, 5000000, 10000000, 25000000, 50000000,
+	100000000, 250000000, 500000000, 1000000000, 5000000000ull,
+};
+
+struct histogram
+{
+	unsigned long long buckets[HISTOGRAM_BUCKETS + 1]; // The last one is +Inf.
+	unsigned long long sum_ns;
+};
+
+// What woke the event loop up, the first ready descriptor in this order.
+enum wake_e
+{
+	WAKE_EDGE,
+	WAKE_TIMER,
+	WAKE_CHILD,
+	WAKE_CONFIG,
+	WAKE_CONTROL,
+	WAKE_OUTPUT, // A handler's stdout while tracing.
+	WAKE_SIGNAL, // A signal other than SIGCHLD, or an interrupted wait.
+	WAKE_PROBE,  // A file or process an @if condition depends on changed.
+	WAKE_COUNT
+};
+
+static const char *const WAKE_NAMES[WAKE_COUNT] = { "edge", "timer", "child", "config", "control", "output", "signal", "probe" };
+
+struct metrics
+{
+	unsigned long long events[CS_COUNT]; // Classified actions, by the entry their name selects.
+	unsigned long long repeated_edges;   // Edges that did not change the button state.
+	unsigned long long handlers_dropped; // Handlers skipped because the child table or their lane's queue was full,
+	                                     // or spawning them failed.
+	unsigned long long actions_dropped;  // Actions dropped because every dispatch was in flight.
+	unsigned long long reloads;
+	unsigned long long config_errors;
+	unsigned long long mode_switches;
+	unsigned long long handlers_cancelled; // Running or queued handlers cancelled by a CANCEL rule.
+	unsigned long long probe_evaluations; // Cache misses of the exists: and running: conditions.
+	unsigned long long wakeups[WAKE_COUNT];
+	unsigned long long resumes;          // System resumes seen with --suspend-safe.
+	struct histogram   spawn;
+	struct histogram   runtime;
+	struct histogram   resume_dispatch;  // From the first wakeup after a resume until the handler it caused started.
+};
+
+static struct metrics g_metrics;
+static bool g_metrics_enabled = false;
+
+static void metric_add(unsigned long long *counter, unsigned long long n)
+{
+	__atomic_store_n(counter, *counter + n, __ATOMIC_RELAXED);
+}
+
+static unsigned long long metric_get(const unsigned long long *counter)
+{
+	return __atomic_load_n(counter, __ATOMIC_RELAXED);
+}
+
+static void histogram_observe(struct histogram *h, timestamp_ns_t ns)
+{
+	int i = 0;
+	while (i < HISTOGRAM_BUCKETS && ns > HISTOGRAM_BOUNDS_NS[i])
+		++i;
+	metric_add(&h->buckets[i], 1);
+	metric_add(&h->sum_ns, ns);
+}
+
+// The action name an entry of the configuration is selected by. Empty for the numeric settings.
+static void config_slot_name(int slot, char *name)
+{
+	if (slot >= CS_CHORD_0 && slot < CS_CLICK_COUNT_LIMIT)
+	{
+		unsigned int c = (slot - CS_CHORD_0) / CS_ACTION_COUNT;
+		size_t len = c < g_config.chord_count ? (size_t)sprintf(name, "%s", g_config.chords[c].prefix) : (size_t)sprintf(name, "CHORD%u_", c);
+		config_slot_name(slot_action(slot), name + len);
+	}
+	else if (slot == CS_DOWN)
+		strcpy(name, DOWN_VALUE_NAME);
+	else if (slot == CS_UP)
+		strcpy(name, UP_VALUE_NAME);
+	else if (slot < CS_CLICK_OTHER)
+		sprintf(name, CLICK_NAME, slot - CS_CLICK_0);
+	else if (slot == CS_CLICK_OTHER)
+		strcpy(name, CLICK_OTHER_VALUE_NAME);
+	else if (slot < CS_HOLD_OTHER)
+		sprintf(name, HOLD_NAME, slot - CS_HOLD_0);
+	else if (slot == CS_HOLD_OTHER)
+		strcpy(name, HOLD_OTHER_VALUE_NAME);
+	else
+		name[0] = '\0';
+}
+
+static void metrics_render_counter(FILE *f, const char *name, const char *help, unsigned long long value)
+{
+	fprintf(f, "# HELP %s %s\n# TYPE %s counter\n%s %llu\n", name, help, name, name, value);
+}
+
+static void metrics_render_histogram(FILE *f, const char *name, const char *help, const struct histogram *h)
+{
+	fprintf(f, "# HELP %s %s\n# TYPE %s histogram\n", name, help, name);
+
+	unsigned long long count = 0;
+	int i;
+	for (i=0; i<=HISTOGRAM_BUCKETS; ++i)
+	{
+		count += metric_get(&h->buckets[i]);
+		if (i < HISTOGRAM_BUCKETS)
+			fprintf(f, "%s_bucket{le=\"%g\"} %llu\n", name, HISTOGRAM_BOUNDS_NS[i] / 1e9, count);
+		else
+			fprintf(f, "%s_bucket{le=\"+Inf\"} %llu\n", name, count);
+	}
+	fprintf(f, "%s_sum %.9f\n%s_count %llu\n", name, metric_get(&h->sum_ns) / 1e9, name, count);
+}
+
+static void metrics_render(FILE *f)
+{
+	fprintf(f, "# HELP inzown_events_total Classified button actions, by name.\n# TYPE inzown_events_total counter\n");
+	int slot;
+	for (slot=0; slot<CS_COUNT; ++slot)
+	{
+		unsigned long long n = metric_get(&g_metrics.events[slot]);
+		char name[ACTION_NAME_SIZE+1];
+		config_slot_name(slot, name);
+		if (n != 0 && name[0] != '\0')
+			fprintf(f, "inzown_events_total{action=\"%s\"} %llu\n", name, n);
+	}
+
+	metrics_render_histogram(f, "inzown_spawn_seconds", "Time from starting a handler until it executed its command.", &g_metrics.spawn);
+	metrics_render_histogram(f, "inzown_handler_runtime_seconds", "Time from starting a handler until it exited.", &g_metrics.runtime);
+	metrics_render_counter(f, "inzown_repeated_edges_total", "Edges that did not change the button state, repeated presses still count as presses.",
+		metric_get(&g_metrics.repeated_edges));
+
+	fprintf(f, "# HELP inzown_shed_total Handlers and actions shed because the daemon's tables were full or a spawn failed.\n"
+		"# TYPE inzown_shed_total counter\n");
+	fprintf(f, "inzown_shed_total{kind=\"handler\"} %llu\n", metric_get(&g_metrics.handlers_dropped));
+	fprintf(f, "inzown_shed_total{kind=\"action\"} %llu\n", metric_get(&g_metrics.actions_dropped));
+
+	metrics_render_counter(f, "inzown_config_reloads_total", "Configuration reloads.", metric_get(&g_metrics.reloads));
+	metrics_render_counter(f, "inzown_probe_evaluations_total", "Evaluations of exists: and running: conditions that were not cached.", metric_get(&g_metrics.probe_evaluations));
+	metrics_render_counter(f, "inzown_handlers_cancelled_total", "Running or queued handlers cancelled by a CANCEL rule.", metric_get(&g_metrics.handlers_cancelled));
+	metrics_render_counter(f, "inzown_mode_switches_total", "Switches to another mode by :mode handlers or the control socket.", metric_get(&g_metrics.mode_switches));
+	fprintf(f, "# HELP inzown_config_errors Errors in the current configuration.\n# TYPE inzown_config_errors gauge\ninzown_config_errors %llu\n",
+		metric_get(&g_metrics.config_errors));
+	fprintf(f, "# HELP inzown_loop_wakeups_total Returns of the event loop's wait, by cause.\n# TYPE inzown_loop_wakeups_total counter\n");
+	int cause;
+	for (cause=0; cause<WAKE_COUNT; ++cause)
+		fprintf(f, "inzown_loop_wakeups_total{cause=\"%s\"} %llu\n", WAKE_NAMES[cause], metric_get(&g_metrics.wakeups[cause]));
+
+	metrics_render_counter(f, "inzown_resumes_total", "System resumes from suspend seen by the event loop.", metric_get(&g_metrics.resumes));
+	metrics_render_histogram(f, "inzown_resume_dispatch_seconds", "Time from the first wakeup after a resume until the handler it caused started.",
+		&g_metrics.resume_dispatch);
+}
+
+// Resume detection for --suspend-safe. CLOCK_BOOTTIME keeps counting while the system is suspended and
+// CLOCK_MONOTONIC does not, so their difference only grows across a suspend.
+enum { RESUME_THRESHOLD_NS = 1000000 }; // Above the jitter of reading both clocks.
+
+struct resume
+{
+	timestamp_ns_t offset_ns; // CLOCK_BOOTTIME - CLOCK_MONOTONIC at the last check.
+	timestamp_ns_t woke_ns;   // First wakeup after the last resume, in g_clock.
+	bool           pending;   // That resume has not dispatched a handler yet.
+};
+
+static struct resume g_resume;
+static bool g_suspend_safe = false;
+
+enum { DEFAULT_DRAIN_TIMEOUT = 5 }; // Seconds.
+
+// How long SIGINT and SIGTERM wait for the running handlers before terminating them.
+static unsigned int g_drain_timeout = DEFAULT_DRAIN_TIMEOUT;
+
+static timestamp_ns_t resume_offset_ns(void)
+{
+	struct timespec boot, mono;
+	clock_gettime(CLOCK_MONOTONIC, &mono);
+	clock_gettime(CLOCK_BOOTTIME, &boot);
+	return (boot.tv_sec - mono.tv_sec) * 1000000000ll + (boot.tv_nsec - mono.tv_nsec);
+}
+
+// Called after every wakeup of the event loop.
+static void resume_check(timestamp_ns_t now)
+{
+	timestamp_ns_t offset = resume_offset_ns();
+	if (offset > g_resume.offset_ns + RESUME_THRESHOLD_NS)
+	{
+		debug(1, "Resumed after %.3f s suspended.\n", (offset - g_resume.offset_ns) / 1e9);
+		metric_add(&g_metrics.resumes, 1);
+		g_resume.woke_ns = now;
+		g_resume.pending = true;
+	}
+	g_resume.offset_ns = offset;
+}
+
+// Called when a handler has started.
+static void resume_dispatched(void)
+{
+	timestamp_ns_t latency = get_timestamp_ns() - g_resume.woke_ns;
+	debug(1, "First handler after the resume started %.3f ms after waking up.\n", latency / 1e6);
+	histogram_observe(&g_metrics.resume_dispatch, latency);
+	g_resume.pending = false;
+}
+
+// Circular journal of the classified actions and handler exits for --journal. The file is mapped shared, so
+// appending is a few stores into the page cache, without a syscall, and the records survive the daemon crashing.
+// A record is only valid when its commit word matches its sequence number. The commit word is cleared before the
+// record is rewritten and stored last, so a record torn by a crash is skipped by the reader.
+enum { JOURNAL_VERSION     = 2 }; // 2 added the button.
+enum { JOURNAL_DEFAULT_KIB = 256 };
+
+static const char JOURNAL_MAGIC[8] = "INZJRNL";
+static const uint64_t JOURNAL_COMMIT = 0x636f6d6d69747465ull;
+
+enum journal_kind_e
+{
+	JOURNAL_ACTION = 1, // A classified action, slot is the entry its name selects.
+	JOURNAL_EXIT   = 2, // A handler exited, slot is the entry that ran it.
+};
+
+struct journal_header
+{
+	char     magic[8];
+	uint32_t version;
+	uint32_t record_size;
+	uint32_t capacity;     // Records following the header.
+	uint32_t reserved[11];
+};
+
+struct journal_record
+{
+	uint64_t seq;          // Of the record, from 1.
+	uint64_t wall_ns;      // CLOCK_REALTIME.
+	uint64_t ts_ns;        // The event's timestamp in the event loop's clock, what --journal-export uses.
+	uint64_t event;        // Sequence number of the button edge.
+	uint16_t kind;
+	int16_t  button;       // The GPIO of the event, the lowest one of a chord.
+	uint32_t slot;
+	uint32_t clicks;       // The handler's ordinal for JOURNAL_EXIT.
+	uint32_t hold_ms;
+	int32_t  pid;
+	int32_t  status;       // As returned by waitpid.
+	uint64_t commit;       // seq ^ JOURNAL_COMMIT once the record is complete.
+};
+
+struct journal
+{
+	struct journal_header *header; // NULL unless journaling.
+	struct journal_record *records;
+	size_t                 size;
+	uint32_t               capacity;
+	uint64_t               last_seq;
+};
+
+static struct journal g_journal;
+
+static bool journal_record_valid(const struct journal_record *r)
+{
+	return r->seq != 0 && __atomic_load_n(&r->commit, __ATOMIC_ACQUIRE) == (r->seq ^ JOURNAL_COMMIT);
+}
+
+static void journal_append(enum journal_kind_e kind, uint64_t event, int button, int slot, unsigned int clicks, unsigned int hold_ms,
+	pid_t pid, int status, timestamp_ns_t ts_ns)
+{
+	uint64_t seq = ++g_journal.last_seq;
+	struct journal_record *r = &g_journal.records[(seq - 1) % g_journal.capacity];
+
+	__atomic_store_n(&r->commit, 0, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+
+	struct timespec wall;
+	clock_gettime(CLOCK_REALTIME, &wall);
+	r->seq = seq;
+	r->wall_ns = wall.tv_sec * 1000000000ull + wall.tv_nsec;
+	r->ts_ns = ts_ns;
+	r->event = event;
+	r->kind = kind;
+	r->button = button;
+	r->slot = slot;
+	r->clicks = clicks;
+	r->hold_ms = hold_ms;
+	r->pid = pid;
+	r->status = status;
+
+	__atomic_store_n(&r->commit, seq ^ JOURNAL_COMMIT, __ATOMIC_RELEASE);
+}
+
+static size_t journal_size(uint32_t capacity)
+{
+	return sizeof(struct journal_header) + (size_t)capacity * sizeof(struct journal_record);
+}
+
+static bool journal_header_valid(const struct journal_header *h, size_t size)
+{
+	return memcmp(h->magic, JOURNAL_MAGIC, sizeof(JOURNAL_MAGIC)) == 0 && h->version == JOURNAL_VERSION &&
+		h->record_size == sizeof(struct journal_record) && h->capacity != 0 && journal_size(h->capacity) == size;
+}
+
+// Maps the journal at path, sized for kib KiB. A journal of another size or format is started over.
+static int journal_open(const char *path, unsigned int kib)
+{
+	if ((size_t)kib * 1024 < journal_size(1))
+	{
+		fprintf(stderr, "The journal needs at least %zu bytes!\n", journal_size(1));
+		return -1;
+	}
+	uint32_t capacity = ((size_t)kib * 1024 - sizeof(struct journal_header)) / sizeof(struct journal_record);
+	size_t size = journal_size(capacity);
+
+	int fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0640);
+	if (fd == -1)
+	{
+		fprintf(stderr, "Opening the journal %s failed. Error %d.\n", path, errno);
+		return -1;
+	}
+
+	struct stat st;
+	bool resized = fstat(fd, &st) == 0 && (size_t)st.st_size != size;
+	if (resized && ftruncate(fd, size) != 0)
+	{
+		fprintf(stderr, "Sizing the journal %s failed. Error %d.\n", path, errno);
+		close(fd);
+		return -1;
+	}
+
+	// Populated up front, so that appending does not fault the pages in.
+	void *p = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, 0);
+	close(fd);
+	if (p == MAP_FAILED)
+	{
+		fprintf(stderr, "Mapping the journal %s failed. Error %d.\n", path, errno);
+		return -1;
+	}
+
+	g_journal.header = p;
+	g_journal.records = (struct journal_record *)(g_journal.header + 1);
+	g_journal.size = size;
+	g_journal.capacity = capacity;
+	g_journal.last_seq = 0;
+
+	if (resized || !journal_header_valid(g_journal.header, size))
+	{
+		memset(p, 0, size);
+		memcpy(g_journal.header->magic, JOURNAL_MAGIC, sizeof(JOURNAL_MAGIC));
+		g_journal.header->version = JOURNAL_VERSION;
+		g_journal.header->record_size = sizeof(struct journal_record);
+		g_journal.header->capacity = capacity;
+		debug(1, "Started the journal %s, %u records.\n", path, capacity);
+		return 0;
+	}
+
+	// Continue after the newest record.
+	uint32_t i;
+	for (i=0; i<capacity; ++i)
+	{
+		const struct journal_record *r = &g_journal.records[i];
+		if (journal_record_valid(r) && r->seq > g_journal.last_seq)
+			g_journal.last_seq = r->seq;
+	}
+	debug(1, "Continuing the journal %s after record %llu.\n", path, (unsigned long long)g_journal.last_seq);
+	return 0;
+}
+
+enum { DEFAULT_METRICS_INTERVAL  = 15 }; // Seconds.
+enum { METRICS_TIMER_SLACK_NS    = 1000000000 }; // Textfile rewrites may come a second late.
+
+struct metrics_server
+{
+	int          listen_fd;    // -1 unless serving a unix socket.
+	const char  *socket_path;
+	const char  *file_path;    // NULL unless writing a textfile.
+	unsigned int interval;
+	pthread_t    thread;
+};
+
+static struct metrics_server g_metrics_server = { .listen_fd = -1 };
+
+// Renders to path.tmp and renames it over path, so collectors never read a partial file.
+static void metrics_write_file(const char *path)
+{
+	char tmp[MAX_PATH_LENGTH + 8];
+	snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+
+	FILE *f = fopen(tmp, "we");
+	if (f == NULL)
+	{
+		fprintf(stderr, "Opening %s failed. Error %d.\n", tmp, errno);
+		return;
+	}
+
+	metrics_render(f);
+	if (fclose(f) != 0 || rename(tmp, path) != 0)
+		fprintf(stderr, "Writing %s failed. Error %d.\n", path, errno);
+}
+
+// Answers every connection to the socket with the metrics and rewrites the textfile every interval.
+static void *metrics_thread(void *arg)
+{
+	(void)arg;
+	struct metrics_server *server = &g_metrics_server;
+	timestamp_ns_t next = get_timestamp_ns();
+
+	prctl(PR_SET_TIMERSLACK, METRICS_TIMER_SLACK_NS);
+
+	for (;;)
+	{
+		int timeout = -1;
+		if (server->file_path != NULL)
+		{
+			timestamp_ns_t now = get_timestamp_ns();
+			if (now >= next)
+			{
+				metrics_write_file(server->file_path);
+				next = now + server->interval * 1000000000ull;
+			}
+			timeout = (next - now + 999999) / 1000000;
+		}
+
+		struct pollfd pfd = { server->listen_fd, POLLIN, 0 };
+		if (poll(&pfd, 1, timeout) <= 0)
+			continue;
+
+		int fd = accept4(server->listen_fd, NULL, NULL, SOCK_CLOEXEC);
+		if (fd == -1)
+			continue;
+
+		FILE *f = fdopen(fd, "w");
+		if (f == NULL)
+		{
+			close(fd);
+			continue;
+		}
+		metrics_render(f);
+		fclose(f);
+	}
+	return NULL;
+}
+
+// Returns a unix stream socket listening on path, replacing a stale one, or -1.
+static int listen_unix(const char *path, const char *what, int flags)
+{
+	struct sockaddr_un addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	if (strlen(path) >= sizeof(addr.sun_path))
+	{
+		fprintf(stderr, "The %s socket path %s is too long!\n", what, path);
+		return -1;
+	}
+	strcpy(addr.sun_path, path);
+
+	int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC | flags, 0);
+	if (fd == -1)
+	{
+		fprintf(stderr, "Creating the %s socket failed. Error %d.\n", what, errno);
+		return -1;
+	}
+
+	unlink(path);
+	if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0 || listen(fd, 4) != 0)
+	{
+		fprintf(stderr, "Listening on %s failed. Error %d.\n", path, errno);
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+static int metrics_start(const char *socket_path, const char *file_path, unsigned int interval)
+{
+	struct metrics_server *server = &g_metrics_server;
+
+	if (socket_path != NULL)
+	{
+		int fd = listen_unix(socket_path, "metrics", 0);
+		if (fd == -1)
+			return -1;
+		server->listen_fd = fd;
+		server->socket_path = socket_path;
+	}
+
+	server->file_path = file_path;
+	server->interval = interval ? interval : DEFAULT_METRICS_INTERVAL;
+
+	int err = start_thread(&server->thread, &metrics_thread);
+	if (err != 0)
+	{
+		fprintf(stderr, "Starting the metrics thread failed. Error %d.\n", err);
+		return -1;
+	}
+
+	g_metrics_enabled = true;
+	return 0;
+}
+
+static void metrics_stop(void)
+{
+	if (g_metrics_server.socket_path != NULL)
+		unlink(g_metrics_server.socket_path);
+}
+
+
+static int get_action_name(enum action_e action, char * action_name, unsigned click_count, unsigned hold_time)
+{
+	inzown_btn_action_name((enum inzown_btn_action)action, click_count, hold_time,
+		(g_full_time ? INZOWN_BTN_FULL_TIME : 0) | (g_offset_time ? INZOWN_BTN_OFFSET_TIME : 0), action_name);
+	debug(3, "action %u click count %u hold time %u (%u seconds) yields action name %s\n", action, click_count, hold_time, TICK_2_SECONDS(hold_time), action_name );
+	return 0;
+}
+
+// Chord names by index, for the chords of the current configuration.
+static const char *chord_prefix(int slot_base)
+{
+	unsigned int c = (slot_base - CS_CHORD_0) / CS_ACTION_COUNT;
+	return slot_base != 0 && c < g_config.chord_count ? g_config.chords[c].prefix : "";
+}
+
+struct action_event
+{
+	enum action_e      action;
+	unsigned int       clicks;
+	unsigned int       hold_ms;
+	timestamp_ns_t     ts_ns;
+	unsigned long long seq;
+	timestamp_ns_t     origin_ns; // Edge that started the gesture, the first press for clicks and holds.
+	int                slot_base; // 0 for a button, CS_CHORD_0 + c * CS_ACTION_COUNT for chord c.
+	int                button;    // The GPIO, the lowest one of a chord.
+};
+
+// The entry the action's name selects, CLICK_OTHER / HOLD_OTHER for counts beyond the named ones.
+static int get_action_slot(enum action_e action, unsigned click_count, unsigned hold_time)
+{
+	switch (action)
+	{
+	case A_DOWN:
+		return CS_DOWN;
+	case A_UP:
+		return CS_UP;
+	case A_CLICK:
+		return click_count <= ABSOLUTE_MAX_CLICK ? CS_CLICK_0 + (int)click_count : CS_CLICK_OTHER;
+	case A_HOLD:
+	{
+		unsigned timer = TICK_2_SECONDS(hold_time);
+		return timer <= ABSOLUTE_MAX_HOLD ? CS_HOLD_0 + (int)timer : CS_HOLD_OTHER;
+	}
+	default:
+		return -1;
+	}
+}
+
+// The current mode and its action table. A mode switch only swaps the table the actions are looked up in.
+static unsigned int               g_mode = 0;
+static const struct config_entry *g_mode_entries = g_config.entries;
+
+static void mode_set(unsigned int m)
+{
+	g_mode = m;
+	g_mode_entries = config_mode_entries(&g_config, m);
+}
+
+// The entry to run for the action's slot in the current mode, falling back to CLICK_OTHER / HOLD_OTHER. NULL if
+// none is defined.
+static const struct config_entry *get_action_entry(int slot)
+{
+	const struct config_entry *entries = g_mode_entries + slot_base(slot);
+	const struct config_entry *entry = &g_mode_entries[slot];
+	int action = slot_action(slot);
+
+	if (entry->line == 0 && action > CS_UP && action < CS_CLICK_OTHER)
+		entry = &entries[CS_CLICK_OTHER];
+	else if (entry->line == 0 && action > CS_CLICK_OTHER && action < CS_HOLD_OTHER)
+		entry = &entries[CS_HOLD_OTHER];
+
+	return entry->line != 0 ? entry : NULL;
+}
+
+// Writes x in decimal to dst, returns the number of characters written. dst must hold 20 characters.
+static size_t format_uint(char *dst, unsigned long long x)
+{
+	char tmp[20];
+	size_t n = 0;
+	do
+	{
+		tmp[n++] = '0' + x % 10;
+		x /= 10;
+	} while (x != 0);
+
+	size_t i;
+	for (i=0; i<n; ++i)
+		dst[i] = tmp[n-1-i];
+	return n;
+}
+
+// Appends the expanded argument template of the handler to dst, which already holds len characters.
+// Returns the new length or -ENAMETOOLONG.
+static int expand_template(const struct config_handler *handler, const struct action_event *ev, char *dst, size_t len, size_t n)
+{
+	const struct template_segment *seg = &g_config.segments[handler->template_first];
+	const struct template_segment *end = seg + handler->template_count;
+
+	for (; seg != end; ++seg)
+	{
+		if (seg->slot == TS_LITERAL)
+		{
+			if (len + seg->literal.len >= n)
+				return -ENAMETOOLONG;
+			memcpy(dst + len, seg->literal.ptr, seg->literal.len);
+			len += seg->literal.len;
+			continue;
+		}
+
+		if (len + 20 >= n)
+			return -ENAMETOOLONG;
+
+		switch (seg->slot)
+		{
+		case TS_CLICKS:
+			len += format_uint(dst + len, ev->clicks);
+			break;
+		case TS_HOLD_MS:
+			len += format_uint(dst + len, ev->hold_ms);
+			break;
+		case TS_HOLD_S:
+			len += format_uint(dst + len, TICK_2_SECONDS(ev->hold_ms));
+			break;
+		case TS_TS:
+			len += format_uint(dst + len, ev->ts_ns / 1000000);
+			break;
+		case TS_BUTTON:
+			len += format_uint(dst + len, ev->button);
+			break;
+		case TS_SEQ:
+			len += format_uint(dst + len, ev->seq);
+			break;
+		default:
+			break;
+		}
+	}
+
+	dst[len] = '\0';
+	return len;
+}
+
+// Builds the command line of the handler into cmd.
+// length of command or an error (negative number).
+static int get_handler_command(const struct config_handler *handler, const struct action_event *ev, char *cmd, size_t n)
+{
+	debug(1, "script = '%.*s', args = '%.*s'\n", (int)handler->value.len, handler->value.ptr, (int)handler->args.len, handler->args.ptr);
+
+	int len;
+
+	// The path is absolute.
+	if (handler->value.ptr[0] == '/')
+	{
+		len = snprintf(cmd, n, "%.*s", (int)handler->value.len, handler->value.ptr);
+	}
+	else // The path is relative to the config file location.
+	{
+		len = snprintf(cmd, n, "%s/%.*s", g_config.base_dir, (int)handler->value.len, handler->value.ptr);
+	}
+
+	if (len < 0 || (size_t)len + 1 >= n)
+	{
+		return -ENAMETOOLONG;
+	}
+
+	if (handler->template_count == 0)
+	{
+		return len;
+	}
+
+	cmd[len++] = ' ';
+	return expand_template(handler, ev, cmd, len, n);
+}
+
+// The key/value store the :set, :toggle and :incr handlers and the control socket change. It is kept in memory
+// and, with --kv-file, written to disk --kv-interval seconds after the first change since the last snapshot.
+enum { DEFAULT_KV_INTERVAL = 60 };
+
+struct kv_pair
+{
+	char key[KV_KEY_SIZE + 1];
+	char value[KV_VALUE_SIZE + 1];
+};
+
+struct kv_store
+{
+	struct kv_pair pairs[MAX_KV_KEYS];
+	unsigned int   count;
+	bool           dirty;    // Changed since the last snapshot.
+	const char    *path;     // NULL without --kv-file.
+	unsigned int   interval;
+	int            timerfd;  // Snapshot timer, only while the event loop runs.
+};
+
+static struct kv_store g_kv = { .interval = DEFAULT_KV_INTERVAL, .timerfd = -1 };
+
+static struct kv_pair *kv_find(struct slice key)
+{
+	unsigned int i;
+	for (i=0; i<g_kv.count; ++i)
+	{
+		if (slice_equals(key, g_kv.pairs[i].key))
+			return &g_kv.pairs[i];
+	}
+	return NULL;
+}
+
+// The value of the key, "" if it is not set.
+static const char *kv_get(const char *key)
+{
+	struct slice k = { key, strlen(key) };
+	const struct kv_pair *pair = kv_find(k);
+	return pair ? pair->value : "";
+}
+
+// Starts the snapshot timer on the first change since the last snapshot.
+static void kv_changed(void)
+{
+	if (g_kv.dirty)
+		return;
+	g_kv.dirty = true;
+
+	if (g_kv.timerfd != -1)
+	{
+		struct itimerspec its;
+		memset(&its, 0, sizeof(its));
+		its.it_value.tv_sec = g_kv.interval;
+		timerfd_settime(g_kv.timerfd, 0, &its, NULL);
+	}
+}
+
+// Sets the key, adding it if it is new. Returns the pair, NULL if the store is full.
+static struct kv_pair *kv_set(struct slice key, struct slice value)
+{
+	struct kv_pair *pair = kv_find(key);
+	if (pair == NULL)
+	{
+		if (g_kv.count == MAX_KV_KEYS)
+		{
+			fprintf(stderr, "The store is full, not adding '%.*s'!\n", (int)key.len, key.ptr);
+			return NULL;
+		}
+		pair = &g_kv.pairs[g_kv.count++];
+		memcpy(pair->key, key.ptr, key.len);
+		pair->key[key.len] = '\0';
+		pair->value[0] = '\0';
+	}
+
+	if (!slice_equals(value, pair->value))
+	{
+		memcpy(pair->value, value.ptr, value.len);
+		pair->value[value.len] = '\0';
+		kv_changed();
+	}
+	return pair;
+}
+
+// Removes the key. Returns false if it was not set.
+static bool kv_delete(struct slice key)
+{
+	struct kv_pair *pair = kv_find(key);
+	if (pair == NULL)
+		return false;
+
+	*pair = g_kv.pairs[--g_kv.count];
+	kv_changed();
+	return true;
+}
+
+// A key that is unset, empty or 0 toggles to 1, anything else to 0.
+static struct kv_pair *kv_toggle(struct slice key)
+{
+	const struct kv_pair *pair = kv_find(key);
+	bool off = pair == NULL || pair->value[0] == '\0' || strcmp(pair->value, "0") == 0;
+	struct slice value = { off ? "1" : "0", 1 };
+	return kv_set(key, value);
+}
+
+// A key that is not a number counts from 0.
+static struct kv_pair *kv_incr(struct slice key, long long n)
+{
+	const struct kv_pair *pair = kv_find(key);
+	long long x = 0;
+	if (pair != NULL)
+	{
+		struct slice value = { pair->value, strlen(pair->value) };
+		if (!parse_slice_ll(value, &x))
+			x = 0;
+	}
+
+	char buf[24];
+	struct slice value = { buf, snprintf(buf, sizeof(buf), "%lld", x + n) };
+	return kv_set(key, value);
+}
+
+// Loads the snapshot, a "<key> <value>" line per key. A missing file is an empty store.
+static int kv_load(void)
+{
+	FILE *f = fopen(g_kv.path, "re");
+	if (f == NULL)
+	{
+		if (errno == ENOENT)
+			return 0;
+		int err = errno;
+		fprintf(stderr, "Opening %s failed. Error %d.\n", g_kv.path, err);
+		return err;
+	}
+
+	char line[KV_KEY_SIZE + KV_VALUE_SIZE + 4];
+	unsigned int n = 0;
+	while (fgets(line, sizeof(line), f) != NULL)
+	{
+		++n;
+		const char *p = line;
+		const char *end = line + strcspn(line, "\n");
+		struct slice key = config_token(&p, end);
+		struct slice value = config_token(&p, end);
+		if (!kv_key_valid(key) || !kv_value_valid(value) || config_token(&p, end).len != 0 || kv_set(key, value) == NULL)
+			fprintf(stderr, "%s:%u: Ignoring invalid entry.\n", g_kv.path, n);
+	}
+	fclose(f);
+
+	g_kv.dirty = false;
+	debug(1, "Loaded %u key(s) from %s.\n", g_kv.count, g_kv.path);
+	return 0;
+}
+
+// Writes the snapshot to path.tmp and renames it over path, so a power cut leaves the old or the new one.
+static void kv_save(void)
+{
+	char tmp[MAX_PATH_LENGTH + 8];
+	snprintf(tmp, sizeof(tmp), "%s.tmp", g_kv.path);
+
+	FILE *f = fopen(tmp, "we");
+	if (f == NULL)
+	{
+		fprintf(stderr, "Opening %s failed. Error %d.\n", tmp, errno);
+		return;
+	}
+
+	unsigned int i;
+	for (i=0; i<g_kv.count; ++i)
+		fprintf(f, "%s %s\n", g_kv.pairs[i].key, g_kv.pairs[i].value);
+
+	if (fflush(f) != 0 || fsync(fileno(f)) != 0 || fclose(f) != 0 || rename(tmp, g_kv.path) != 0)
+	{
+		fprintf(stderr, "Writing %s failed. Error %d.\n", g_kv.path, errno);
+		return;
+	}
+
+	g_kv.dirty = false;
+	debug(2, "Saved %u key(s) to %s.\n", g_kv.count, g_kv.path);
+}
+
+// Handlers run with a small fixed environment: a few variables passed through from the daemon,
+// INZOWN_CONFIG, and slots describing the event that are patched in place before every spawn.
+static const char *const ENV_PASSTHROUGH[] = { "PATH", "HOME", "LANG", "LC_ALL", "TZ", "USER", "LOGNAME", NULL };
+static const char *const DEFAULT_ENV_PATH = "PATH=/usr/local/sbin:/usr/local/bin:/usr/sbin:/usr/bin:/sbin:/bin";
+
+enum env_slot_e
+{
+	ENV_ACTION = 0, // Action name, e.g. CLICK_2.
+	ENV_CLICKS,
+	ENV_HOLD_MS,
+	ENV_TS_NS,      // CLOCK_MONOTONIC timestamp of the event in nanoseconds.
+	ENV_SEQ,
+	ENV_BUTTON,
+	ENV_MODE,       // The mode the action was looked up in.
+
+	// Must be the last one!
+	ENV_SLOT_COUNT
+};
+
+static const char *const ENV_SLOT_NAMES[ENV_SLOT_COUNT] =
+{
+	"INZOWN_ACTION=",
+	"INZOWN_CLICKS=",
+	"INZOWN_HOLD_MS=",
+	"INZOWN_TS_NS=",
+	"INZOWN_SEQ=",
+	"INZOWN_BUTTON=",
+	"INZOWN_MODE=",
+};
+
+enum { ENV_SLOT_SIZE = 64 };
+enum { MAX_ENV_SIZE  = 32 };
+
+static char   g_env_slots[ENV_SLOT_COUNT][ENV_SLOT_SIZE];
+static size_t g_env_slot_offset[ENV_SLOT_COUNT];
+static char   g_env_config[MAX_PATH_LENGTH + 16];
+static char   g_env_kv[MAX_KV_EXPORTS][sizeof("INZOWN_KV_") + KV_KEY_SIZE + 1 + KV_VALUE_SIZE];
+static size_t g_env_kv_offset[MAX_KV_EXPORTS];
+static char  *g_env[MAX_ENV_SIZE];
+
+extern char **environ;
+
+// Builds the handler environment, once per configuration load.
+static void build_handler_env(void)
+{
+	size_t n = 0;
+	bool have_path = false;
+
+	const char *const *name;
+	for (name = ENV_PASSTHROUGH; *name != NULL; ++name)
+	{
+		size_t len = strlen(*name);
+		char **e;
+		for (e = environ; e && *e; ++e)
+		{
+			if (strncmp(*e, *name, len) == 0 && (*e)[len] == '=')
+			{
+				g_env[n++] = *e;
+				have_path = have_path || strcmp(*name, "PATH") == 0;
+				break;
+			}
+		}
+	}
+
+	if (!have_path)
+		g_env[n++] = (char *)DEFAULT_ENV_PATH;
+
+	snprintf(g_env_config, sizeof(g_env_config), "INZOWN_CONFIG=%s", g_config_path);
+	g_env[n++] = g_env_config;
+
+	int i;
+	for (i=0; i<ENV_SLOT_COUNT; ++i)
+	{
+		g_env_slot_offset[i] = strlen(ENV_SLOT_NAMES[i]);
+		memcpy(g_env_slots[i], ENV_SLOT_NAMES[i], g_env_slot_offset[i] + 1);
+		g_env[n++] = g_env_slots[i];
+	}
+
+	unsigned int k;
+	for (k=0; k<g_config.kv_export_count; ++k)
+	{
+		g_env_kv_offset[k] = sprintf(g_env_kv[k], "INZOWN_KV_%s=", g_config.kv_exports[k]);
+		g_env[n++] = g_env_kv[k];
+	}
+
+	g_env[n] = NULL;
+	assert(n < MAX_ENV_SIZE);
+}
+
+static void patch_env_uint(enum env_slot_e slot, unsigned long long x)
+{
+	char *p = g_env_slots[slot] + g_env_slot_offset[slot];
+	p[format_uint(p, x)] = '\0';
+}
+
+static void patch_env_string(enum env_slot_e slot, const char *str)
+{
+	char *p = g_env_slots[slot] + g_env_slot_offset[slot];
+	strncpy(p, str, ENV_SLOT_SIZE - g_env_slot_offset[slot] - 1);
+}
+
+static void patch_handler_env(const struct action_event *ev, const char *action_name, const char *mode)
+{
+	patch_env_string(ENV_ACTION, action_name);
+	patch_env_string(ENV_MODE, mode);
+
+	patch_env_uint(ENV_CLICKS, ev->clicks);
+	patch_env_uint(ENV_HOLD_MS, ev->hold_ms);
+	patch_env_uint(ENV_TS_NS, ev->ts_ns);
+	patch_env_uint(ENV_SEQ, ev->seq);
+	patch_env_uint(ENV_BUTTON, ev->button);
+
+	// The store as it is when the handler starts, after the built-ins of its action ran.
+	unsigned int k;
+	for (k=0; k<g_config.kv_export_count; ++k)
+		strcpy(g_env_kv[k] + g_env_kv_offset[k], kv_get(g_config.kv_exports[k]));
+}
+
+// Starts cmd through /bin/sh with the handler environment, its stdout redirected to out_fd unless that is -1.
+// Returns the pid or negative errno.
+// vfork lets the low lane child demote itself before the exec. posix_spawn can not do that for SCHED_IDLE, and
+// demoting the child after posix_spawn returns races with the commands its shell starts. POSIX only allows a vfork
+// child to exec or _exit; the calls below rely on Linux and its C libraries, where the child runs on the parent's
+// memory and stack until its execve, with the parent suspended, and these calls only change the child's own
+// kernel state. SCHED_IDLE is Linux only anyway.
+static pid_t spawn_handler(const char *cmd, enum lane_e lane, int out_fd)
+{
+	char *const argv[] = { "sh", "-c", (char *)cmd, NULL };
+
+	bool slow = fault_slow_exec();
+	pid_t pid = fault_vfork();
+	if (pid == 0)
+	{
+		if (slow)
+			fault_exec_delay();
+		if (lane == LANE_LOW)
+		{
+			struct sched_param param;
+			memset(&param, 0, sizeof(param));
+			if (sched_setscheduler(0, SCHED_IDLE, &param) != 0)
+				setpriority(PRIO_PROCESS, 0, 19);
+		}
+		if (out_fd != -1)
+			dup2(out_fd, STDOUT_FILENO);
+		// A process group of its own, so cancelling or terminating the handler reaches the processes it started.
+		setpgid(0, 0);
+		// The daemon reads its signals from g_signal_fd, the handlers get them delivered as usual.
+		sigset_t none;
+		sigemptyset(&none);
+		sigprocmask(SIG_SETMASK, &none, NULL);
+		execve("/bin/sh", argv, g_env);
+		_exit(127);
+	}
+
+	if (pid == -1)
+	{
+		int err = errno;
+		fprintf(stderr, "Failed spawning '%s'! Error %d.\n", cmd, err);
+		return -err;
+	}
+	return pid;
+}
+
+// Latencies of the stages an event goes through, sampled by --bench and reported as percentiles.
+enum stage_e
+{
+	STAGE_CLASSIFY, // An edge or click window expiry, including the synchronous part of its dispatches.
+	STAGE_LOOKUP,
+	STAGE_EXPAND,
+	STAGE_SPAWN,
+	STAGE_RUNTIME,
+	STAGE_COUNT
+};
+
+static const char *const STAGE_NAMES[STAGE_COUNT] = { "classify", "lookup", "expand", "spawn", "runtime" };
+
+struct stage_samples
+{
+	timestamp_ns_t *ns;
+	size_t          count;
+	size_t          capacity;
+};
+
+static struct stage_samples g_stage_samples[STAGE_COUNT];
+static bool g_stage_sampling = false;
+
+// True if the stages have to be timed, for the trace or the samples.
+static bool stage_timing(void)
+{
+	return trace_enabled() || g_stage_sampling || g_metrics_enabled;
+}
+
+static void stage_sample(enum stage_e stage, timestamp_ns_t start, timestamp_ns_t end)
+{
+	struct stage_samples *samples = &g_stage_samples[stage];
+	if (samples->count == samples->capacity)
+	{
+		size_t capacity = samples->capacity ? 2 * samples->capacity : 4096;
+		timestamp_ns_t *ns = realloc(samples->ns, capacity * sizeof(*ns));
+		if (ns == NULL)
+			return;
+		samples->ns = ns;
+		samples->capacity = capacity;
+	}
+	samples->ns[samples->count++] = end - start;
+}
+
+// Ends a timed stage, a slice named trace_name in the trace unless that is NULL.
+static void stage_done(enum stage_e stage, const char *trace_name, pid_t tid, timestamp_ns_t start, unsigned long long seq)
+{
+	timestamp_ns_t now = get_timestamp_ns();
+	if (trace_name != NULL && trace_enabled())
+		trace_complete(trace_name, tid, start, now, seq);
+	if (g_stage_sampling)
+		stage_sample(stage, start, now);
+	if (g_metrics_enabled && stage == STAGE_SPAWN)
+		histogram_observe(&g_metrics.spawn, now - start);
+	if (g_metrics_enabled && stage == STAGE_RUNTIME)
+		histogram_observe(&g_metrics.runtime, now - start);
+}
+
+// Handlers run asynchronously. Every classified event gets a dispatch tracking its running and queued
+// handlers, completed when the slowest of them exits.
+enum { MAX_DISPATCHES = 32 };
+enum { MAX_CHILDREN   = 64 };
+enum { MAX_QUEUED     = 32 }; // Per lane.
+enum { MAX_OUTPUT_LINE = 256 };
+
+struct dispatch
+{
+	unsigned int       pending;   // Handlers still running, 0 if the dispatch is free.
+	unsigned int       handlers;
+	int                slot;      // Entry of the configuration the handlers came from.
+	int                button;    // GPIO of the event, as in struct action_event.
+	int                action;    // Action slot of the classified name, even if it fell back to CLICK_OTHER or HOLD_OTHER.
+	char               action_name[ACTION_NAME_SIZE+1];
+	char               mode[MODE_NAME_SIZE+1];
+	unsigned long long seq;
+	timestamp_ns_t     origin_ns;
+	timestamp_ns_t     started_ns;
+};
+
+// Tags of the descriptors in the event loop's epoll set. The stdout pipes of the handlers while tracing
+// follow the fixed descriptors, tagged by their index in the child table, then the control socket's clients.
+enum loop_fd_e
+{
+	FD_BUTTON  = 0,                          // By button index.
+	FD_TIMER   = FD_BUTTON + MAX_BUTTONS,    // By machine index, see struct loop_state.
+	FD_CONFIG  = FD_TIMER + MAX_BUTTONS + MAX_CHORDS,
+	FD_SIGNAL,
+	FD_CONTROL,
+	FD_KV,
+	FD_PROBE,                                // The inotify descriptor of the probes.
+	FD_PROBE_PID,                            // By probe index, the pidfds of running: conditions.
+	FD_COUNT = FD_PROBE_PID + MAX_PROBES,
+	FD_CONTROL_CLIENT = FD_COUNT + MAX_CHILDREN
+};
+
+static int g_loop_epfd = -1; // Only while the event loop runs.
+
+static int loop_watch(int fd, uint32_t events, uint32_t tag)
+{
+	if (g_loop_epfd == -1)
+		return 0;
+
+	struct epoll_event ev;
+	memset(&ev, 0, sizeof(ev));
+	ev.events = events;
+	ev.data.u32 = tag;
+	if (epoll_ctl(g_loop_epfd, EPOLL_CTL_ADD, fd, &ev) == -1)
+	{
+		fprintf(stderr, "Watching descriptor %d failed. Error %d.\n", fd, errno);
+		return errno;
+	}
+	return 0;
+}
+
+// The results of the exists: and running: conditions, cached until inotify reports a change of the file or the
+// pidfd the process's exit. Every file is watched through its directory, so it may come and go. A result is only
+// cached while the event loop runs and the watches could be set up, otherwise it is evaluated every time.
+struct probe
+{
+	enum condition_e kind;  // COND_EXISTS or COND_RUNNING.
+	char            *path;  // NULL if the slot is free.
+	const char      *name;  // The file name within the watched directory.
+	bool             used;  // By the current configuration.
+	bool             valid;
+	bool             result;
+	int              wd;    // Of the directory, -1 if it is not watched.
+	int              pidfd; // COND_RUNNING's process, -1 unless the result is cached as alive.
+};
+
+struct probes
+{
+	struct probe probes[MAX_PROBES];
+	int          inotify_fd;
+};
+
+static struct probes g_probes = { .inotify_fd = -1 };
+
+static void probe_close_pidfd(unsigned int i)
+{
+	struct probe *p = &g_probes.probes[i];
+	if (p->pidfd != -1)
+	{
+		close(p->pidfd); // Also leaves the epoll set.
+		p->pidfd = -1;
+	}
+}
+
+// Watches the directory of the probe's file. The watch is shared by the probes of the same directory.
+static void probe_watch(struct probe *p)
+{
+	if (g_probes.inotify_fd == -1)
+	{
+		g_probes.inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+		if (g_probes.inotify_fd == -1)
+			return;
+		loop_watch(g_probes.inotify_fd, EPOLLIN, FD_PROBE);
+	}
+
+	char dir[MAX_PATH_LENGTH + 1];
+	size_t len = p->name - p->path;
+	memcpy(dir, p->path, len);
+	dir[len > 1 ? len - 1 : len] = '\0';
+	p->wd = inotify_add_watch(g_probes.inotify_fd, dir, IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_CLOSE_WRITE | IN_ONLYDIR);
+}
+
+// Whether the process of the pid file is alive. Keeps a pidfd of it in the event loop to learn when it exits.
+static bool probe_running(unsigned int i)
+{
+	struct probe *p = &g_probes.probes[i];
+	probe_close_pidfd(i);
+
+	char buf[24];
+	int fd = open(p->path, O_RDONLY | O_CLOEXEC);
+	if (fd == -1)
+		return false;
+	ssize_t n = read(fd, buf, sizeof(buf) - 1);
+	close(fd);
+	if (n <= 0)
+		return false;
+	buf[n] = '\0';
+
+	long pid = strtol(buf, NULL, 10);
+	if (pid <= 0)
+		return false;
+
+#ifdef SYS_pidfd_open
+	int pidfd = syscall(SYS_pidfd_open, (pid_t)pid, 0);
+	if (pidfd != -1)
+	{
+		if (g_loop_epfd != -1 && loop_watch(pidfd, EPOLLIN, FD_PROBE_PID + i) == 0)
+			p->pidfd = pidfd;
+		else
+			close(pidfd);
+		return true;
+	}
+	if (errno != ENOSYS)
+		return false;
+#endif
+	// Without pidfds the result is not cached.
+	return kill(pid, 0) == 0 || errno == EPERM;
+}
+
+static bool probe_result(unsigned int i)
+{
+	struct probe *p = &g_probes.probes[i];
+	if (p->valid)
+		return p->result;
+
+	metric_add(&g_metrics.probe_evaluations, 1);
+	if (p->wd == -1 && g_loop_epfd != -1)
+		probe_watch(p);
+
+	p->result = p->kind == COND_EXISTS ? access(p->path, F_OK) == 0 : probe_running(i);
+	p->valid = g_loop_epfd != -1 && p->wd != -1 && (p->kind == COND_EXISTS || !p->result || p->pidfd != -1);
+	return p->result;
+}
+
+static void probe_free(unsigned int i)
+{
+	struct probe *p = &g_probes.probes[i];
+	probe_close_pidfd(i);
+
+	unsigned int j;
+	for (j=0; j<MAX_PROBES && p->wd != -1; ++j)
+	{
+		if (j != i && g_probes.probes[j].path != NULL && g_probes.probes[j].wd == p->wd)
+			break;
+	}
+	if (j == MAX_PROBES)
+		inotify_rm_watch(g_probes.inotify_fd, p->wd);
+
+	free(p->path);
+	memset(p, 0, sizeof(*p));
+	p->wd = -1;
+	p->pidfd = -1;
+}
+
+// Points the exists: and running: conditions of g_config at the probes of their files, keeping the cached results
+// of the files the previous configuration probed too.
+static void probes_bind(void)
+{
+	unsigned int i;
+	for (i=0; i<MAX_PROBES; ++i)
+		g_probes.probes[i].used = false;
+
+	for (i=0; i<g_config.condition_count; ++i)
+	{
+		struct config_condition *cond = &g_config.conditions[i];
+		if (cond->kind != COND_EXISTS && cond->kind != COND_RUNNING)
+			continue;
+
+		int free_slot = -1;
+		unsigned int j;
+		for (j=0; j<MAX_PROBES; ++j)
+		{
+			struct probe *p = &g_probes.probes[j];
+			if (p->path == NULL)
+			{
+				// Slots of the previous configuration are only reused once it is known they are not needed.
+				if (free_slot < 0)
+					free_slot = j;
+			}
+			else if (p->kind == cond->kind && slice_equals(cond->arg, p->path))
+				break;
+		}
+		if (j == MAX_PROBES && free_slot >= 0)
+		{
+			struct probe *p = &g_probes.probes[free_slot];
+			p->path = strndup(cond->arg.ptr, cond->arg.len);
+			if (p->path != NULL)
+			{
+				p->kind = cond->kind;
+				p->name = strrchr(p->path, '/') + 1;
+				p->wd = -1;
+				p->pidfd = -1;
+				j = free_slot;
+			}
+		}
+		if (j == MAX_PROBES)
+		{
+			fprintf(stderr, "More than %u files probed, '%.*s' is always false!\n", MAX_PROBES, (int)cond->arg.len, cond->arg.ptr);
+			cond->probe = -1;
+			continue;
+		}
+		g_probes.probes[j].used = true;
+		cond->probe = j;
+	}
+
+	for (i=0; i<MAX_PROBES; ++i)
+	{
+		if (g_probes.probes[i].path != NULL && !g_probes.probes[i].used)
+			probe_free(i);
+	}
+}
+
+// Drops the cached results of the files the pending inotify events name.
+static void probes_changed(void)
+{
+	char buffer[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+	for (;;)
+	{
+		ssize_t n = read(g_probes.inotify_fd, buffer, sizeof(buffer));
+		if (n <= 0)
+			break;
+
+		const char *ptr = buffer;
+		while (ptr < buffer + n)
+		{
+			const struct inotify_event *ev = (const struct inotify_event *)ptr;
+			ptr += sizeof(struct inotify_event) + ev->len;
+
+			unsigned int i;
+			for (i=0; i<MAX_PROBES; ++i)
+			{
+				struct probe *p = &g_probes.probes[i];
+				if (p->path == NULL)
+					continue;
+				if ((ev->mask & IN_Q_OVERFLOW) || (ev->wd == p->wd && (ev->len == 0 || strcmp(ev->name, p->name) == 0)))
+					p->valid = false;
+				if (ev->wd == p->wd && (ev->mask & IN_IGNORED)) // The directory is gone.
+					p->wd = -1;
+			}
+		}
+	}
+}
+
+// Forgets every cached result, when the event loop that keeps them current ends.
+static void probes_reset(void)
+{
+	unsigned int i;
+	for (i=0; i<MAX_PROBES; ++i)
+	{
+		if (g_probes.probes[i].path == NULL)
+			continue;
+		probe_close_pidfd(i);
+		g_probes.probes[i].valid = false;
+	}
+}
+
+static bool condition_met(const struct config_condition *cond)
+{
+	bool result = false;
+	switch (cond->kind)
+	{
+	case COND_MODE:
+		result = cond->mode == g_mode;
+		break;
+	case COND_KV:
+	{
+		const struct kv_pair *pair = kv_find(cond->arg);
+		const char *value = pair ? pair->value : "";
+		if (cond->value.ptr != NULL)
+			result = slice_equals(cond->value, value);
+		else
+			result = value[0] != '\0' && strcmp(value, "0") != 0;
+		break;
+	}
+	case COND_EXISTS:
+	case COND_RUNNING:
+		result = cond->probe >= 0 && probe_result(cond->probe);
+		break;
+	}
+	return result != cond->negate;
+}
+
+// Whether all @if conditions of the handler hold.
+static bool handler_selected(const struct config_handler *handler)
+{
+	unsigned int i;
+	for (i=0; i<handler->condition_count; ++i)
+	{
+		if (!condition_met(&g_config.conditions[handler->condition_first + i]))
+			return false;
+	}
+	return true;
+}
+
+// Bumped by every reload, the event loop maps the chords again on its next edge.
+static unsigned int g_config_generation = 0;
+
+// Set while a benchmark's configuration, which config_free can not release, is swapped in.
+static bool g_config_pinned = false;
+
+// Loads the configuration again and swaps it in. Entries are only referenced while an action executes.
+// Returns false if the configuration is pinned.
+static bool reload_config(void)
+{
+	if (g_config_pinned)
+	{
+		debug(1, "Not reloading the configuration while a benchmark runs.\n");
+		return false;
+	}
+
+	struct config cfg;
+	config_load(&cfg, g_config_path, g_config_dir_path);
+
+	// Stay in the current mode if it still exists.
+	unsigned int mode = 0;
+	while (mode < cfg.mode_count && strcmp(cfg.modes[mode].name, g_config.modes[g_mode].name) != 0)
+		++mode;
+	if (mode == cfg.mode_count)
+	{
+		debug(1, "Mode %s is gone, switching to the default mode.\n", g_config.modes[g_mode].name);
+		mode = 0;
+	}
+
+	config_free(&g_config);
+	g_config = cfg;
+	mode_set(mode);
+	probes_bind();
+	++g_config_generation;
+	build_handler_env();
+
+	if (!g_click_count_limit_specified)
+		g_click_count_limit = config_uint(&g_config, CS_CLICK_COUNT_LIMIT, DEFAULT_CLICK_COUNT_LIMIT);
+
+	g_lane_limit[LANE_HIGH] = config_uint(&g_config, CS_HIGH_LANE_LIMIT, DEFAULT_HIGH_LANE_LIMIT);
+	g_lane_limit[LANE_LOW] = config_uint(&g_config, CS_LOW_LANE_LIMIT, DEFAULT_LOW_LANE_LIMIT);
+
+	metric_add(&g_metrics.reloads, 1);
+	__atomic_store_n(&g_metrics.config_errors, g_config.errors, __ATOMIC_RELAXED);
+
+	debug(1, "Reloaded configuration, %u file(s), %u error(s).\n", g_config.file_count, g_config.errors);
+	return true;
+}
+
+struct child
+{
+	pid_t        pid;       // 0 if the slot is free.
+	int          dispatch;
+	int          slot;
+	unsigned int   ordinal;   // Position of the handler within the entry.
+	unsigned long long identity; // Of the configured handler, for @single.
+	enum lane_e    lane;
+	timestamp_ns_t started_ns;
+	bool           cancelled; // Signalled by a CANCEL rule, waiting to be reaped.
+	int            out_fd;    // Read end of the handler's stdout while tracing, -1 otherwise.
+	unsigned int   out_length;
+	char           out[MAX_OUTPUT_LINE];
+};
+
+// A handler waiting for its lane to have room.
+struct queued_handler
+{
+	char               *cmd;
+	struct action_event ev;
+	int                 dispatch;
+	int                 slot;
+	unsigned int        ordinal;
+	unsigned long long  identity;
+};
+
+struct lane
+{
+	unsigned int          running;
+	unsigned int          head;    // Index of the oldest queued handler.
+	unsigned int          count;
+	struct queued_handler queue[MAX_QUEUED];
+};
+
+struct latency_stats
+{
+	unsigned long long count;
+	timestamp_ns_t     total_ns;
+	timestamp_ns_t     max_ns;
+};
+
+static struct dispatch      g_dispatches[MAX_DISPATCHES];
+static struct child         g_children[MAX_CHILDREN];
+// Completion latency of each entry's dispatches, from the first spawn until the last handler exits.
+static struct latency_stats g_action_stats[CS_COUNT];
+// Lateness of the click window timer expiries.
+static struct latency_stats g_timer_drift;
+
+static struct lane          g_lanes[LANE_COUNT];
+
+// SIGCHLD, and SIGINT, SIGTERM and SIGHUP while the event loop runs, are blocked and read from here, so no
+// signal handler interrupts the daemon.
+static int g_signal_fd = -1;
+
+#define SIGNAL_BIT(signum) (1u << (signum))
+
+static int dispatcher_init(void)
+{
+	sigset_t mask;
+	sigemptyset(&mask);
+	sigaddset(&mask, SIGCHLD);
+	sigprocmask(SIG_BLOCK, &mask, NULL);
+
+	g_signal_fd = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
+	if (g_signal_fd == -1)
+	{
+		fprintf(stderr, "Creating the signal descriptor failed. Error %d.\n", errno);
+		return -1;
+	}
+	return 0;
+}
+
+// Returns the SIGNAL_BIT of every signal received since the last call.
+static unsigned int signals_read(void)
+{
+	unsigned int signals = 0;
+	struct signalfd_siginfo info[8];
+	ssize_t n;
+	while ((n = read(g_signal_fd, info, sizeof(info))) > 0)
+	{
+		size_t i;
+		for (i=0; i<(size_t)n / sizeof(info[0]); ++i)
+			signals |= SIGNAL_BIT(info[i].ssi_signo);
+	}
+	return signals;
+}
+
+// True if the handler is running or queued, including one started before a reload of the same configured
+// handler. Every mode has handlers of its own, but the actions it falls back to the default mode for share the
+// default mode's. Handlers a CANCEL rule signalled no longer count.
+static bool handler_running(unsigned long long identity)
+{
+	int i;
+	for (i=0; i<MAX_CHILDREN; ++i)
+	{
+		if (g_children[i].pid != 0 && !g_children[i].cancelled && g_children[i].identity == identity)
+			return true;
+	}
+
+	int lane;
+	for (lane=0; lane<LANE_COUNT; ++lane)
+	{
+		unsigned int j;
+		for (j=0; j<g_lanes[lane].count; ++j)
+		{
+			const struct queued_handler *q = &g_lanes[lane].queue[(g_lanes[lane].head + j) % MAX_QUEUED];
+			if (q->identity == identity)
+				return true;
+		}
+	}
+	return false;
+}
+
+static bool lane_has_room(enum lane_e lane)
+{
+	return g_lane_limit[lane] == 0 || g_lanes[lane].running < g_lane_limit[lane];
+}
+
+static struct child *child_alloc(void)
+{
+	int i;
+	for (i=0; i<MAX_CHILDREN; ++i)
+	{
+		if (g_children[i].pid == 0)
+			return &g_children[i];
+	}
+	return NULL;
+}
+
+static int dispatch_alloc(void)
+{
+	int i;
+	for (i=0; i<MAX_DISPATCHES; ++i)
+	{
+		if (g_dispatches[i].pending == 0)
+			return i;
+	}
+	return -1;
+}
+
+static void latency_add(struct latency_stats *stats, timestamp_ns_t latency)
+{
+	++stats->count;
+	stats->total_ns += latency;
+	if (latency > stats->max_ns)
+		stats->max_ns = latency;
+}
+
+static void dispatch_completed(struct dispatch *d, timestamp_ns_t now)
+{
+	timestamp_ns_t latency = now - d->started_ns;
+	latency_add(&g_action_stats[d->slot], latency);
+
+	debug(2, "%s (event %llu) completed in %llu us with %u handler(s).\n", d->action_name, d->seq, latency / 1000, d->handlers);
+
+	if (trace_enabled())
+		trace_span(d->action_name, d->seq * CS_COUNT + d->slot, d->origin_ns, now, d->seq);
+}
+
+static void dispatch_handler_done(struct dispatch *d)
+{
+	if (--d->pending == 0)
+		dispatch_completed(d, get_timestamp_ns());
+}
+
+// Spawns the handler command and tracks it as part of the dispatch. Returns false if it could not be started.
+static bool start_handler(const char *cmd, enum lane_e lane, int di, int slot, unsigned int ordinal, unsigned long long identity)
+{
+	struct child *c = child_alloc();
+	if (c == NULL)
+	{
+		fprintf(stderr, "Too many handlers running, skipping %s!\n", cmd);
+		metric_add(&g_metrics.handlers_dropped, 1);
+		return false;
+	}
+
+	unsigned long long seq = g_dispatches[di].seq;
+
+	int out[2] = { -1, -1 };
+	if (trace_enabled())
+	{
+		if (pipe2(out, O_CLOEXEC) != 0)
+			fprintf(stderr, "Creating the output pipe of %s failed. Error %d.\n", cmd, errno);
+		else
+			fcntl(out[0], F_SETFL, O_NONBLOCK);
+	}
+
+	debug(2, "execute_action: executing %s\n", cmd );
+	timestamp_ns_t started = stage_timing() ? get_timestamp_ns() : 0;
+	PROBE3(spawn_start, seq, slot, ordinal);
+	pid_t pid = spawn_handler(cmd, lane, out[1]);
+	if (out[1] != -1)
+		close(out[1]);
+	if (pid < 0)
+	{
+		if (out[0] != -1)
+			close(out[0]);
+		metric_add(&g_metrics.handlers_dropped, 1);
+		return false;
+	}
+
+	// vfork returns once the child has called execve.
+	PROBE3(exec_complete, seq, slot, pid);
+
+	c->pid = pid;
+	c->dispatch = di;
+	c->slot = slot;
+	c->ordinal = ordinal;
+	c->identity = identity;
+	c->lane = lane;
+	c->started_ns = started;
+	c->cancelled = false;
+	c->out_fd = out[0];
+	c->out_length = 0;
+	++g_lanes[lane].running;
+
+	if (stage_timing())
+		stage_done(STAGE_SPAWN, "spawn", 0, started, seq);
+	if (trace_enabled())
+		trace_thread_name(pid, cmd, strlen(cmd));
+	if (g_resume.pending)
+		resume_dispatched();
+	if (c->out_fd != -1)
+		loop_watch(c->out_fd, EPOLLIN, FD_COUNT + (c - g_children));
+	return true;
+}
+
+// Emits the complete lines buffered from the child's stdout as trace events and forwards them to ours.
+// At the end of the output a trailing partial line is emitted too.
+static void child_output_lines(struct child *c, bool end)
+{
+	timestamp_ns_t now = get_timestamp_ns();
+	unsigned int start = 0;
+	unsigned int i;
+	for (i=0; i<c->out_length; ++i)
+	{
+		if (c->out[i] == '\n')
+		{
+			trace_instant("stdout", c->pid, now, c->out + start, i - start);
+			printf("%.*s\n", (int)(i - start), c->out + start);
+			start = i + 1;
+		}
+	}
+
+	// A line longer than the buffer is split.
+	if (start < c->out_length && (end || (start == 0 && c->out_length == MAX_OUTPUT_LINE)))
+	{
+		trace_instant("stdout", c->pid, now, c->out + start, c->out_length - start);
+		printf("%.*s\n", (int)(c->out_length - start), c->out + start);
+		start = c->out_length;
+	}
+
+	memmove(c->out, c->out + start, c->out_length - start);
+	c->out_length -= start;
+	fflush(stdout);
+}
+
+// Reads what the child wrote to its stdout, closing the pipe once it is drained at the end of its output.
+static void child_output(struct child *c, bool exited)
+{
+	for (;;)
+	{
+		ssize_t n = read(c->out_fd, c->out + c->out_length, MAX_OUTPUT_LINE - c->out_length);
+		if (n > 0)
+		{
+			c->out_length += n;
+			child_output_lines(c, false);
+			continue;
+		}
+
+		if (n < 0 && errno == EINTR)
+			continue;
+
+		// EOF, or nothing left to read of an exited handler whose own children still hold the pipe.
+		if (n == 0 || exited || errno != EAGAIN)
+		{
+			child_output_lines(c, true);
+			close(c->out_fd);
+			c->out_fd = -1;
+		}
+		return;
+	}
+}
+
+// Starts queued handlers while their lanes have room, high lane first.
+static void start_queued_handlers(void)
+{
+	int lane;
+	for (lane=0; lane<LANE_COUNT; ++lane)
+	{
+		struct lane *l = &g_lanes[lane];
+		while (l->count != 0 && lane_has_room(lane))
+		{
+			struct queued_handler *q = &l->queue[l->head];
+			l->head = (l->head + 1) % MAX_QUEUED;
+			--l->count;
+
+			struct dispatch *d = &g_dispatches[q->dispatch];
+			patch_handler_env(&q->ev, d->action_name, d->mode);
+			if (!start_handler(q->cmd, lane, q->dispatch, q->slot, q->ordinal, q->identity))
+				dispatch_handler_done(d);
+
+			free(q->cmd);
+			q->cmd = NULL;
+		}
+	}
+}
+
+static bool queue_handler(const char *cmd, enum lane_e lane, const struct action_event *ev, int di, int slot, unsigned int ordinal, unsigned long long identity)
+{
+	struct lane *l = &g_lanes[lane];
+	if (l->count == MAX_QUEUED)
+	{
+		fprintf(stderr, "Too many handlers queued, skipping %s!\n", cmd);
+		metric_add(&g_metrics.handlers_dropped, 1);
+		return false;
+	}
+
+	struct queued_handler *q = &l->queue[(l->head + l->count) % MAX_QUEUED];
+	q->cmd = strdup(cmd);
+	if (q->cmd == NULL)
+		return false;
+
+	q->ev = *ev;
+	q->dispatch = di;
+	q->slot = slot;
+	q->ordinal = ordinal;
+	q->identity = identity;
+	++l->count;
+
+	debug(2, "execute_action: queued %s\n", cmd);
+	return true;
+}
+
+// Reaps every exited child, completing the dispatches whose last handler it was.
+static void reap_children(void)
+{
+	for (;;)
+	{
+		int status;
+		pid_t pid = waitpid(-1, &status, WNOHANG);
+		if (pid <= 0)
+			break;
+
+		int i;
+		for (i=0; i<MAX_CHILDREN; ++i)
+		{
+			if (g_children[i].pid == pid)
+				break;
+		}
+		if (i == MAX_CHILDREN)
+			continue;
+
+		struct child *c = &g_children[i];
+		struct dispatch *d = &g_dispatches[c->dispatch];
+		if (c->out_fd != -1)
+			child_output(c, true);
+		if (stage_timing())
+			stage_done(STAGE_RUNTIME, d->action_name, pid, c->started_ns, d->seq);
+		c->pid = 0;
+		--g_lanes[c->lane].running;
+
+		debug(3, "Handler %u of %s exited with status %d.\n", c->ordinal, d->action_name, WIFEXITED(status) ? WEXITSTATUS(status) : -1);
+		PROBE4(child_exit, d->seq, c->slot, pid, status);
+		if (g_journal.header != NULL)
+			journal_append(JOURNAL_EXIT, d->seq, d->button, c->slot, c->ordinal, 0, pid, status, get_timestamp_ns());
+
+		dispatch_handler_done(d);
+	}
+
+	start_queued_handlers();
+}
+
+// Running and queued handlers.
+static unsigned int handlers_pending(void)
+{
+	return g_lanes[LANE_HIGH].running + g_lanes[LANE_HIGH].count + g_lanes[LANE_LOW].running + g_lanes[LANE_LOW].count;
+}
+
+// Forgets the handlers waiting for room in their lane, for the shutdown.
+static void drop_queued_handlers(void)
+{
+	int lane;
+	for (lane=0; lane<LANE_COUNT; ++lane)
+	{
+		struct lane *l = &g_lanes[lane];
+		while (l->count != 0)
+		{
+			struct queued_handler *q = &l->queue[l->head];
+			debug(2, "Not starting queued %s.\n", q->cmd);
+			free(q->cmd);
+			q->cmd = NULL;
+			l->head = (l->head + 1) % MAX_QUEUED;
+			--l->count;
+		}
+	}
+}
+
+// Sends signum to the process group of the handler, which spawn_handler made it lead.
+static void signal_handler(const struct child *c, int signum)
+{
+	if (killpg(c->pid, signum) != 0)
+		kill(c->pid, signum);
+}
+
+// Sends signum to every running handler, returning how many there were.
+static unsigned int signal_handlers(int signum)
+{
+	unsigned int count = 0;
+	int i;
+	for (i=0; i<MAX_CHILDREN; ++i)
+	{
+		if (g_children[i].pid != 0)
+		{
+			signal_handler(&g_children[i], signum);
+			++count;
+		}
+	}
+	return count;
+}
+
+static bool action_in_range(int action, int first, int last)
+{
+	return action >= first && action <= last;
+}
+
+// Terminates the running handlers of the actions the CANCEL rules of action cancel, and drops their queued ones.
+// Runs before the action's own handlers start, so an action cancelling itself only ends its earlier instances.
+static void cancel_handlers(int action, const char *action_name)
+{
+	unsigned int r;
+	for (r=0; r<g_config.cancel_count; ++r)
+	{
+		const struct config_cancel *rule = &g_config.cancels[r];
+		if (!action_in_range(action, rule->trigger_first, rule->trigger_last))
+			continue;
+
+		int i;
+		for (i=0; i<MAX_CHILDREN; ++i)
+		{
+			struct child *c = &g_children[i];
+			if (c->pid == 0 || c->cancelled || !action_in_range(g_dispatches[c->dispatch].action, rule->target_first, rule->target_last))
+				continue;
+
+			debug(2, "%s cancels handler %u of %s.\n", action_name, c->ordinal, g_dispatches[c->dispatch].action_name);
+			signal_handler(c, SIGTERM);
+			c->cancelled = true;
+			metric_add(&g_metrics.handlers_cancelled, 1);
+		}
+
+		// Keeps the queued handlers the rule does not cancel, in their order.
+		int lane;
+		for (lane=0; lane<LANE_COUNT; ++lane)
+		{
+			struct lane *l = &g_lanes[lane];
+			unsigned int count = l->count;
+			unsigned int kept = 0;
+			unsigned int j;
+			for (j=0; j<count; ++j)
+			{
+				struct queued_handler *q = &l->queue[(l->head + j) % MAX_QUEUED];
+				if (!action_in_range(g_dispatches[q->dispatch].action, rule->target_first, rule->target_last))
+				{
+					l->queue[(l->head + kept++) % MAX_QUEUED] = *q;
+					continue;
+				}
+
+				debug(2, "%s cancels queued %s.\n", action_name, q->cmd);
+				free(q->cmd);
+				q->cmd = NULL;
+				metric_add(&g_metrics.handlers_cancelled, 1);
+				dispatch_handler_done(&g_dispatches[q->dispatch]);
+			}
+			l->count = kept;
+		}
+	}
+}
+
+// Set by --replay: handler commands are printed instead of run.
+static bool g_dry_run = false;
+static unsigned long long g_dry_run_commands = 0;
+
+static void dry_run_action(const struct action_event *ev, const char *action_name, const struct config_entry *entry)
+{
+	char cmd[2 * MAX_PATH_LENGTH + 64];
+	int h;
+	for (h = entry->first_handler; h >= 0; h = g_config.handlers[h].next)
+	{
+		const struct config_handler *handler = &g_config.handlers[h];
+		if (handler->condition_count != 0 && handler->builtin == BUILTIN_NONE && !handler_selected(handler))
+			continue;
+		if (handler->builtin == BUILTIN_MODE)
+			snprintf(cmd, sizeof(cmd), ":mode %s", g_config.modes[handler->mode].name);
+		else if (handler->builtin != BUILTIN_NONE)
+			snprintf(cmd, sizeof(cmd), "%.*s %.*s %s", (int)handler->value.len, handler->value.ptr,
+				(int)handler->key.len, handler->key.ptr, kv_find(handler->key) ? kv_find(handler->key)->value : "");
+
+		timestamp_ns_t start = g_stage_sampling ? get_timestamp_ns() : 0;
+		if (handler->builtin == BUILTIN_NONE && get_handler_command(handler, ev, cmd, sizeof(cmd)) < 0)
+			continue;
+		if (g_stage_sampling)
+			stage_done(STAGE_EXPAND, NULL, 0, start, ev->seq);
+
+		++g_dry_run_commands;
+		if (g_debug >= 1)
+			printf("%llu.%03llu %s %s\n", ev->ts_ns / 1000000000, ev->ts_ns / 1000000 % 1000, action_name, cmd);
+	}
+}
+
+// Control socket for inzown-btn-ctl. Every connection sends one command line and is closed after the reply,
+// except for tail, which streams the classified actions until the client disconnects.
+enum { MAX_CONTROL_CLIENTS = 8 };
+enum { CONTROL_LINE_SIZE   = 128 };
+
+struct control_client
+{
+	int    fd;     // -1 if the slot is free.
+	bool   tail;
+	size_t length;
+	char   line[CONTROL_LINE_SIZE];
+};
+
+struct control
+{
+	int                   listen_fd;
+	const char           *path;
+	unsigned int          tails;
+	struct control_client clients[MAX_CONTROL_CLIENTS];
+};
+
+static struct control g_control = { .listen_fd = -1 };
+
+// The clients are local and the replies small. A client whose socket buffer is full loses the rest, so that
+// it can never stall the event loop.
+static void control_write(struct control_client *c, const char *buf, size_t len)
+{
+	while (len > 0)
+	{
+		ssize_t n = send(c->fd, buf, len, MSG_NOSIGNAL | MSG_DONTWAIT);
+		if (n == -1 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			return;
+		buf += n;
+		len -= n;
+	}
+}
+
+static void control_printf(struct control_client *c, const char *fmt, ...)
+{
+	char buf[512];
+	va_list args;
+	va_start(args, fmt);
+	int n = vsnprintf(buf, sizeof(buf), fmt, args);
+	va_end(args);
+	if (n > 0)
+		control_write(c, buf, (size_t)n < sizeof(buf) ? (size_t)n : sizeof(buf) - 1);
+}
+
+// Streams a line to the tail clients, prefixed with the wall clock time.
+static void control_tail_printf(const char *fmt, ...)
+{
+	struct timespec now;
+	clock_gettime(CLOCK_REALTIME, &now);
+	struct tm tm;
+	localtime_r(&now.tv_sec, &tm);
+
+	char line[128];
+	size_t n = strftime(line, sizeof(line), "%Y-%m-%d %H:%M:%S", &tm);
+	n += snprintf(line + n, sizeof(line) - n, ".%03ld ", now.tv_nsec / 1000000);
+
+	va_list argp;
+	va_start(argp, fmt);
+	int len = vsnprintf(line + n, sizeof(line) - n, fmt, argp);
+	va_end(argp);
+	n = len < 0 ? n : n + len < sizeof(line) ? n + len : sizeof(line) - 1;
+
+	int i;
+	for (i=0; i<MAX_CONTROL_CLIENTS; ++i)
+	{
+		if (g_control.clients[i].fd != -1 && g_control.clients[i].tail)
+			control_write(&g_control.clients[i], line, n);
+	}
+}
+
+// Streams a classified action to the tail clients.
+static void control_tail(const struct action_event *ev, const char *action_name)
+{
+	control_tail_printf("%llu %s clicks %u hold_ms %u mode %s\n", ev->seq, action_name, ev->clicks, ev->hold_ms, g_config.modes[g_mode].name);
+}
+
+// Makes mode m current, telling the tail clients.
+static void mode_switch(unsigned int m)
+{
+	if (m == g_mode)
+		return;
+
+	debug(1, "Switching from mode %s to %s.\n", g_config.modes[g_mode].name, g_config.modes[m].name);
+	mode_set(m);
+	metric_add(&g_metrics.mode_switches, 1);
+	if (g_control.tails != 0)
+		control_tail_printf("mode %s\n", g_config.modes[m].name);
+}
+
+// Tells the tail clients the new value of a key.
+static void kv_tail(const struct kv_pair *pair)
+{
+	if (pair != NULL && g_control.tails != 0)
+		control_tail_printf("kv %s %s\n", pair->key, pair->value);
+}
+
+// Runs the entry's handlers the daemon implements itself, before the others of the action are started.
+static void run_builtins(const struct config_entry *entry)
+{
+	int h;
+	for (h = entry->first_handler; h >= 0; h = g_config.handlers[h].next)
+	{
+		const struct config_handler *handler = &g_config.handlers[h];
+		if (handler->builtin == BUILTIN_NONE || !handler_selected(handler))
+			continue;
+
+		long long n = 1;
+		switch (handler->builtin)
+		{
+		case BUILTIN_NONE:
+			break;
+		case BUILTIN_MODE:
+			mode_switch(handler->mode);
+			break;
+		case BUILTIN_SET:
+			kv_tail(kv_set(handler->key, handler->args));
+			break;
+		case BUILTIN_TOGGLE:
+			kv_tail(kv_toggle(handler->key));
+			break;
+		case BUILTIN_INCR:
+			if (handler->args.len != 0)
+				parse_slice_ll(handler->args, &n);
+			kv_tail(kv_incr(handler->key, n));
+			break;
+		}
+	}
+}
+
+static void execute_action(const struct action_event *ev)
+{
+	char cmd[2 * MAX_PATH_LENGTH + 64];
+	char action_name[ ACTION_NAME_SIZE+1 ];
+
+	if (ev->action < 0 || ev->action >= A_COUNT)
+	{
+		debug(1, "execute_action: invalid action %u!\n", ev->action);
+		return;
+	}
+
+	timestamp_ns_t lookup_start = stage_timing() ? get_timestamp_ns() : 0;
+
+	size_t prefix = strlen(strcpy(action_name, chord_prefix(ev->slot_base)));
+	get_action_name(ev->action, action_name + prefix, ev->clicks, ev->hold_ms);
+
+	int name_slot = ev->slot_base + get_action_slot(ev->action, ev->clicks, ev->hold_ms);
+	metric_add(&g_metrics.events[name_slot], 1);
+	if (g_control.tails != 0)
+		control_tail(ev, action_name);
+	if (g_journal.header != NULL)
+		journal_append(JOURNAL_ACTION, ev->seq, ev->button, name_slot, ev->clicks, ev->hold_ms, 0, 0, ev->ts_ns);
+	if (g_config.cancel_count != 0 && !g_dry_run)
+		cancel_handlers(slot_action(name_slot), action_name);
+
+	const struct config_entry *entry = get_action_entry(name_slot);
+	PROBE5(action_resolved, ev->seq, ev->action, ev->clicks, ev->hold_ms, entry ? (int)(entry - g_mode_entries) : -1);
+	if (stage_timing())
+		stage_done(STAGE_LOOKUP, "lookup", 0, lookup_start, ev->seq);
+	if (entry == NULL || entry->handler_count == 0)
+	{
+		debug(1, "execute_action: no command for action %s : click count %u hold time %u (%u seconds)\n", action_name, ev->clicks, ev->hold_ms, TICK_2_SECONDS(ev->hold_ms));
+		return;
+	}
+
+	// The handlers see the mode the action was looked up in, even if it switches modes.
+	const char *mode = g_config.modes[g_mode].name;
+	int slot = entry - g_mode_entries;
+	if (entry->builtin_count != 0)
+		run_builtins(entry);
+
+	if (g_dry_run)
+	{
+		dry_run_action(ev, action_name, entry);
+		return;
+	}
+	if (entry->builtin_count == entry->handler_count)
+		return;
+
+	int di = dispatch_alloc();
+	if (di < 0)
+	{
+		fprintf(stderr, "execute_action: too many actions in flight, dropping %s!\n", action_name);
+		metric_add(&g_metrics.actions_dropped, 1);
+		return;
+	}
+
+	struct dispatch *d = &g_dispatches[di];
+	d->handlers = 0;
+	d->slot = slot;
+	d->action = slot_action(name_slot);
+	d->button = ev->button;
+	strcpy(d->action_name, action_name);
+	strcpy(d->mode, mode);
+	d->seq = ev->seq;
+	d->origin_ns = ev->origin_ns;
+	d->started_ns = get_timestamp_ns();
+
+	patch_handler_env(ev, action_name, mode);
+
+	unsigned int ordinal = 0;
+	int h;
+	for (h = entry->first_handler; h >= 0; h = g_config.handlers[h].next, ++ordinal)
+	{
+		const struct config_handler *handler = &g_config.handlers[h];
+		if (handler->builtin != BUILTIN_NONE)
+			continue;
+		if (handler->condition_count != 0 && !handler_selected(handler))
+		{
+			debug(2, "execute_action: the conditions of handler %u of %s do not hold, skipping it.\n", ordinal, action_name);
+			continue;
+		}
+
+		if (handler->concurrency == CC_SINGLE && handler_running(handler->identity))
+		{
+			debug(2, "execute_action: handler %u of %s is still running, skipping it.\n", ordinal, action_name);
+			continue;
+		}
+
+		timestamp_ns_t start = g_stage_sampling ? get_timestamp_ns() : 0;
+		int n = get_handler_command(handler, ev, cmd, sizeof(cmd));
+		if (n < 0)
+		{
+			debug(1, "execute_action: getting command for action %s handler %u resulted in error %d!\n", action_name, ordinal, n);
+			continue;
+		}
+		if (g_stage_sampling)
+			stage_done(STAGE_EXPAND, NULL, 0, start, ev->seq);
+
+		bool started = lane_has_room(handler->lane) && g_lanes[handler->lane].count == 0
+			? start_handler(cmd, handler->lane, di, slot, ordinal, handler->identity)
+			: queue_handler(cmd, handler->lane, ev, di, slot, ordinal, handler->identity);
+
+		if (started)
+		{
+			++d->pending;
+			++d->handlers;
+		}
+	}
+}
+
+// Sequence number of the last button edge.
+static unsigned long long g_event_seq = 0;
+
+static void on_button_event(const struct inzown_btn_event *e, void *user)
+{
+	struct action_event ev = { (enum action_e)e->action, e->clicks, e->hold_ms, e->ts_ns, g_event_seq, e->origin_ns, (int)(intptr_t)user, e->button };
+	execute_action(&ev);
+}
+
+// The click and hold classification of a button or chord, with the probes, metrics and trace events around it.
+// id is the GPIO, slot_base selects the entries of the actions as in struct action_event.
+static void button_init(struct inzown_btn_machine *b, int id, int slot_base)
+{
+	inzown_btn_machine_init(b, id, g_click_count_limit, on_button_event, (void *)(intptr_t)slot_base);
+}
+
+// Returns true if the click window timer has to be started again, to expire in CLICK_TIMEOUT_MS.
+static bool button_edge(struct inzown_btn_machine *b, bool pressed, timestamp_ns_t timestamp_ns)
+{
+	unsigned long long repeated_edges = b->repeated_edges;
+	b->click_count_limit = g_click_count_limit; // Reloads may change it.
+
+	bool restart_timer = inzown_btn_machine_edge(b, pressed, timestamp_ns);
+	if (b->repeated_edges != repeated_edges)
+		metric_add(&g_metrics.repeated_edges, 1);
+	if (b->repeated_edges == repeated_edges || pressed)
+		PROBE4(transition, g_event_seq, b->button_down, b->timer_running, b->num_pressed);
+	return restart_timer;
+}
+
+static void button_timeout(struct inzown_btn_machine *b, timestamp_ns_t timestamp_ns)
+{
+	PROBE2(timer_expiry, g_event_seq, b->num_pressed);
+	if (trace_enabled())
+		trace_complete("click window", 0, b->gesture_start_ns, timestamp_ns, g_event_seq);
+	inzown_btn_machine_timeout(b, timestamp_ns);
+	PROBE4(transition, g_event_seq, b->button_down, b->timer_running, b->num_pressed);
+}
+
+// Where the button edges come from.
+enum backend_e
+{
+	BACKEND_GPIO, // The sysfs value file, signalling POLLPRI and read again from its start.
+	BACKEND_PIPE, // A '0' or '1' character per edge, written by the --soak generator. EOF ends the loop.
+};
+
+// Resource and timing health of the event loop, sampled by --soak at a fixed interval.
+enum { SOAK_INTERVAL = 10 }; // Seconds.
+
+struct soak_sample
+{
+	timestamp_ns_t     at;
+	long               rss_kib;
+	int                fds;
+	int                zombies;
+	unsigned long long edges;
+	unsigned long long drift_count;
+	timestamp_ns_t     drift_total_ns;
+	unsigned long long handlers_dropped;
+	unsigned long long actions_dropped;
+	timestamp_ns_t     cpu_ns;         // User and system time of the daemon, not of its handlers.
+};
+
+struct soak
+{
+	bool               active;
+	unsigned int       samples;
+	timestamp_ns_t     start_ns;
+	timestamp_ns_t     next_ns;
+	struct soak_sample start;
+	struct soak_sample baseline; // The first interval's sample, once the daemon warmed up.
+	struct soak_sample last;
+	timestamp_ns_t     first_drift_ns;
+	timestamp_ns_t     last_drift_ns;
+};
+
+static struct soak g_soak;
+
+static long soak_rss_kib(void)
+{
+	long pages = 0;
+	FILE *f = fopen("/proc/self/statm", "r");
+	if (f != NULL)
+	{
+		if (fscanf(f, "%*s %ld", &pages) != 1)
+			pages = 0;
+		fclose(f);
+	}
+	return pages * (sysconf(_SC_PAGESIZE) / 1024);
+}
+
+static int soak_fd_count(void)
+{
+	DIR *dir = opendir("/proc/self/fd");
+	if (dir == NULL)
+		return -1;
+
+	int count = 0;
+	struct dirent *d;
+	while ((d = readdir(dir)) != NULL)
+	{
+		if (d->d_name[0] != '.')
+			++count;
+	}
+	closedir(dir);
+	return count - 1; // The directory itself.
+}
+
+// Children of ours that exited without being reaped.
+static int soak_zombie_count(void)
+{
+	DIR *dir = opendir("/proc");
+	if (dir == NULL)
+		return -1;
+
+	pid_t self = getpid();
+	int count = 0;
+	struct dirent *d;
+	while ((d = readdir(dir)) != NULL)
+	{
+		if (d->d_name[0] < '0' || d->d_name[0] > '9')
+			continue;
+
+		char path[300];
+		snprintf(path, sizeof(path), "/proc/%s/stat", d->d_name);
+		FILE *f = fopen(path, "r");
+		if (f == NULL)
+			continue;
+
+		// The command name may contain spaces, the fields after it start at the last ')'.
+		char line[512];
+		if (fgets(line, sizeof(line), f) != NULL)
+		{
+			char state;
+			int ppid;
+			const char *p = strrchr(line, ')');
+			if (p != NULL && sscanf(p + 1, " %c %d", &state, &ppid) == 2 && state == 'Z' && ppid == self)
+				++count;
+		}
+		fclose(f);
+	}
+	closedir(dir);
+	return count;
+}
+
+static void soak_take_sample(struct soak_sample *sample, timestamp_ns_t now)
+{
+	sample->at = now;
+	sample->rss_kib = soak_rss_kib();
+	sample->fds = soak_fd_count();
+	sample->zombies = soak_zombie_count();
+	sample->edges = g_event_seq;
+	sample->drift_count = g_timer_drift.count;
+	sample->drift_total_ns = g_timer_drift.total_ns;
+	sample->handlers_dropped = g_metrics.handlers_dropped;
+	sample->actions_dropped = g_metrics.actions_dropped;
+
+	struct rusage usage;
+	getrusage(RUSAGE_SELF, &usage);
+	sample->cpu_ns = (usage.ru_utime.tv_sec + usage.ru_stime.tv_sec) * 1000000000ull
+		+ (usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) * 1000ull;
+}
+
+// Share of the time between two samples the daemon spent on a CPU, in percent.
+static double soak_cpu_percent(const struct soak_sample *from, const struct soak_sample *to)
+{
+	return to->at > from->at ? (to->cpu_ns - from->cpu_ns) * 100.0 / (to->at - from->at) : 0;
+}
+
+// Average timer drift between two samples.
+static timestamp_ns_t soak_drift(const struct soak_sample *from, const struct soak_sample *to)
+{
+	unsigned long long count = to->drift_count - from->drift_count;
+	return count ? (to->drift_total_ns - from->drift_total_ns) / count : 0;
+}
+
+static void soak_print(const struct soak_sample *sample, const struct soak_sample *previous)
+{
+	printf("%6llus  rss %6ld KiB  fds %3d  zombies %2d  edges %9llu  drift %6.0f us  cpu %3.0f%%  dropped %llu handler(s) %llu action(s)\n",
+		(sample->at - g_soak.start_ns) / 1000000000, sample->rss_kib, sample->fds, sample->zombies, sample->edges,
+		soak_drift(previous, sample) / 1e3, soak_cpu_percent(previous, sample), sample->handlers_dropped, sample->actions_dropped);
+	fflush(stdout);
+}
+
+// Called on every wakeup of the loop while soaking, samples once per interval.
+static void soak_tick(timestamp_ns_t now)
+{
+	if (g_soak.samples != 0 && now < g_soak.next_ns)
+		return;
+
+	struct soak_sample sample;
+	soak_take_sample(&sample, now);
+	if (g_soak.samples == 0)
+	{
+		g_soak.start_ns = now;
+		g_soak.start = sample;
+	}
+	else
+	{
+		soak_print(&sample, &g_soak.last);
+		g_soak.last_drift_ns = soak_drift(&g_soak.last, &sample);
+		if (g_soak.samples == 1)
+			g_soak.first_drift_ns = g_soak.last_drift_ns;
+	}
+	if (g_soak.samples <= 1)
+		g_soak.baseline = sample;
+	g_soak.last = sample;
+	g_soak.next_ns = now + SOAK_INTERVAL * 1000000000ull;
+	++g_soak.samples;
+}
+
+enum { DEFAULT_CHORD_WINDOW_MS = 150 };
+
+// A classification of the event loop with its click window timer.
+struct loop_machine
+{
+	struct inzown_btn_machine button;
+	int                       timerfd;  // -1 until the machine is used.
+	timestamp_ns_t            timer_deadline;
+};
+
+// The event loop's classification state, which the control socket's inject command feeds too. Machine i
+// classifies button i, machine MAX_BUTTONS + c chord c. A chord matches when the last of its buttons is pressed
+// within the chord window of the first. It then captures its buttons, whose edges only press and release the
+// chord until all of them are up again, and their own gestures are dropped.
+struct loop_state
+{
+	struct loop_machine machines[MAX_BUTTONS + MAX_CHORDS];
+	unsigned int        pressed;                 // Bit per button.
+	unsigned int        captured;                // Buttons owned by a matched chord.
+	unsigned int        chords_matched;          // Bit per chord owning its buttons.
+	unsigned int        chord_masks[MAX_CHORDS]; // The buttons of each chord, 0 unless they all are --gpio buttons.
+	timestamp_ns_t      chord_window_ns;
+	timestamp_ns_t      pressed_ns[MAX_BUTTONS];
+	unsigned int        config_generation;       // Of the configuration the chords were mapped from.
+};
+
+// A CLOCK_BOOTTIME_ALARM timer wakes a suspended system up to end the click window.
+static int loop_timer_create(void)
+{
+	int timerfd;
+	if (g_suspend_safe)
+	{
+		timerfd = timerfd_create(CLOCK_BOOTTIME_ALARM, TFD_NONBLOCK | TFD_CLOEXEC);
+		if (timerfd == -1 && errno == EPERM)
+		{
+			fprintf(stderr, "The click timer can not wake the system up without CAP_WAKE_ALARM.\n");
+			timerfd = timerfd_create(CLOCK_BOOTTIME, TFD_NONBLOCK | TFD_CLOEXEC);
+		}
+	}
+	else
+		timerfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+	if (timerfd == -1)
+		fprintf(stderr, "Creating timer failed. Error %d.\n", errno);
+	return timerfd;
+}
+
+// Creates and watches the timer of machine m unless it has one.
+static int loop_machine_timer(struct loop_state *loop, unsigned int m)
+{
+	struct loop_machine *lm = &loop->machines[m];
+	if (lm->timerfd != -1)
+		return 0;
+
+	lm->timerfd = loop_timer_create();
+	if (lm->timerfd == -1)
+		return errno;
+
+	// With --suspend-safe the kernel holds a wakeup source from the end of a click window until the next
+	// epoll_wait, so the system can not suspend before it was dispatched.
+	return loop_watch(lm->timerfd, EPOLLIN | (g_suspend_safe ? EPOLLWAKEUP : 0), FD_TIMER + m);
+}
+
+// Forgets the gesture of machine m and stops its click window.
+static void loop_machine_reset(struct loop_state *loop, unsigned int m, int id, int slot_base)
+{
+	struct loop_machine *lm = &loop->machines[m];
+	button_init(&lm->button, id, slot_base);
+	if (lm->timerfd != -1)
+	{
+		struct itimerspec its;
+		memset(&its, 0, sizeof(its));
+		timerfd_settime(lm->timerfd, 0, &its, NULL);
+	}
+}
+
+// Classifies an edge of machine m, (re)starting its click window if it began or extended one.
+static void loop_machine_edge(struct loop_state *loop, unsigned int m, bool pressed, timestamp_ns_t timestamp_ns)
+{
+	struct loop_machine *lm = &loop->machines[m];
+	if (button_edge(&lm->button, pressed, timestamp_ns))
 	{
-		"none",
-		"rising",
-		"falling",
-		"both",
-	};
+		// The click window is measured from the edge, however long its dispatch took.
+		lm->timer_deadline = timestamp_ns + CLICK_TIMEOUT_MS * 1000000ull;
 
-	const int n = strlen(edge2str[edge])+1;
+		struct itimerspec its;
+		memset(&its, 0, sizeof(its));
 
-	int result = write(fd, edge2str[edge], n);
-	if (result != n)
-	{
-		fprintf(stderr, "Failed writing to %s! Error %d.\n", gpio, errno);
-		close(fd);
-		return -1;
+		its.it_value.tv_sec = lm->timer_deadline / 1000000000;
+		its.it_value.tv_nsec = lm->timer_deadline % 1000000000;
+		timerfd_settime(lm->timerfd, TFD_TIMER_ABSTIME, &its, 0); // Start the timer.
 	}
-	int err = close(fd);
-	if (err != 0)
+}
+
+// Maps the chords of the configuration to masks of the buttons. A chord whose buttons changed starts over.
+static void loop_chords_update(struct loop_state *loop)
+{
+	loop->config_generation = g_config_generation;
+	loop->chord_window_ns = config_uint(&g_config, CS_CHORD_WINDOW_MS, DEFAULT_CHORD_WINDOW_MS) * 1000000ull;
+
+	unsigned int c;
+	for (c=0; c<MAX_CHORDS; ++c)
 	{
-		fprintf(stderr, "Failed closing %s! Error %d.\n", gpio, errno);
-		return -1;
+		const struct config_chord *chord = &g_config.chords[c];
+		unsigned int mask = 0;
+		unsigned int i;
+		for (i=0; c<g_config.chord_count && i<chord->pin_count; ++i)
+		{
+			unsigned int b = 0;
+			while (b < g_button_count && g_button_pins[b] != chord->pins[i])
+				++b;
+			if (b == g_button_count)
+			{
+				debug(1, "GPIO %d of %s is not a --gpio button, ignoring the chord.\n", chord->pins[i], chord->prefix);
+				mask = 0;
+				break;
+			}
+			mask |= 1u << b;
+		}
+		if (mask == loop->chord_masks[c])
+			continue;
+
+		if (loop->chords_matched & (1u << c))
+		{
+			loop->captured &= ~loop->chord_masks[c];
+			loop->chords_matched &= ~(1u << c);
+		}
+		loop->chord_masks[c] = mask;
+		if (mask != 0)
+			loop_machine_timer(loop, MAX_BUTTONS + c);
+		loop_machine_reset(loop, MAX_BUTTONS + c, mask ? chord->pins[0] : 0, CS_CHORD_0 + c * CS_ACTION_COUNT);
 	}
-	return 0;
 }
 
-static int gpio_set_active_low(int pin, bool state)
+// Matches the chords the press of button i completes. Returns true if one took the press.
+static bool loop_chord_match(struct loop_state *loop, unsigned int i, timestamp_ns_t timestamp_ns)
 {
-	if (!gpio_is_pin_valid(pin))
+	unsigned int bit = 1u << i;
+	unsigned int c;
+	for (c=0; c<MAX_CHORDS; ++c)
 	{
-		fprintf(stderr, "Invalid pin number %d!\n", pin);
-		return -1;
+		unsigned int mask = loop->chord_masks[c];
+		if ((mask & bit) == 0 || (loop->pressed & mask) != mask || (loop->captured & mask) != 0)
+			continue;
+
+		unsigned int b;
+		for (b=0; b<g_button_count; ++b)
+		{
+			if ((mask & (1u << b)) && timestamp_ns - loop->pressed_ns[b] > loop->chord_window_ns)
+				break;
+		}
+		if (b != g_button_count) // Not pressed together.
+			continue;
+
+		debug(2, "Chord %s matched.\n", g_config.chords[c].prefix);
+		loop->captured |= mask;
+		loop->chords_matched |= 1u << c;
+		for (b=0; b<g_button_count; ++b)
+		{
+			if ((mask & (1u << b)) == 0)
+				continue;
+
+			// The buttons that already ran their DOWN are released as far as their handlers can tell.
+			if (loop->machines[b].button.button_down)
+			{
+				struct inzown_btn_event up = { INZOWN_BTN_UP, 0, 0, timestamp_ns, timestamp_ns, g_button_pins[b] };
+				on_button_event(&up, (void *)(intptr_t)0);
+			}
+			loop_machine_reset(loop, b, g_button_pins[b], 0);
+		}
+		loop_machine_edge(loop, MAX_BUTTONS + c, true, timestamp_ns);
+		return true;
 	}
+	return false;
+}
 
-	char gpio[64];
+// An edge of a button a chord captured. The chord is pressed while all of its buttons are.
+static void loop_chord_edge(struct loop_state *loop, unsigned int bit, timestamp_ns_t timestamp_ns)
+{
+	unsigned int c = 0;
+	while (!((loop->chords_matched & (1u << c)) && (loop->chord_masks[c] & bit)))
+		++c;
 
-	snprintf(gpio, sizeof(gpio), "/sys/class/gpio/gpio%d/active_low", pin);
+	unsigned int mask = loop->chord_masks[c];
+	bool pressed = (loop->pressed & mask) == mask;
+	if (pressed != loop->machines[MAX_BUTTONS + c].button.button_down)
+		loop_machine_edge(loop, MAX_BUTTONS + c, pressed, timestamp_ns);
 
-	int fd = open(gpio, O_WRONLY);
-	if (fd == -1)
+	if ((loop->pressed & mask) == 0)
 	{
-		fprintf(stderr, "Failed to open %s! Error %d.\n", gpio, errno);
-		return -1;
+		loop->captured &= ~mask;
+		loop->chords_matched &= ~(1u << c);
 	}
+}
+
+// Classifies an edge of button i read at timestamp_ns.
+static void loop_edge(struct loop_state *loop, unsigned int i, bool pressed, timestamp_ns_t timestamp_ns)
+{
+	++g_event_seq;
+	PROBE3(edge_read, g_event_seq, pressed, timestamp_ns);
+	if (trace_enabled())
+		trace_complete(pressed ? "edge down" : "edge up", 0, timestamp_ns, get_timestamp_ns(), g_event_seq);
+
+	if (loop->config_generation != g_config_generation)
+		loop_chords_update(loop);
 
-	int result = write(fd, state?"1":"0", 1);
-	if (result != 1)
+	unsigned int bit = 1u << i;
+	if (pressed)
 	{
-		fprintf(stderr, "Failed writing to %s! Error %d.\n", gpio, errno);
-		close(fd);
-		return -1;
+		loop->pressed |= bit;
+		loop->pressed_ns[i] = timestamp_ns;
 	}
-	int err = close(fd);
-	if (err != 0)
+	else
+		loop->pressed &= ~bit;
+
+	if (loop->captured & bit)
+		loop_chord_edge(loop, bit, timestamp_ns);
+	else if (!pressed || !loop_chord_match(loop, i, timestamp_ns))
+		loop_machine_edge(loop, i, pressed, timestamp_ns);
+}
+
+// No gesture is in progress.
+static bool loop_idle(const struct loop_state *loop)
+{
+	unsigned int m;
+	for (m=0; m<MAX_BUTTONS + MAX_CHORDS; ++m)
 	{
-		fprintf(stderr, "Failed closing %s! Error %d.\n", gpio, errno);
-		return -1;
+		if (loop->machines[m].button.timer_running || loop->machines[m].button.button_down)
+			return false;
 	}
-	return 0;
+	return true;
 }
 
-static int gpio_open(int pin)
+static int control_start(const char *path)
 {
-	if (!gpio_is_pin_valid(pin))
-	{
-		fprintf(stderr, "Invalid pin number %d!\n", pin);
+	int i;
+	for (i=0; i<MAX_CONTROL_CLIENTS; ++i)
+		g_control.clients[i].fd = -1;
+
+	g_control.listen_fd = listen_unix(path, "control", SOCK_NONBLOCK);
+	if (g_control.listen_fd == -1)
 		return -1;
-	}
 
-	char gpio[64];
+	// It can inject actions and reload the configuration, so only root and the socket's group may connect.
+	chmod(path, 0660);
+	g_control.path = path;
+
+	// The stats and latency commands report the metrics.
+	g_metrics_enabled = true;
+	return 0;
+}
 
-	snprintf(gpio, sizeof(gpio), "/sys/class/gpio/gpio%d/value", pin);
+static void control_stop(void)
+{
+	if (g_control.path != NULL)
+		unlink(g_control.path);
+}
 
-	int fd = open(gpio, O_RDONLY);
+static void control_close(struct control_client *c)
+{
+	if (c->tail)
+		--g_control.tails;
+	close(c->fd);
+	c->fd = -1;
+}
 
+static void control_accept(void)
+{
+	int fd = accept4(g_control.listen_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
 	if (fd == -1)
+		return;
+
+	int i;
+	for (i=0; i<MAX_CONTROL_CLIENTS && g_control.clients[i].fd != -1; ++i)
+		;
+	if (i == MAX_CONTROL_CLIENTS || loop_watch(fd, EPOLLIN, FD_CONTROL_CLIENT + i) != 0)
 	{
-		fprintf(stderr, "Failed opening %s! Error %d.\n", gpio, errno);
+		debug(1, "Too many control clients, closing a new one.\n");
+		close(fd);
+		return;
 	}
 
-	return fd;
+	struct control_client *c = &g_control.clients[i];
+	c->fd = fd;
+	c->tail = false;
+	c->length = 0;
 }
 
-static int gpio_close(int fd)
+static void control_stats(struct control_client *c)
 {
-	int err = close(fd);
-	if (err != 0)
+	char *buf = NULL;
+	size_t len = 0;
+	FILE *f = open_memstream(&buf, &len);
+	if (f == NULL)
+		return;
+	metrics_render(f);
+	fclose(f);
+	control_write(c, buf, len);
+	free(buf);
+}
+
+// Upper bound of the bucket holding quantile q of the samples, 0 for an empty or +Inf bucket.
+static timestamp_ns_t histogram_quantile(const struct histogram *h, unsigned long long count, double q)
+{
+	unsigned long long rank = (unsigned long long)(q * count) + 1;
+	unsigned long long seen = 0;
+	int i;
+	for (i=0; i<HISTOGRAM_BUCKETS; ++i)
 	{
-		fprintf(stderr, "Failed closing descriptor %d! Error %d.\n", fd, err);
-		return -1;
+		seen += metric_get(&h->buckets[i]);
+		if (seen >= rank)
+			return HISTOGRAM_BOUNDS_NS[i];
 	}
 	return 0;
 }
 
-typedef unsigned long long timestamp_ms_t;
-
-static timestamp_ms_t get_timestamp_ms(void)
+static void control_histogram(struct control_client *c, const char *name, const struct histogram *h)
 {
-	struct timespec tp;
-	clock_gettime(CLOCK_MONOTONIC, &tp);
-	return tp.tv_sec * 1000 + tp.tv_nsec / 1000000;
+	unsigned long long count = 0, max_bucket = 0;
+	int i;
+	for (i=0; i<=HISTOGRAM_BUCKETS; ++i)
+	{
+		unsigned long long n = metric_get(&h->buckets[i]);
+		count += n;
+		if (n > max_bucket)
+			max_bucket = n;
+	}
+
+	control_printf(c, "%s: %llu sample(s)", name, count);
+	if (count == 0)
+	{
+		control_printf(c, "\n\n");
+		return;
+	}
+	control_printf(c, ", average %.3f ms", metric_get(&h->sum_ns) / 1e6 / count);
+	static const double QUANTILES[] = { 0.5, 0.9, 0.99 };
+	for (i=0; i<3; ++i)
+	{
+		timestamp_ns_t bound = histogram_quantile(h, count, QUANTILES[i]);
+		if (bound != 0)
+			control_printf(c, ", p%g <= %g ms", QUANTILES[i] * 100, bound / 1e6);
+		else
+			control_printf(c, ", p%g > %g ms", QUANTILES[i] * 100, HISTOGRAM_BOUNDS_NS[HISTOGRAM_BUCKETS-1] / 1e6);
+	}
+	control_printf(c, "\n");
+
+	for (i=0; i<=HISTOGRAM_BUCKETS; ++i)
+	{
+		unsigned long long n = metric_get(&h->buckets[i]);
+		char bar[41];
+		int width = (int)(n * 40 / max_bucket);
+		memset(bar, '#', width);
+		bar[width] = '\0';
+		if (i < HISTOGRAM_BUCKETS)
+			control_printf(c, "  <= %8g ms %10llu%s%s\n", HISTOGRAM_BOUNDS_NS[i] / 1e6, n, width ? " " : "", bar);
+		else
+			control_printf(c, "   > %8g ms %10llu%s%s\n", HISTOGRAM_BOUNDS_NS[HISTOGRAM_BUCKETS-1] / 1e6, n, width ? " " : "", bar);
+	}
+	control_printf(c, "\n");
 }
 
-static void onTimesClicked(unsigned num_presses)
+static void control_latency(struct control_client *c)
 {
-	execute_action(A_CLICK, num_presses, 0);
+	control_histogram(c, "spawn", &g_metrics.spawn);
+	control_histogram(c, "handler runtime", &g_metrics.runtime);
+	if (g_suspend_safe)
+		control_histogram(c, "resume to dispatch", &g_metrics.resume_dispatch);
+
+	control_printf(c, "action completion, from the first spawn until the last handler exited:\n");
+	int slot;
+	for (slot=0; slot<CS_COUNT; ++slot)
+	{
+		const struct latency_stats *stats = &g_action_stats[slot];
+		char name[ACTION_NAME_SIZE+1];
+		config_slot_name(slot, name);
+		if (stats->count != 0)
+			control_printf(c, "  %-11s %8llu  average %8.3f ms  max %8.3f ms\n", name, stats->count,
+				stats->total_ns / 1e6 / stats->count, stats->max_ns / 1e6);
+	}
+	if (g_timer_drift.count != 0)
+		control_printf(c, "click timer lateness: average %.3f ms, max %.3f ms over %llu expiries\n",
+			g_timer_drift.total_ns / 1e6 / g_timer_drift.count, g_timer_drift.max_ns / 1e6, g_timer_drift.count);
 }
 
-static void onDown()
+enum { HOLD_INJECT_MIN_MS = INZOWN_BTN_HOLD_TIMEOUT_MS };
+enum { HOLD_INJECT_MAX_MS = 200000 }; // Beyond the longest named hold in every time option.
+
+// inject edge <0|1> [gpio] classifies an edge as if read from the button, the first one by default, inject <ACTION>
+// dispatches the action.
+static void control_inject(struct loop_state *loop, struct control_client *c, const char *args)
 {
-	execute_action(A_DOWN, 0, 0);
+	if (strncmp(args, "edge ", 5) == 0 && (args[5] == '0' || args[5] == '1') && (args[6] == '\0' || args[6] == ' '))
+	{
+		unsigned int i = 0;
+		if (args[6] == ' ')
+		{
+			char *end;
+			long pin = strtol(args + 7, &end, 10);
+			while (i < g_button_count && g_button_pins[i] != pin)
+				++i;
+			if (end == args + 7 || *end != '\0' || i == g_button_count)
+			{
+				control_printf(c, "GPIO %s is not a --gpio button.\n", args + 7);
+				return;
+			}
+		}
+		loop_edge(loop, i, args[5] == '1', get_timestamp_ns());
+		control_printf(c, "Injected edge %c of GPIO %d as event %llu.\n", args[5], g_button_pins[i], g_event_seq);
+		return;
+	}
+
+	struct slice name = { args, strlen(args) };
+	int slot = config_slot(name);
+	if (slot < 0)
+		slot = config_chord_slot(&g_config, name, false);
+	if (slot < 0 || slot_action(slot) > CS_HOLD_OTHER)
+	{
+		control_printf(c, "Usage: inject edge <0|1> [gpio] | inject [CHORD_<gpio>+<gpio>_]<DOWN|UP|CLICK_n|CLICK_OTHER|HOLD_nS|HOLD_OTHER>\n");
+		return;
+	}
+
+	int base = slot_base(slot);
+	slot = slot_action(slot);
+
+	timestamp_ns_t now = get_timestamp_ns();
+	int button = base == 0 ? g_button_pins[0] : g_config.chords[(base - CS_CHORD_0) / CS_ACTION_COUNT].pins[0];
+	struct action_event ev = { A_DOWN, 0, 0, now, g_event_seq + 1, now, base, button };
+	if (slot == CS_UP)
+		ev.action = A_UP;
+	else if (slot >= CS_CLICK_0 && slot <= CS_CLICK_OTHER)
+	{
+		ev.action = A_CLICK;
+		ev.clicks = slot - CS_CLICK_0;
+	}
+	else if (slot >= CS_HOLD_0)
+	{
+		// The shortest hold the time options name so.
+		ev.action = A_HOLD;
+		ev.clicks = 1;
+		for (ev.hold_ms = HOLD_INJECT_MIN_MS; ev.hold_ms <= HOLD_INJECT_MAX_MS; ev.hold_ms += 10)
+		{
+			if (get_action_slot(A_HOLD, 1, ev.hold_ms) == slot)
+				break;
+		}
+		if (ev.hold_ms > HOLD_INJECT_MAX_MS)
+		{
+			control_printf(c, "No hold time is named %s with the current time options.\n", args);
+			return;
+		}
+	}
+
+	++g_event_seq;
+	execute_action(&ev);
+	control_printf(c, "Injected %s as event %llu.\n", args, g_event_seq);
 }
 
-static void onUp()
+// kv lists the store, kv get <key>, kv set <key> <value> and kv del <key> read and change it.
+static void control_kv(struct control_client *c, const char *args)
 {
-	execute_action(A_UP, 0, 0);
+	const char *end = args + strlen(args);
+	struct slice command = config_token(&args, end);
+	struct slice key = config_token(&args, end);
+	struct slice value = config_token(&args, end);
+	bool extra = config_token(&args, end).len != 0;
+
+	if (command.len == 0)
+	{
+		unsigned int i;
+		for (i=0; i<g_kv.count; ++i)
+			control_printf(c, "%s %s\n", g_kv.pairs[i].key, g_kv.pairs[i].value);
+	}
+	else if (slice_equals(command, "get") && kv_key_valid(key) && value.len == 0)
+	{
+		const struct kv_pair *pair = kv_find(key);
+		if (pair != NULL)
+			control_printf(c, "%s\n", pair->value);
+		else
+			control_printf(c, "Key %.*s is not set.\n", (int)key.len, key.ptr);
+	}
+	else if (slice_equals(command, "set") && kv_key_valid(key) && kv_value_valid(value) && !extra)
+	{
+		const struct kv_pair *pair = kv_set(key, value);
+		kv_tail(pair);
+		control_printf(c, pair ? "Set %.*s.\n" : "The store is full, not adding %.*s.\n", (int)key.len, key.ptr);
+	}
+	else if (slice_equals(command, "del") && kv_key_valid(key) && value.len == 0)
+	{
+		bool deleted = kv_delete(key);
+		if (deleted && g_control.tails != 0)
+			control_tail_printf("kv %.*s deleted\n", (int)key.len, key.ptr);
+		control_printf(c, deleted ? "Deleted %.*s.\n" : "Key %.*s is not set.\n", (int)key.len, key.ptr);
+	}
+	else
+		control_printf(c, "Usage: kv | kv get <key> | kv set <key> <value> | kv del <key>\n");
 }
 
-static void onHold(unsigned num_presses, timestamp_ms_t time_held)
+static void control_mode(struct control_client *c, const char *name)
 {
-	execute_action(A_HOLD, num_presses, time_held);
+	unsigned int m = 0;
+	while (m < g_config.mode_count && strcmp(g_config.modes[m].name, name) != 0)
+		++m;
+	if (m == g_config.mode_count)
+	{
+		control_printf(c, "No mode is named %s.\n", name);
+		return;
+	}
+	mode_switch(m);
+	control_printf(c, "Mode %s.\n", name);
 }
 
-static int run(void)
+static void control_command(struct loop_state *loop, struct control_client *c, const char *line)
 {
-	char version_string[64];
-	char serial[64];
-	char id[64];
-
-	int err = gpio_export(g_button_pin);
-
-	if (err < 0) return err;
-	else g_button_exported = (err == 1);
+	debug(2, "Control command '%s'.\n", line);
 
-	if (g_pin_activation == PA_ACTIVE_LOW || g_pin_activation == PA_ACTIVE_HIGH)
+	if (strcmp(line, "stats") == 0)
+		control_stats(c);
+	else if (strcmp(line, "latency") == 0)
+		control_latency(c);
+	else if (strcmp(line, "tail") == 0)
 	{
-		err = gpio_set_active_low(g_button_pin, g_pin_activation == PA_ACTIVE_LOW);
-		if (err != 0)
-			return err;
+		c->tail = true;
+		++g_control.tails;
+		return; // Keep the connection.
+	}
+	else if (strncmp(line, "inject ", 7) == 0)
+		control_inject(loop, c, line + 7);
+	else if (strcmp(line, "reload") == 0)
+	{
+		if (reload_config())
+			control_printf(c, "Reloaded configuration, %u file(s), %u error(s).\n", g_config.file_count, g_config.errors);
+		else
+			control_printf(c, "Not reloading the configuration while a benchmark runs.\n");
 	}
+	else if (strcmp(line, "mode") == 0)
+		control_printf(c, "%s\n", g_config.modes[g_mode].name);
+	else if (strncmp(line, "mode ", 5) == 0)
+		control_mode(c, line + 5);
+	else if (strcmp(line, "kv") == 0 || strncmp(line, "kv ", 3) == 0)
+		control_kv(c, line + 2);
+	else
+		control_printf(c, "Unknown command '%s'. Commands: stats, tail, inject, mode, kv, reload, latency.\n", line);
 
-	err = gpio_set_edge(g_button_pin, E_BOTH);
+	control_close(c);
+}
 
-	if (err != 0)
-		return err;
+static void control_read(struct loop_state *loop, struct control_client *c)
+{
+	ssize_t n = read(c->fd, c->line + c->length, sizeof(c->line) - 1 - c->length);
+	if (n == -1 && (errno == EAGAIN || errno == EINTR))
+		return;
+	if (n <= 0) // Disconnected.
+	{
+		control_close(c);
+		return;
+	}
+	if (c->tail) // Has nothing more to say.
+		return;
 
-	enum
+	c->length += n;
+	c->line[c->length] = '\0';
+	char *end = strchr(c->line, '\n');
+	if (end == NULL)
 	{
-		FD_BUTTON = 0,
-		FD_TIMER  = 1,
-		FD_COUNT
-	};
+		if (c->length == sizeof(c->line) - 1)
+		{
+			control_printf(c, "Command too long.\n");
+			control_close(c);
+		}
+		return;
+	}
 
-	int btnfd = gpio_open(g_button_pin);
-	if (btnfd == -1)
-		return errno;
+	*end = '\0';
+	if (end > c->line && end[-1] == '\r')
+		end[-1] = '\0';
+	control_command(loop, c, c->line);
+}
 
-	int timerfd = timerfd_create(CLOCK_MONOTONIC, 0);
-	if (timerfd == -1)
+// Reads the edges of the buttons from btnfds, -1 for unused ones, and dispatches their actions until the backend
+// ends or fails.
+static int event_loop(const int btnfds[MAX_BUTTONS], enum backend_e backend)
+{
+	int epfd = epoll_create1(EPOLL_CLOEXEC);
+	if (epfd == -1)
 	{
-		fprintf(stderr, "Creating timer failed. Error %d.\n", errno);
-		gpio_close(btnfd);
-		return errno;
+		int err = errno;
+		fprintf(stderr, "Creating the event loop failed. Error %d.\n", err);
+		return err;
 	}
 
-	printf("Listening to events on GPIO #%d\n", g_button_pin);
-
-	struct pollfd pfd[FD_COUNT];
+	int watchfd = g_config_pinned ? -1 : inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	if (watchfd == -1 && !g_config_pinned)
+		fprintf(stderr, "Watching the configuration failed, it will not be reloaded. Error %d.\n", errno);
+	else if (watchfd != -1)
+		config_watch(watchfd, g_config_path, g_config_dir_path);
 
-	pfd[FD_BUTTON].fd = btnfd;
-	pfd[FD_BUTTON].events = POLLPRI;
+	if (g_signal_fd == -1 && dispatcher_init() != 0)
+	{
+		int err = errno;
+		if (watchfd != -1)
+			close(watchfd);
+		close(epfd);
+		return err;
+	}
 
-	pfd[FD_TIMER].fd = timerfd;
-	pfd[FD_TIMER].events = POLLIN;
+	struct loop_state loop;
+	memset(&loop, 0, sizeof(loop));
+	unsigned int m;
+	for (m=0; m<MAX_BUTTONS + MAX_CHORDS; ++m)
+		loop.machines[m].timerfd = -1;
+	for (m=0; m<g_button_count; ++m)
+		button_init(&loop.machines[m].button, g_button_pins[m], 0);
+
+	// With --suspend-safe the kernel holds a wakeup source from an edge until the next epoll_wait, so the system
+	// can not suspend before it was dispatched. The flag is silently ignored without CAP_BLOCK_SUSPEND.
+	uint32_t wakeup = g_suspend_safe ? EPOLLWAKEUP : 0;
+	uint32_t button_events = backend == BACKEND_GPIO ? EPOLLPRI : EPOLLIN;
+
+	g_loop_epfd = epfd;
+	int err = 0;
+	for (m=0; err == 0 && m<g_button_count; ++m)
+	{
+		if (btnfds[m] != -1)
+			err = loop_watch(btnfds[m], button_events | wakeup, FD_BUTTON + m);
+		if (err == 0) // The control socket injects edges of buttons without a descriptor too.
+			err = loop_machine_timer(&loop, m);
+	}
+	if (err == 0)
+		loop_chords_update(&loop);
+	if (err == 0 && watchfd != -1)
+		err = loop_watch(watchfd, EPOLLIN, FD_CONFIG);
+	if (err == 0)
+		err = loop_watch(g_signal_fd, EPOLLIN, FD_SIGNAL);
+	if (err == 0 && g_control.listen_fd != -1)
+		err = loop_watch(g_control.listen_fd, EPOLLIN, FD_CONTROL);
+	if (err == 0 && g_probes.inotify_fd != -1)
+		err = loop_watch(g_probes.inotify_fd, EPOLLIN, FD_PROBE);
+	if (err == 0 && g_kv.path != NULL)
+	{
+		g_kv.timerfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+		if (g_kv.timerfd == -1)
+			fprintf(stderr, "Creating the snapshot timer failed, the store is only saved at exit. Error %d.\n", errno);
+		else
+			err = loop_watch(g_kv.timerfd, EPOLLIN, FD_KV);
+		if (err == 0 && g_kv.dirty) // Changed before the loop started.
+		{
+			g_kv.dirty = false;
+			kv_changed();
+		}
+	}
 
-	timestamp_ms_t pressed_at = 0;
+	// SIGINT and SIGTERM shut the loop down after the running handlers, SIGHUP reloads the configuration.
+	sigset_t loop_signals, signals_mask;
+	sigemptyset(&loop_signals);
+	sigaddset(&loop_signals, SIGINT);
+	sigaddset(&loop_signals, SIGTERM);
+	sigaddset(&loop_signals, SIGHUP);
+	signals_mask = loop_signals;
+	sigaddset(&signals_mask, SIGCHLD);
+	sigprocmask(SIG_BLOCK, &loop_signals, NULL);
+	if (err == 0 && signalfd(g_signal_fd, &signals_mask, 0) == -1)
+	{
+		err = errno;
+		fprintf(stderr, "Watching the signals failed. Error %d.\n", err);
+	}
+	timestamp_ns_t drain_deadline = 0; // Shutting down once set.
 
-	bool timer_running = false;
-	bool button_down = false;
-	unsigned num_pressed = 0;
+	if (g_soak.active)
+		soak_tick(get_timestamp_ns());
+	if (g_suspend_safe)
+		g_resume.offset_ns = resume_offset_ns();
 
-	for (;;)
+	while (err == 0)
 	{
-		int result = poll(pfd, FD_COUNT, -1);
+		int timeout = -1;
+		if (drain_deadline != 0)
+		{
+			if (handlers_pending() == 0)
+				break;
+			timestamp_ns_t now = get_timestamp_ns();
+			if (now >= drain_deadline)
+				break;
+			timeout = (drain_deadline - now + 999999) / 1000000;
+		}
+
+		struct epoll_event events[FD_COUNT + MAX_CHILDREN + MAX_CONTROL_CLIENTS];
+		int result = fault_epoll_wait(epfd, events, FD_COUNT + MAX_CHILDREN + MAX_CONTROL_CLIENTS, timeout);
 
 		if (result == -1)
+		{
+			if (errno == EINTR) // Stopped and continued, the signals we handle are blocked.
+			{
+				metric_add(&g_metrics.wakeups[WAKE_SIGNAL], 1);
+				continue;
+			}
+			err = errno;
+			fprintf(stderr, "Waiting for events failed. Error %d.\n", err);
 			break;
-
-		if (result == 0)
+		}
+		if (result == 0) // The drain deadline passed.
 			continue;
 
-		if (pfd[FD_BUTTON].revents & POLLPRI) // Button state changed.
+		uint32_t revents[FD_COUNT];
+		memset(revents, 0, sizeof(revents));
+		bool control_ready = false;
+		bool button_ready = false;
+		bool timer_ready = false;
+		bool probe_ready = false;
+		int i;
+		for (i=0; i<result; ++i)
+		{
+			uint32_t tag = events[i].data.u32;
+			if (tag < FD_COUNT)
+				revents[tag] = events[i].events;
+			else if (tag >= FD_CONTROL_CLIENT)
+				control_ready = true;
+			button_ready |= tag < FD_TIMER; // FD_BUTTON is 0.
+			timer_ready |= tag >= FD_TIMER && tag < FD_CONFIG;
+			probe_ready |= tag >= FD_PROBE && tag < FD_COUNT;
+		}
+
+		unsigned int signals = revents[FD_SIGNAL] ? signals_read() : 0;
+
+		enum wake_e cause = WAKE_OUTPUT;
+		if (button_ready)
+			cause = WAKE_EDGE;
+		else if (timer_ready)
+			cause = WAKE_TIMER;
+		else if (signals & SIGNAL_BIT(SIGCHLD))
+			cause = WAKE_CHILD;
+		else if (signals != 0)
+			cause = WAKE_SIGNAL;
+		else if (revents[FD_CONFIG])
+			cause = WAKE_CONFIG;
+		else if (revents[FD_KV])
+			cause = WAKE_TIMER;
+		else if (probe_ready)
+			cause = WAKE_PROBE;
+		else if (revents[FD_CONTROL] || control_ready)
+			cause = WAKE_CONTROL;
+		metric_add(&g_metrics.wakeups[cause], 1);
+
+		if (g_soak.active)
+			soak_tick(get_timestamp_ns());
+		if (g_suspend_safe)
+			resume_check(get_timestamp_ns());
+
+		bool finished = false;
+		for (m=0; m<g_button_count; ++m)
 		{
-			timestamp_ms_t timestamp = get_timestamp_ms();
+			if ((revents[FD_BUTTON + m] & (button_events | EPOLLHUP)) == 0) // Button state did not change.
+				continue;
 
+			timestamp_ns_t timestamp_ns = get_timestamp_ns();
 			char buff[16];
 			memset(buff, 0, sizeof(buff));
-			int n = read(btnfd, buff, sizeof(buff));
-			if (n == 0)
+			ssize_t n = fault_read(btnfds[m], buff, sizeof(buff) - 1, false);
+
+			if (n == -1 && (errno == EINTR || errno == EAGAIN))
+			{
+				// Nothing was consumed, the descriptor is still ready and wakes the loop again.
+			}
+			else if (n == -1)
 			{
-				fprintf(stderr, "Reading button value returned 0.\n");
+				err = errno;
+				fprintf(stderr, "Reading the button failed. Error %d.\n", err);
 				break;
 			}
+			else if (backend == BACKEND_PIPE)
+			{
+				if (n == 0) // The generator finished.
+				{
+					finished = true;
+					break;
+				}
+
+				// Edges queued up while the loop was busy share the timestamp of this read.
+				ssize_t j;
+				for (j=0; j<n; ++j)
+					loop_edge(&loop, m, buff[j] == '1', timestamp_ns);
+			}
+			else
+			{
+				// The value file is read from its start on every edge. A failed rewind leaves the next read at
+				// its end, returning 0, and is retried then.
+				if (lseek(btnfds[m], 0, SEEK_SET) == -1)
+					fprintf(stderr, "Rewinding button failed. Error %d.\n", errno);
+				if (n != 0)
+					loop_edge(&loop, m, strtoul(buff, NULL, 10), timestamp_ns);
+			}
+		}
+		if (err != 0 || finished)
+			break;
+		for (m=0; m<MAX_BUTTONS + MAX_CHORDS; ++m)
+		{
+			if ((revents[FD_TIMER + m] & EPOLLIN) == 0) // Timer did not time out.
+				continue;
 
-			if (lseek(btnfd, SEEK_SET, 0) == -1)
+			struct loop_machine *lm = &loop.machines[m];
+			uint64_t t;
+			ssize_t n = fault_read(lm->timerfd, &t, sizeof(t), true);
+			if (n == sizeof(t))
+			{
+				timestamp_ns_t now = get_timestamp_ns();
+				latency_add(&g_timer_drift, now - lm->timer_deadline);
+				button_timeout(&lm->button, now);
+			}
+			else if (n != -1 || (errno != EINTR && errno != EAGAIN)) // EAGAIN if an edge of this wakeup rearmed it.
+			{
+				err = n == -1 ? errno : EIO;
+				fprintf(stderr, "Error %d reading the timer!\n", err);
+				break;
+			}
+		}
+		if (err != 0)
+			break;
+		if (revents[FD_CONFIG] & EPOLLIN) // Configuration changed.
+		{
+			if (config_watch_changed(watchfd, g_config_path, g_config_dir_path))
+			{
+				reload_config();
+				config_watch(watchfd, g_config_path, g_config_dir_path);
+			}
+		}
+		if (revents[FD_CONTROL] & EPOLLIN) // A control client connected.
+		{
+			control_accept();
+		}
+		if (revents[FD_PROBE] & EPOLLIN) // A probed file changed.
+		{
+			probes_changed();
+		}
+		for (m=0; m<MAX_PROBES; ++m)
+		{
+			if (revents[FD_PROBE_PID + m]) // A probed process exited.
 			{
-				fprintf(stderr, "Rewinding button failed. Error %d.\n", errno);
+				probe_close_pidfd(m);
+				g_probes.probes[m].valid = false;
+			}
+		}
+		if (revents[FD_KV] & EPOLLIN) // Time for a snapshot of the store.
+		{
+			uint64_t t;
+			if (read(g_kv.timerfd, &t, sizeof(t)) == sizeof(t) && g_kv.dirty)
+			{
+				kv_save();
+				if (g_kv.dirty) // Failed, try again later.
+				{
+					g_kv.dirty = false;
+					kv_changed();
+				}
+			}
+		}
+		for (i=0; i<result; ++i)
+		{
+			uint32_t tag = events[i].data.u32;
+			if (tag >= FD_CONTROL_CLIENT)
+			{
+				struct control_client *c = &g_control.clients[tag - FD_CONTROL_CLIENT];
+				if (c->fd != -1) // A control client sent a command or disconnected.
+					control_read(&loop, c);
+			}
+			else if (tag >= FD_COUNT)
+			{
+				struct child *c = &g_children[tag - FD_COUNT];
+				if (c->out_fd != -1) // A handler wrote to stdout.
+					child_output(c, false);
+			}
+		}
+		if (signals & SIGNAL_BIT(SIGCHLD)) // Handlers exited.
+		{
+			reap_children();
+		}
+		if (signals & SIGNAL_BIT(SIGHUP))
+		{
+			debug(1, "Reloading the configuration on SIGHUP.\n");
+			reload_config();
+			if (watchfd != -1)
+				config_watch(watchfd, g_config_path, g_config_dir_path);
+		}
+		if (signals & (SIGNAL_BIT(SIGINT) | SIGNAL_BIT(SIGTERM)))
+		{
+			if (drain_deadline != 0) // Asked again, stop waiting.
 				break;
+
+			// Stop taking input, the gestures in progress are dropped along with the queued handlers.
+			for (m=0; m<g_button_count; ++m)
+			{
+				if (btnfds[m] != -1)
+					epoll_ctl(epfd, EPOLL_CTL_DEL, btnfds[m], NULL);
+			}
+			for (m=0; m<MAX_BUTTONS + MAX_CHORDS; ++m)
+			{
+				if (loop.machines[m].timerfd != -1)
+					epoll_ctl(epfd, EPOLL_CTL_DEL, loop.machines[m].timerfd, NULL);
 			}
+			if (watchfd != -1)
+				epoll_ctl(epfd, EPOLL_CTL_DEL, watchfd, NULL);
+			if (g_control.listen_fd != -1)
+				epoll_ctl(epfd, EPOLL_CTL_DEL, g_control.listen_fd, NULL);
+			drop_queued_handlers();
+
+			drain_deadline = get_timestamp_ns() + (timestamp_ns_t)g_drain_timeout * 1000000000ull;
+			debug(1, "Shutting down, waiting up to %u s for %u running handler(s).\n", g_drain_timeout, handlers_pending());
+		}
+		if (g_resume.pending && loop_idle(&loop)) // The resume ran no handler.
+			g_resume.pending = false;
+	}
+
+	if (drain_deadline != 0)
+	{
+		unsigned int count = signal_handlers(SIGTERM);
+		if (count != 0)
+			fprintf(stderr, "Terminated %u handler(s) still running at shutdown.\n", count);
+	}
+
+	sigdelset(&signals_mask, SIGINT);
+	sigdelset(&signals_mask, SIGTERM);
+	sigdelset(&signals_mask, SIGHUP);
+	signalfd(g_signal_fd, &signals_mask, 0);
+	sigprocmask(SIG_UNBLOCK, &loop_signals, NULL);
+
+	probes_reset();
+	if (g_kv.path != NULL && g_kv.dirty)
+		kv_save();
+	if (g_kv.timerfd != -1)
+	{
+		close(g_kv.timerfd);
+		g_kv.timerfd = -1;
+	}
 
-			unsigned long pressed = strtoul(buff, NULL, 10);
+	g_loop_epfd = -1;
+	close(epfd);
+	if (watchfd != -1)
+		close(watchfd);
+	for (m=0; m<MAX_BUTTONS + MAX_CHORDS; ++m)
+	{
+		if (loop.machines[m].timerfd != -1)
+			close(loop.machines[m].timerfd);
+	}
+	return err;
+}
 
-			if (pressed)
-			{
-				button_down = true;
-				onDown();
+static int run(void)
+{
+	int btnfds[MAX_BUTTONS];
+	int err = 0;
+	unsigned int i;
+	for (i=0; i<MAX_BUTTONS; ++i)
+		btnfds[i] = -1;
 
-				if (!timer_running)
-				{
-					num_pressed = 1;
-					timer_running = true;
-				}
-				else
-				{
-					if (g_click_count_limit == 0 || num_pressed < g_click_count_limit)
-						++num_pressed;
-				}
+	for (i=0; err == 0 && i<g_button_count; ++i)
+	{
+		int pin = g_button_pins[i];
+		err = inzown_btn_gpio_export(pin);
 
-				pressed_at = timestamp;
+		if (err < 0) break;
+		else if (err == 1) g_buttons_exported |= 1u << i;
 
-				struct itimerspec its;
-				memset(&its, 0, sizeof(its));
+		if (g_pin_activation == PA_ACTIVE_LOW || g_pin_activation == PA_ACTIVE_HIGH)
+		{
+			err = inzown_btn_gpio_set_active_low(pin, g_pin_activation == PA_ACTIVE_LOW);
+			if (err != 0)
+				break;
+		}
 
-				its.it_value.tv_sec = 0;
-				its.it_value.tv_nsec = CLICK_TIMEOUT_MS * 1000 * 1000;
-				timerfd_settime(timerfd, 0, &its, 0); // Start the timer.
-			}
-			else if (button_down)
-			{
-				button_down = false;
-				onUp();
+		err = inzown_btn_gpio_set_edge(pin, INZOWN_BTN_EDGE_BOTH);
 
-				if (pressed_at != 0)
-				{
-					if (timestamp - pressed_at >= HOLD_PRESS_TIMEOUT_MS)
-					{
-						onHold(num_pressed, timestamp - pressed_at);
-					}
-				}
-			}
+		if (err != 0)
+			break;
 
-		}
-		if (pfd[FD_TIMER].revents & POLLIN) // Timer timed out.
+		btnfds[i] = inzown_btn_gpio_open(pin);
+		if (btnfds[i] == -1)
 		{
-			uint64_t t;
-			int n = read(timerfd, &t, sizeof(t));
-			if (n != sizeof(t))
-			{
-				fprintf(stderr, "Error %d reading the timer!\n", errno);
-				return errno;
-			}
-			if (!button_down)
-				onTimesClicked(num_pressed);
-			timer_running = false;
+			err = errno;
+			break;
 		}
+
+		printf("Listening to events on GPIO #%d\n", pin);
 	}
 
-	close(timerfd);
-	gpio_close(btnfd);
+	if (err == 0)
+		err = event_loop(btnfds, BACKEND_GPIO);
 
-	gpio_set_edge(g_button_pin, E_NONE);
-	return 0;
+	for (i=0; i<g_button_count; ++i)
+	{
+		if (btnfds[i] == -1)
+			continue;
+		inzown_btn_gpio_close(btnfds[i]);
+		inzown_btn_gpio_set_edge(g_button_pins[i], INZOWN_BTN_EDGE_NONE);
+	}
+	return err;
 }
 
 static void print_version(void)
@@ -845,11 +5201,13 @@ static void print_usage(void)
 		"Options:\n"
 		"\t--help                   Display the usage information.\n"
 		"\t--version                Show the version information.\n"
-		"\t--gpio <n>               The pin GPIO number to use for the button. Default is 17.\n"
+		"\t--gpio <n>[,<n>...]      The pin GPIO numbers of the buttons, up to 8. Default is 17.\n"
 		"\t--active-high            Configure the pin for active high triggering.\n"
 		"\t--active-low             Reverse the sense of the active state.\n"
 		"\t                           If none of --active-high or --active-low is specified, this GPIO setting is left as is.\n"
 		"\t--conf <path>            Specify the path to configuration file to use. Default is /etc/inzown/button.conf.\n"
+		"\t--conf-dir <path>        Directory of *.conf fragments loaded after the configuration file, in lexical order.\n"
+		"\t                           Default is /etc/inzown/button/conf.d. Use \"\" to disable.\n"
 		"\t--click-count-limit <n>  Set the click count limit to n. Use 0 for no limit. Default is 8.\n"
 		"\t--debug <n>              Enable debugging at level n (higher value = more logging)\n"
 		"\t-n <n>                   Short for --click-count-limit.\n"
@@ -858,6 +5216,32 @@ static void print_usage(void)
 		"\t                           (--help-time for more details).\n"
 		"\t--offset-time            Offset the start and end times by 1/2 second (--help-time for more details).\n"
 		"\t--help-time              Explain the time options above.\n"
+		"\t--suspend-safe           Keep the system from suspending while an edge or click window is pending, let the click\n"
+		"\t                           timer wake it up and count time spent suspended in click and hold durations.\n"
+		"\t--drain-timeout <s>      Seconds SIGINT and SIGTERM wait for running handlers before terminating them.\n"
+		"\t                           Default is 5.\n"
+		"\t--check-config           Report every error in the configuration file and exit.\n"
+		"\t--bench-config <n>       Measure the configuration parser throughput on a generated file of n lines.\n"
+		"\t--replay <path>          Run the \"<ms> <0|1>\" edge trace in path (- for stdin) through the classification,\n"
+		"\t                           printing the handler commands instead of running them.\n"
+		"\t--repeat <n>             Replay the trace n times. Default is 1.\n"
+		"\t--bench                  Measure the throughput and stage latencies of a synthetic button workload.\n"
+		"\t--bench-wakeups <s>      Count the event loop's wakeups per hour while idle and in typical use, s seconds each.\n"
+		"\t--soak <s>               Run the event loop on generated edges for s seconds, checking every 10 seconds that\n"
+		"\t                           memory, descriptors, zombies and timer drift do not grow and no edge is lost.\n"
+		"\t--soak-rate <n>          Steady edge rate of --soak, in edges per second. Default is 20.\n"
+		"\t--soak-burst <n>         Edge rate of the one second bursts every 10 seconds. Default is 2000, 0 disables them.\n"
+		"\t--metrics-socket <path>  Serve the metrics in the Prometheus text format to every connection to a unix socket.\n"
+		"\t--metrics-file <path>    Rewrite the metrics in the Prometheus text format to path at an interval, atomically.\n"
+		"\t--metrics-interval <s>   Interval of --metrics-file in seconds. Default is 15.\n"
+		"\t--control-socket <path>  Accept inzown-btn-ctl commands (stats, tail, inject, mode, kv, reload, latency) on a unix socket.\n"
+		"\t--journal <path>         Append the classified actions and handler exits to a circular journal file.\n"
+		"\t--journal-size <KiB>     Size of the --journal file. Default is 256, about 4000 records.\n"
+		"\t--journal-dump <path>    Print the records of a journal.\n"
+		"\t--journal-export <path>  Print the presses and releases of a journal as an edge trace for --replay.\n"
+		"\t--kv-file <path>         Load the key/value store from path and save it there after changes.\n"
+		"\t--kv-interval <s>        Seconds from the first change of the store until it is saved. Default is 60.\n"
+		"\t--trace-out <path>       Write a Trace Event Format (chrome://tracing, Perfetto) trace of every event to path.\n"
 		"\n"
 		"Environment Variables:\n"
 		"\tINZOWN_BTN_CFG           Equivalent to --conf specifies the configuration file.  if both INZOWN_BTN_CFG and\n"
@@ -917,65 +5301,815 @@ static void print_time_help(void)
 		"\n"
 		);
 }
-static bool parse_uint(unsigned int *dst, const char *src)
+static bool parse_uint(unsigned int *dst, const char *src)
+{
+	char * endPtr;
+	uint32_t x = strtoul(src, &endPtr, 10);
+	if (endPtr == src || *endPtr != '\0')
+	{
+		*dst = 0;
+		return false;
+	}
+	*dst = x;
+	return true;
+}
+
+// Parses a comma separated list of distinct GPIO numbers, at most MAX_BUTTONS of them.
+static bool parse_gpio_list(int pins[MAX_BUTTONS], unsigned int *count, const char *src)
+{
+	unsigned int n = 0;
+	for (;;)
+	{
+		char *endPtr;
+		unsigned long x = strtoul(src, &endPtr, 10);
+		if (endPtr == src || (*endPtr != ',' && *endPtr != '\0') || n == MAX_BUTTONS || x > MAX_GPIO_NUMBER)
+			return false;
+
+		unsigned int i;
+		for (i=0; i<n; ++i)
+		{
+			if (pins[i] == (int)x)
+				return false;
+		}
+		pins[n++] = (int)x;
+
+		if (*endPtr == '\0')
+			break;
+		src = endPtr + 1;
+	}
+	*count = n;
+	return true;
+}
+
+// Parses a generated configuration of the given number of lines repeatedly and reports the throughput.
+static int bench_config(unsigned int lines)
+{
+	enum { LINE_SIZE = 96 };
+
+	char *data = malloc((size_t)lines * LINE_SIZE);
+	if (data == NULL)
+	{
+		fprintf(stderr, "Failed allocating %u lines!\n", lines);
+		return 1;
+	}
+
+	size_t size = 0;
+	unsigned int i;
+	for (i=0; i<lines; ++i)
+	{
+		unsigned int n = i % (ABSOLUTE_MAX_CLICK + 1);
+		switch (i % 4)
+		{
+		case 0:
+			size += sprintf(data + size, "# Generated line %u\n", i);
+			break;
+		case 1:
+			size += sprintf(data + size, "CLICK_%u  /etc/inzown/button/scripts/click CLICK_%u %u # comment\n", n, n, i);
+			break;
+		case 2:
+			size += sprintf(data + size, "\tHOLD_%uS\t/etc/inzown/button/scripts/hold HOLD_%uS\n", n, n);
+			break;
+		default:
+			size += sprintf(data + size, "\n");
+			break;
+		}
+	}
+
+	struct config_file file = { "<generated>", data, size };
+	struct config cfg;
+	unsigned int iterations = 0;
+	timestamp_ms_t start = get_timestamp_ms();
+	timestamp_ms_t elapsed;
+	do
+	{
+		config_init(&cfg);
+		cfg.files = &file;
+		cfg.file_count = 1;
+		cfg.quiet = true;
+		config_parse(&cfg, 0);
+		free(cfg.segments);
+		free(cfg.handlers);
+		free(cfg.conditions);
+		++iterations;
+		elapsed = get_timestamp_ms() - start;
+	} while (elapsed < 1000);
+
+	double seconds = elapsed / 1000.0;
+	printf("Parsed %zu bytes (%u lines, %u error(s)) %u times in %.3f s: %.1f MB/s, %.1f Mlines/s\n",
+		size, lines, cfg.errors, iterations, seconds,
+		(double)size * iterations / seconds / 1e6, (double)lines * iterations / seconds / 1e6);
+
+	free(data);
+	return 0;
+}
+
+struct replay_edge
+{
+	timestamp_ms_t ms;
+	bool           pressed;
+};
+
+static void replay_step(struct inzown_btn_machine *b, const struct replay_edge *edge, timestamp_ns_t t, timestamp_ns_t *deadline)
+{
+	timestamp_ns_t start = g_stage_sampling ? get_timestamp_ns() : 0;
+	if (edge == NULL)
+	{
+		button_timeout(b, t);
+	}
+	else
+	{
+		++g_event_seq;
+		if (button_edge(b, edge->pressed, t))
+			*deadline = t + CLICK_TIMEOUT_MS * 1000000ull;
+	}
+	if (g_stage_sampling)
+		stage_done(STAGE_CLASSIFY, NULL, 0, start, g_event_seq);
+}
+
+// Feeds the edges through the classification in virtual time, the given number of times. Every repetition
+// starts after the click window of the previous one closed. settle, unless NULL, is called after each step.
+static void replay_edges(const struct replay_edge *edges, unsigned int count, unsigned int repeat, void (*settle)(void))
+{
+	// Time 0 stays reserved for a button that was never pressed.
+	timestamp_ns_t period = count ? (edges[count-1].ms + 2 * CLICK_TIMEOUT_MS) * 1000000ull : 0;
+	timestamp_ns_t offset = 1000000000ull;
+	timestamp_ns_t deadline = 0;
+	struct inzown_btn_machine button;
+	button_init(&button, g_button_pins[0], 0);
+
+	unsigned int r;
+	for (r=0; r<repeat; ++r, offset += period)
+	{
+		unsigned int i;
+		for (i=0; i<count; ++i)
+		{
+			timestamp_ns_t t = offset + edges[i].ms * 1000000ull;
+			if (button.timer_running && deadline <= t)
+			{
+				replay_step(&button, NULL, deadline, &deadline);
+				if (settle)
+					settle();
+			}
+
+			replay_step(&button, &edges[i], t, &deadline);
+			if (settle)
+				settle();
+		}
+		if (button.timer_running)
+		{
+			replay_step(&button, NULL, deadline, &deadline);
+			if (settle)
+				settle();
+		}
+	}
+}
+
+// Feeds an edge trace of "<ms> <0|1>" lines through the classification in virtual time, printing the
+// handler commands instead of running them. The trace is repeated the given number of times.
+static int replay(const char *path, unsigned int repeat)
+{
+	FILE *f = strcmp(path, "-") == 0 ? stdin : fopen(path, "r");
+	if (f == NULL)
+	{
+		fprintf(stderr, "Opening %s failed. Error %d.\n", path, errno);
+		return 1;
+	}
+
+	struct replay_edge *edges = NULL;
+	unsigned int count = 0;
+	unsigned int capacity = 0;
+	unsigned int line = 0;
+	char buffer[128];
+	while (fgets(buffer, sizeof(buffer), f) != NULL)
+	{
+		++line;
+		const char *p = buffer;
+		while (is_config_space(*p))
+			++p;
+		if (*p == '#' || *p == '\n' || *p == '\0')
+			continue;
+
+		unsigned long long ms;
+		unsigned int value;
+		if (sscanf(p, "%llu %u", &ms, &value) != 2 || value > 1 || (count != 0 && ms < edges[count-1].ms))
+		{
+			fprintf(stderr, "%s:%u: expected \"<ms> <0|1>\" in increasing time order.\n", path, line);
+			free(edges);
+			if (f != stdin)
+				fclose(f);
+			return 1;
+		}
+
+		if (count == capacity)
+		{
+			capacity = capacity ? 2 * capacity : 256;
+			struct replay_edge *grown = realloc(edges, capacity * sizeof(*edges));
+			if (grown == NULL)
+			{
+				fprintf(stderr, "Failed allocating %u edges!\n", capacity);
+				free(edges);
+				if (f != stdin)
+					fclose(f);
+				return 1;
+			}
+			edges = grown;
+		}
+		edges[count].ms = ms;
+		edges[count].pressed = value;
+		++count;
+	}
+	if (f != stdin)
+		fclose(f);
+
+	g_dry_run = true;
+
+	timestamp_ns_t start = get_timestamp_ns();
+	replay_edges(edges, count, repeat, NULL);
+	timestamp_ns_t elapsed = get_timestamp_ns() - start;
+
+	unsigned long long total = (unsigned long long)count * repeat;
+	printf("Replayed %llu edges, %llu handler commands in %.3f ms: %.1f ns per edge\n",
+		total, g_dry_run_commands, elapsed / 1e6, total ? (double)elapsed / total : 0.0);
+
+	free(edges);
+	return 0;
+}
+
+// The synthetic workload of --bench: a cycle of clicks, bounced presses and holds, in ms.
+static const struct replay_edge BENCH_EDGES[] =
+{
+	{    0, 1 }, {  100, 0 },                                                // CLICK_1
+	{ 1000, 1 }, { 1090, 0 }, { 1250, 1 }, { 1340, 0 },                      // CLICK_2
+	{ 2500, 1 }, { 2502, 0 }, { 2503, 1 }, { 2620, 0 }, { 2621, 1 },        // CLICK_3, bouncing
+	{ 2623, 0 }, { 2800, 1 }, { 2900, 0 }, { 3050, 1 }, { 3160, 0 },
+	{ 4500, 1 }, { 6000, 0 },                                                // HOLD_1S
+	{ 7000, 1 }, { 7100, 0 }, { 7300, 1 }, { 10500, 0 },                     // HOLD_3S after a click
+};
+
+enum { JOURNAL_EXPORT_GAP_MS = 2 * CLICK_TIMEOUT_MS }; // Between the edges of two daemon runs.
+
+static int compare_journal_records(const void *a, const void *b)
+{
+	const struct journal_record *ra = a, *rb = b;
+	return ra->seq < rb->seq ? -1 : ra->seq > rb->seq;
+}
+
+static void journal_print(const struct journal_record *r)
+{
+	time_t sec = r->wall_ns / 1000000000;
+	struct tm tm;
+	localtime_r(&sec, &tm);
+	char when[32];
+	strftime(when, sizeof(when), "%Y-%m-%d %H:%M:%S", &tm);
+
+	char name[ACTION_NAME_SIZE+1];
+	config_slot_name(r->slot < CS_COUNT ? (int)r->slot : CS_COUNT, name);
+
+	printf("%llu %s.%03llu event %llu gpio %d ", (unsigned long long)r->seq, when, (unsigned long long)(r->wall_ns / 1000000 % 1000),
+		(unsigned long long)r->event, r->button);
+	if (r->kind == JOURNAL_ACTION)
+		printf("%s clicks %u hold_ms %u\n", name, r->clicks, r->hold_ms);
+	else if (WIFEXITED(r->status))
+		printf("%s handler %u pid %d exited with status %d\n", name, r->clicks, r->pid, WEXITSTATUS(r->status));
+	else
+		printf("%s handler %u pid %d killed by signal %d\n", name, r->clicks, r->pid, WTERMSIG(r->status));
+}
+
+// Prints the complete records of the journal at path in order. With export, prints the DOWN and UP actions as an
+// edge trace for --replay instead. The journal may be in use by a running daemon.
+static int journal_read(const char *path, bool export)
+{
+	int fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd == -1)
+	{
+		fprintf(stderr, "Opening the journal %s failed. Error %d.\n", path, errno);
+		return 1;
+	}
+
+	struct stat st;
+	void *p = fstat(fd, &st) == 0 && (size_t)st.st_size >= sizeof(struct journal_header)
+		? mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0) : MAP_FAILED;
+	close(fd);
+	if (p == MAP_FAILED || !journal_header_valid(p, st.st_size))
+	{
+		fprintf(stderr, "%s is not a journal.\n", path);
+		if (p != MAP_FAILED)
+			munmap(p, st.st_size);
+		return 1;
+	}
+
+	const struct journal_header *header = p;
+	const struct journal_record *records = (const struct journal_record *)(header + 1);
+	struct journal_record *copies = malloc(header->capacity * sizeof(*copies));
+	if (copies == NULL)
+	{
+		fprintf(stderr, "Failed allocating %u records!\n", header->capacity);
+		munmap(p, st.st_size);
+		return 1;
+	}
+
+	// A record the daemon rewrites while it is copied changes its commit word.
+	uint32_t count = 0;
+	uint32_t i;
+	for (i=0; i<header->capacity; ++i)
+	{
+		uint64_t commit = __atomic_load_n(&records[i].commit, __ATOMIC_ACQUIRE);
+		memcpy(&copies[count], &records[i], sizeof(*copies));
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		if (commit != 0 && commit == (copies[count].seq ^ JOURNAL_COMMIT) && __atomic_load_n(&records[i].commit, __ATOMIC_RELAXED) == commit)
+			++count;
+	}
+	munmap(p, st.st_size);
+	qsort(copies, count, sizeof(*copies), compare_journal_records);
+
+	// --replay classifies a single button.
+	int button = -1;
+	for (i=0; i<count && export; ++i)
+	{
+		const struct journal_record *r = &copies[i];
+		if (r->kind != JOURNAL_ACTION || (r->slot != CS_DOWN && r->slot != CS_UP) || r->button == button)
+			continue;
+		if (button != -1)
+		{
+			fprintf(stderr, "The journal %s has presses of GPIO %d and GPIO %d, but an edge trace is of one button.\n", path, button, r->button);
+			free(copies);
+			return 1;
+		}
+		button = r->button;
+	}
+
+	if (export)
+	{
+		printf("# Edge trace exported from the journal %s.\n"
+			"# Each line is \"<ms> <0|1>\": milliseconds since the start of the trace and the button value on the edge.\n", path);
+
+		// The timestamps restart with the daemon, whose runs are laid end to end.
+		bool started = false;
+		timestamp_ns_t run_start = 0, previous = 0;
+		timestamp_ms_t run_ms = 0, ms = 0;
+		for (i=0; i<count; ++i)
+		{
+			const struct journal_record *r = &copies[i];
+			if (r->kind != JOURNAL_ACTION || (r->slot != CS_DOWN && r->slot != CS_UP))
+				continue;
+			if (!started && r->slot == CS_UP) // The press was overwritten.
+				continue;
+
+			if (!started || r->ts_ns < previous)
+			{
+				run_ms = started ? ms + JOURNAL_EXPORT_GAP_MS : 0;
+				run_start = r->ts_ns;
+				started = true;
+			}
+			previous = r->ts_ns;
+			ms = run_ms + (r->ts_ns - run_start) / 1000000;
+			printf("%llu %d\n", ms, r->slot == CS_DOWN);
+		}
+	}
+	else
+	{
+		for (i=0; i<count; ++i)
+			journal_print(&copies[i]);
+	}
+
+	free(copies);
+	return 0;
+}
+
+enum { BENCH_CYCLES       = 20000 };
+enum { BENCH_SPAWN_CYCLES = 50 };
+
+static const char BENCH_SPAWN_CONFIG[] =
+	"DOWN /bin/true\n"
+	"UP /bin/true\n"
+	"CLICK_OTHER /bin/true {clicks}\n"
+	"HOLD_OTHER /bin/true {clicks} {hold_ms}\n";
+
+static int compare_timestamps(const void *a, const void *b)
+{
+	timestamp_ns_t x = *(const timestamp_ns_t *)a;
+	timestamp_ns_t y = *(const timestamp_ns_t *)b;
+	return x < y ? -1 : x > y;
+}
+
+// Waits for every running and queued handler to exit.
+static void settle_handlers(void)
+{
+	while (handlers_pending() != 0)
+	{
+		struct pollfd pfd = { g_signal_fd, POLLIN, 0 };
+		if (poll(&pfd, 1, -1) > 0 && (signals_read() & SIGNAL_BIT(SIGCHLD)))
+			reap_children();
+	}
+}
+
+// Runs the workload cycles times and prints the throughput and the percentiles of every sampled stage.
+static void bench_phase(const char *name, unsigned int cycles, void (*settle)(void))
+{
+	unsigned int i;
+	for (i=0; i<STAGE_COUNT; ++i)
+		g_stage_samples[i].count = 0;
+
+	unsigned int count = sizeof(BENCH_EDGES) / sizeof(BENCH_EDGES[0]);
+	timestamp_ns_t start = get_timestamp_ns();
+	replay_edges(BENCH_EDGES, count, cycles, settle);
+	timestamp_ns_t elapsed = get_timestamp_ns() - start;
+
+	unsigned long long edges = (unsigned long long)count * cycles;
+	printf("%s: %llu edges, %zu actions in %.3f s, %.0f edges/s, %.0f actions/s\n", name, edges,
+		g_stage_samples[STAGE_LOOKUP].count, elapsed / 1e9, edges / (elapsed / 1e9), g_stage_samples[STAGE_LOOKUP].count / (elapsed / 1e9));
+
+	for (i=0; i<STAGE_COUNT; ++i)
+	{
+		struct stage_samples *samples = &g_stage_samples[i];
+		if (samples->count == 0)
+			continue;
+
+		qsort(samples->ns, samples->count, sizeof(*samples->ns), compare_timestamps);
+		printf("\t%-9s p50 %9.2f  p90 %9.2f  p99 %9.2f  max %9.2f us\n", STAGE_NAMES[i],
+			samples->ns[samples->count / 2] / 1e3,
+			samples->ns[samples->count * 9 / 10] / 1e3,
+			samples->ns[samples->count * 99 / 100] / 1e3,
+			samples->ns[samples->count - 1] / 1e3);
+	}
+}
+
+// Swaps in a configuration parsed from text for a benchmark phase. Returns false on errors.
+static bool bench_config_swap(struct config *saved, struct config_file *file, const char *text)
+{
+	*saved = g_config;
+	config_init(&g_config);
+	file->path = "<bench>";
+	file->data = (char *)text;
+	file->size = strlen(text);
+	g_config.files = file;
+	g_config.file_count = 1;
+	g_config_pinned = true;
+	config_parse(&g_config, 0);
+	return g_config.errors == 0;
+}
+
+// Frees what parsing allocated, the file and its text are the caller's.
+static void bench_config_restore(struct config *saved)
+{
+	unsigned int i;
+	for (i=1; i<g_config.mode_count; ++i)
+		free(g_config.modes[i].entries);
+	free(g_config.segments);
+	free(g_config.handlers);
+	free(g_config.conditions);
+	g_config = *saved;
+	g_config_pinned = false;
+}
+
+static long peak_rss_kib(void)
+{
+	struct rusage usage;
+	getrusage(RUSAGE_SELF, &usage);
+	return usage.ru_maxrss;
+}
+
+// Pushes a synthetic edge workload through the classification, action resolution and dispatch: /bin/true spawned
+// for real, then the configured handlers resolved and expanded in dry run, or the /bin/true ones if none are
+// configured.
+static int bench(void)
+{
+	long rss_before = peak_rss_kib();
+	unsigned int debug_level = g_debug;
+	struct config saved;
+	struct config_file file;
+	int result = 0;
+
+	// Quiet, so that the handlers' debug output does not end up being measured.
+	g_debug = 0;
+	g_stage_sampling = true;
+
+	g_dry_run = false;
+	if (dispatcher_init() == 0 && bench_config_swap(&saved, &file, BENCH_SPAWN_CONFIG))
+		bench_phase("/bin/true handler", BENCH_SPAWN_CYCLES, settle_handlers);
+	else
+		result = 1;
+	bench_config_restore(&saved);
+
+	g_dry_run = true;
+	if (g_config.handler_count != 0)
+		bench_phase("configured handlers, dry run", BENCH_CYCLES, NULL);
+	else if (bench_config_swap(&saved, &file, BENCH_SPAWN_CONFIG))
+	{
+		bench_phase("/bin/true handler, dry run", BENCH_CYCLES, NULL);
+		bench_config_restore(&saved);
+	}
+	else
+	{
+		bench_config_restore(&saved);
+		result = 1;
+	}
+
+	g_stage_sampling = false;
+	g_debug = debug_level;
+
+	printf("Peak RSS %ld KiB, %ld KiB before the benchmark.\n", peak_rss_kib(), rss_before);
+
+	unsigned int i;
+	for (i=0; i<STAGE_COUNT; ++i)
+	{
+		free(g_stage_samples[i].ns);
+		memset(&g_stage_samples[i], 0, sizeof(g_stage_samples[i]));
+	}
+	return result;
+}
+
+enum { SOAK_BURST_PERIOD   = 10 };  // Seconds between the starts of one second bursts.
+enum { SOAK_CLICK_EDGES    = 8 };   // Edges before a pause letting the click window expire.
+enum { SOAK_HOLD_EDGES     = 40 };  // Edges between holds.
+enum { SOAK_HOLD_MS        = 1500 };
+enum { SOAK_RSS_SLACK_KIB  = 256 };
+enum { SOAK_DRIFT_SLACK_US = 1000 };
+enum { SOAK_CPU_MAX_PERCENT = 50 }; // A loop spinning on a descriptor it does not drain uses a whole CPU.
+
+// Edges the generator wrote, and those it had to drop because the daemon fell behind and the pipe was full.
+struct soak_generator_counters
+{
+	unsigned long long written;
+	unsigned long long presses; // Written edges that pressed the button.
+	unsigned long long dropped;
+};
+
+// Writes edges to fd for the given number of seconds, in the child process. At the steady rate the edges
+// form clicks and holds, during bursts they toggle as fast as the burst rate.
+static void soak_generator(int fd, unsigned int seconds, unsigned int rate, unsigned int burst, struct soak_generator_counters *counters)
+{
+	timestamp_ns_t start = get_timestamp_ns();
+	timestamp_ns_t end = start + seconds * 1000000000ull;
+	timestamp_ns_t t = start;
+	bool pressed = false;
+	unsigned long long n = 0;
+
+	while (t < end)
+	{
+		struct timespec ts = { t / 1000000000, t % 1000000000 };
+		while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR)
+			;
+
+		pressed = !pressed;
+		if (write(fd, pressed ? "1" : "0", 1) == 1)
+		{
+			++counters->written;
+			if (pressed)
+				++counters->presses;
+		}
+		else
+			++counters->dropped;
+		++n;
+
+		bool bursting = burst != 0 && (t - start) % (SOAK_BURST_PERIOD * 1000000000ull) < 1000000000ull;
+		if (bursting)
+			t += 1000000000ull / burst;
+		else if (pressed && n % SOAK_HOLD_EDGES == 1)
+			t += SOAK_HOLD_MS * 1000000ull;
+		else if (!pressed && n % SOAK_CLICK_EDGES == 0)
+			t += (CLICK_TIMEOUT_MS + 50) * 1000000ull;
+		else
+			t += 1000000000ull / rate;
+	}
+}
+
+// Runs the event loop on edges from a generator process for the given number of seconds, sampling the
+// daemon's health every SOAK_INTERVAL seconds. Fails if memory, descriptors, zombies or timer drift grew,
+// or if edges were lost.
+static int soak(unsigned int seconds, unsigned int rate, unsigned int burst)
+{
+	struct soak_generator_counters *counters = mmap(NULL, sizeof(*counters), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if (counters == MAP_FAILED)
+	{
+		fprintf(stderr, "Mapping the generator counters failed. Error %d.\n", errno);
+		return 1;
+	}
+	memset(counters, 0, sizeof(*counters));
+
+	int edges[2];
+	if (pipe2(edges, O_CLOEXEC) != 0)
+	{
+		fprintf(stderr, "Creating the edge pipe failed. Error %d.\n", errno);
+		return 1;
+	}
+	fcntl(edges[1], F_SETFL, O_NONBLOCK);
+
+	pid_t generator = fork();
+	if (generator == -1)
+	{
+		fprintf(stderr, "Starting the edge generator failed. Error %d.\n", errno);
+		return 1;
+	}
+	if (generator == 0)
+	{
+		close(edges[0]);
+		soak_generator(edges[1], seconds, rate, burst, counters);
+		_exit(0);
+	}
+	close(edges[1]);
+
+	printf("Soaking for %u s at %u edges/s, bursts of %u edges/s.\n", seconds, rate, burst);
+	g_soak.active = true;
+	int btnfds[MAX_BUTTONS];
+	unsigned int i;
+	for (i=0; i<MAX_BUTTONS; ++i)
+		btnfds[i] = -1;
+	btnfds[0] = edges[0]; // The generator presses the first button.
+	int err = event_loop(btnfds, BACKEND_PIPE);
+	g_soak.active = false;
+	close(edges[0]);
+
+	waitpid(generator, NULL, 0);
+	settle_handlers();
+
+	struct soak_sample end;
+	soak_take_sample(&end, get_timestamp_ns());
+	soak_print(&end, &g_soak.last);
+
+	bool failed = err != 0;
+	if (end.rss_kib > g_soak.baseline.rss_kib + SOAK_RSS_SLACK_KIB)
+	{
+		printf("FAIL: RSS grew from %ld to %ld KiB.\n", g_soak.baseline.rss_kib, end.rss_kib);
+		failed = true;
+	}
+	if (end.fds > g_soak.baseline.fds)
+	{
+		printf("FAIL: open descriptors grew from %d to %d.\n", g_soak.baseline.fds, end.fds);
+		failed = true;
+	}
+	if (end.zombies != 0)
+	{
+		printf("FAIL: %d unreaped handler(s).\n", end.zombies);
+		failed = true;
+	}
+	if (g_soak.samples > 2 && g_soak.last_drift_ns > 2 * g_soak.first_drift_ns + SOAK_DRIFT_SLACK_US * 1000ull)
+	{
+		printf("FAIL: timer drift grew from %.0f to %.0f us.\n", g_soak.first_drift_ns / 1e3, g_soak.last_drift_ns / 1e3);
+		failed = true;
+	}
+	if (counters->dropped != 0 || counters->written != g_event_seq)
+	{
+		printf("FAIL: %llu edge(s) written, %llu dropped by the generator, %llu read.\n", counters->written, counters->dropped, g_event_seq);
+		failed = true;
+	}
+	if (g_metrics.events[CS_DOWN] != counters->presses || g_metrics.events[CS_UP] != counters->written - counters->presses)
+	{
+		printf("FAIL: %llu press(es) and %llu release(s) written, %llu DOWN and %llu UP classified.\n", counters->presses,
+			counters->written - counters->presses, g_metrics.events[CS_DOWN], g_metrics.events[CS_UP]);
+		failed = true;
+	}
+	if (soak_cpu_percent(&g_soak.start, &end) > SOAK_CPU_MAX_PERCENT)
+	{
+		printf("FAIL: the daemon used %.0f%% of a CPU.\n", soak_cpu_percent(&g_soak.start, &end));
+		failed = true;
+	}
+
+	fault_report();
+	printf("%s: %llu edges, %llu handler(s) and %llu action(s) shed under load.\n", failed ? "FAILED" : "PASSED",
+		g_event_seq, g_metrics.handlers_dropped, g_metrics.actions_dropped);
+
+	munmap(counters, sizeof(*counters));
+	return failed;
+}
+
+enum { WAKEUP_TYPICAL_PERIOD_MS = 60000 }; // The benchmark workload once a minute stands for typical use.
+
+// Plays the edges in real time, repeated every period_ms, until the given number of seconds passed.
+// Without edges it only waits, for the idle measurement.
+static void wakeup_generator(int fd, unsigned int seconds, const struct replay_edge *edges, unsigned int count, timestamp_ms_t period_ms)
 {
-	char * endPtr;
-	uint32_t x = strtoul(src, &endPtr, 10);
-	if (endPtr == src || *endPtr != '\0')
+	timestamp_ns_t start = get_timestamp_ns();
+	timestamp_ns_t end = start + seconds * 1000000000ull;
+	timestamp_ns_t offset;
+
+	for (offset = 0; count != 0; offset += period_ms * 1000000ull)
 	{
-		*dst = 0;
-		return false;
+		unsigned int i;
+		for (i=0; i<count; ++i)
+		{
+			timestamp_ns_t t = start + offset + edges[i].ms * 1000000ull;
+			if (t >= end)
+				return;
+
+			struct timespec ts = { t / 1000000000, t % 1000000000 };
+			while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR)
+				;
+			if (write(fd, edges[i].pressed ? "1" : "0", 1) != 1)
+				return;
+		}
 	}
-	*dst = x;
-	return true;
+
+	struct timespec ts = { end / 1000000000, end % 1000000000 };
+	while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR)
+		;
 }
 
-static bool read_config_uint(const char *conf, const char *value_name, unsigned int *dst, unsigned int default_value)
+// Runs the event loop on the generated edges for the given number of seconds and prints its wakeups per hour.
+static int bench_wakeup_phase(const char *name, unsigned int seconds, const struct replay_edge *edges, unsigned int count)
 {
-	char buffer[12];
-	read_config_value(conf, value_name, buffer, NULL, sizeof(buffer), "#");
-	if (buffer[0] == '#') // No value was specified.
+	int fds[2];
+	if (pipe2(fds, O_CLOEXEC) != 0)
 	{
-		*dst = default_value;
-		return false;
+		fprintf(stderr, "Creating the edge pipe failed. Error %d.\n", errno);
+		return 1;
 	}
 
-	if (parse_uint(dst, buffer))
+	pid_t generator = fork();
+	if (generator == -1)
 	{
-		return true;
+		fprintf(stderr, "Starting the edge generator failed. Error %d.\n", errno);
+		close(fds[0]);
+		close(fds[1]);
+		return 1;
 	}
-	else
+	if (generator == 0)
 	{
-		*dst = default_value;
-		return false;
+		close(fds[0]);
+		wakeup_generator(fds[1], seconds, edges, count, WAKEUP_TYPICAL_PERIOD_MS);
+		_exit(0);
 	}
+	close(fds[1]);
+
+	unsigned long long before[WAKE_COUNT];
+	memcpy(before, g_metrics.wakeups, sizeof(before));
+
+	int btnfds[MAX_BUTTONS];
+	unsigned int i;
+	for (i=0; i<MAX_BUTTONS; ++i)
+		btnfds[i] = -1;
+	btnfds[0] = fds[0];
+	int err = event_loop(btnfds, BACKEND_PIPE);
+	close(fds[0]);
+	waitpid(generator, NULL, 0);
+	settle_handlers();
+
+	unsigned long long total = 0;
+	int cause;
+	for (cause=0; cause<WAKE_COUNT; ++cause)
+		total += g_metrics.wakeups[cause] - before[cause];
+
+	printf("%s: %.0f wakeups/hour (", name, total * 3600.0 / seconds);
+	for (cause=0; cause<WAKE_COUNT; ++cause)
+		printf("%s%s %.0f", cause ? ", " : "", WAKE_NAMES[cause], (g_metrics.wakeups[cause] - before[cause]) * 3600.0 / seconds);
+	printf(")\n");
+	return err != 0;
 }
 
-static void cleanup(void)
+// Measures the event loop's wakeups while idle and while running the --bench workload once a minute with
+// /bin/true handlers, each for the given number of seconds.
+static int bench_wakeups(unsigned int seconds)
 {
-	if (g_button_exported)
+	struct config saved;
+	struct config_file file;
+	int result = 1;
+
+	if (bench_config_swap(&saved, &file, BENCH_SPAWN_CONFIG))
 	{
-		gpio_unexport(g_button_pin);
-		g_button_exported = false;
+		result = bench_wakeup_phase("idle", seconds, NULL, 0);
+		result |= bench_wakeup_phase("typical use", seconds, BENCH_EDGES, sizeof(BENCH_EDGES) / sizeof(BENCH_EDGES[0]));
 	}
+	bench_config_restore(&saved);
+	return result;
 }
 
-static void sigint_handler(int signum)
+static void cleanup(void)
 {
-	exit(0);
+	trace_close();
+	metrics_stop();
+	control_stop();
+
+	unsigned int i;
+	for (i=0; i<g_button_count; ++i)
+	{
+		if (g_buttons_exported & (1u << i))
+			inzown_btn_gpio_unexport(g_button_pins[i]);
+	}
+	g_buttons_exported = 0;
 }
 
 int main(int argc, char **argv, char **envp)
 {
 	atexit(&cleanup);
-	struct sigaction action;
-	memset(&action, 0, sizeof(action));
-	action.sa_handler = &sigint_handler;
-	sigaction(SIGINT, &action, NULL);
+	fault_init();
 
 	int i;
 	bool conf_path_specified = false;
-	bool click_count_limit_specified = false;
+	bool check_config = false;
+	const char *trace_path = NULL;
+	const char *replay_path = NULL;
+	unsigned int replay_repeat = 1;
+	bool run_bench = false;
+	unsigned int bench_wakeup_seconds = 0;
+	unsigned int soak_seconds = 0;
+	unsigned int soak_rate = 20;
+	unsigned int soak_burst = 2000;
+	const char *metrics_socket = NULL;
+	const char *metrics_file = NULL;
+	unsigned int metrics_interval = DEFAULT_METRICS_INTERVAL;
+	const char *control_socket = NULL;
+	const char *journal_path = NULL;
+	unsigned int journal_kib = JOURNAL_DEFAULT_KIB;
 	for (i=1; i<argc; ++i)
 	{
 		if (strcmp(argv[i], "--help") == 0)
@@ -992,6 +6126,11 @@ int main(int argc, char **argv, char **envp)
 		{
 			g_full_time=true;
 		}
+		else if (strcmp(argv[i], "--suspend-safe") == 0)
+		{
+			g_suspend_safe = true;
+			g_clock = CLOCK_BOOTTIME;
+		}
 		else if (strcmp(argv[i], "--offset-time") == 0)
 		{
 			g_offset_time=true;
@@ -1039,6 +6178,21 @@ int main(int argc, char **argv, char **envp)
 				return 1;
 			}
 		}
+		else if (strcmp(argv[i], "--conf-dir") == 0)
+		{
+			if (i + 1 < argc)
+			{
+				strncpy(g_config_dir_path, argv[i+1], MAX_PATH_LENGTH);
+				g_config_dir_path[MAX_PATH_LENGTH] = '\0';
+				++i;
+			}
+			else
+			{
+				printf("Missing path argument for '%s'!\n", argv[i]);
+				print_usage();
+				return 1;
+			}
+		}
 		else if (strcmp(argv[i], "--click-count-limit") == 0 || strcmp(argv[i], "-n") == 0)
 		{
 			if (i + 1 < argc)
@@ -1047,7 +6201,7 @@ int main(int argc, char **argv, char **envp)
 				if (parse_uint(&x, argv[i+1]))
 				{
 					g_click_count_limit = x;
-					click_count_limit_specified = true;
+					g_click_count_limit_specified = true;
 					++i;
 				}
 				else
@@ -1068,10 +6222,8 @@ int main(int argc, char **argv, char **envp)
 		{
 			if (i + 1 < argc)
 			{
-				unsigned int x;
-				if (parse_uint(&x, argv[i+1]))
+				if (parse_gpio_list(g_button_pins, &g_button_count, argv[i+1]))
 				{
-					g_button_pin = (int)x;
 					++i;
 				}
 				else
@@ -1088,6 +6240,221 @@ int main(int argc, char **argv, char **envp)
 				return 1;
 			}
 		}
+		else if (strcmp(argv[i], "--check-config") == 0)
+		{
+			check_config = true;
+		}
+		else if (strcmp(argv[i], "--journal-dump") == 0 || strcmp(argv[i], "--journal-export") == 0)
+		{
+			if (i + 1 < argc)
+			{
+				return journal_read(argv[i+1], strcmp(argv[i], "--journal-export") == 0);
+			}
+			else
+			{
+				printf("Missing path argument for '%s'!\n", argv[i]);
+				print_usage();
+				return 1;
+			}
+		}
+		else if (strcmp(argv[i], "--bench-config") == 0)
+		{
+			unsigned int x;
+			if (i + 1 < argc && parse_uint(&x, argv[i+1]) && x > 0)
+			{
+				return bench_config(x);
+			}
+			else
+			{
+				printf("Missing line count argument for '%s'!\n", argv[i]);
+				print_usage();
+				return 1;
+			}
+		}
+		else if (strcmp(argv[i], "--replay") == 0)
+		{
+			if (i + 1 < argc)
+			{
+				replay_path = argv[i+1];
+				++i;
+			}
+			else
+			{
+				printf("Missing path argument for '%s'!\n", argv[i]);
+				print_usage();
+				return 1;
+			}
+		}
+		else if (strcmp(argv[i], "--repeat") == 0)
+		{
+			if (i + 1 < argc && parse_uint(&replay_repeat, argv[i+1]) && replay_repeat > 0)
+			{
+				++i;
+			}
+			else
+			{
+				printf("Missing count argument for '%s'!\n", argv[i]);
+				print_usage();
+				return 1;
+			}
+		}
+		else if (strcmp(argv[i], "--bench") == 0)
+		{
+			run_bench = true;
+		}
+		else if (strcmp(argv[i], "--bench-wakeups") == 0)
+		{
+			if (i + 1 < argc && parse_uint(&bench_wakeup_seconds, argv[i+1]) && bench_wakeup_seconds > 0)
+			{
+				++i;
+			}
+			else
+			{
+				printf("Missing numeric argument for '%s'!\n", argv[i]);
+				print_usage();
+				return 1;
+			}
+		}
+		else if (strcmp(argv[i], "--soak") == 0 || strcmp(argv[i], "--soak-rate") == 0 || strcmp(argv[i], "--soak-burst") == 0)
+		{
+			unsigned int *dst = strcmp(argv[i], "--soak") == 0 ? &soak_seconds
+				: strcmp(argv[i], "--soak-rate") == 0 ? &soak_rate : &soak_burst;
+			if (i + 1 < argc && parse_uint(dst, argv[i+1]))
+			{
+				++i;
+			}
+			else
+			{
+				printf("Missing numeric argument for '%s'!\n", argv[i]);
+				print_usage();
+				return 1;
+			}
+		}
+		else if (strcmp(argv[i], "--metrics-socket") == 0 || strcmp(argv[i], "--metrics-file") == 0)
+		{
+			if (i + 1 < argc)
+			{
+				if (strcmp(argv[i], "--metrics-socket") == 0)
+					metrics_socket = argv[i+1];
+				else
+					metrics_file = argv[i+1];
+				++i;
+			}
+			else
+			{
+				printf("Missing path argument for '%s'!\n", argv[i]);
+				print_usage();
+				return 1;
+			}
+		}
+		else if (strcmp(argv[i], "--journal") == 0)
+		{
+			if (i + 1 < argc)
+			{
+				journal_path = argv[i+1];
+				++i;
+			}
+			else
+			{
+				printf("Missing path argument for '%s'!\n", argv[i]);
+				print_usage();
+				return 1;
+			}
+		}
+		else if (strcmp(argv[i], "--journal-size") == 0)
+		{
+			if (i + 1 < argc && parse_uint(&journal_kib, argv[i+1]) && journal_kib > 0)
+			{
+				++i;
+			}
+			else
+			{
+				printf("Missing numeric argument for '%s'!\n", argv[i]);
+				print_usage();
+				return 1;
+			}
+		}
+		else if (strcmp(argv[i], "--control-socket") == 0)
+		{
+			if (i + 1 < argc)
+			{
+				control_socket = argv[i+1];
+				++i;
+			}
+			else
+			{
+				printf("Missing path argument for '%s'!\n", argv[i]);
+				print_usage();
+				return 1;
+			}
+		}
+		else if (strcmp(argv[i], "--drain-timeout") == 0)
+		{
+			if (i + 1 < argc && parse_uint(&g_drain_timeout, argv[i+1]))
+			{
+				++i;
+			}
+			else
+			{
+				printf("Missing numeric argument for '%s'!\n", argv[i]);
+				print_usage();
+				return 1;
+			}
+		}
+		else if (strcmp(argv[i], "--metrics-interval") == 0)
+		{
+			if (i + 1 < argc && parse_uint(&metrics_interval, argv[i+1]) && metrics_interval > 0)
+			{
+				++i;
+			}
+			else
+			{
+				printf("Missing numeric argument for '%s'!\n", argv[i]);
+				print_usage();
+				return 1;
+			}
+		}
+		else if (strcmp(argv[i], "--kv-file") == 0)
+		{
+			if (i + 1 < argc)
+			{
+				g_kv.path = argv[i+1];
+				++i;
+			}
+			else
+			{
+				printf("Missing path argument for '%s'!\n", argv[i]);
+				print_usage();
+				return 1;
+			}
+		}
+		else if (strcmp(argv[i], "--kv-interval") == 0)
+		{
+			if (i + 1 < argc && parse_uint(&g_kv.interval, argv[i+1]) && g_kv.interval > 0)
+			{
+				++i;
+			}
+			else
+			{
+				printf("Missing numeric argument for '%s'!\n", argv[i]);
+				print_usage();
+				return 1;
+			}
+		}
+		else if (strcmp(argv[i], "--trace-out") == 0)
+		{
+			if (i + 1 < argc)
+			{
+				trace_path = argv[i+1];
+				++i;
+			}
+			else
+			{
+				printf("Missing path argument for '%s'!\n", argv[i]);
+				print_usage();
+				return 1;
+			}
+		}
 		else if (strcmp(argv[i], "--active-low") == 0)
 		{
 			g_pin_activation = PA_ACTIVE_LOW;
@@ -1117,10 +6484,56 @@ int main(int argc, char **argv, char **envp)
 		}
 	}
 
-	if (!click_count_limit_specified)
+	int err = config_load(&g_config, g_config_path, g_config_dir_path);
+	build_handler_env();
+
+	if (check_config)
+	{
+		if (err != 0)
+			fprintf(stderr, "Failed loading %s! Error %d.\n", g_config_path, -err);
+		else
+			printf("%s: %u error(s).\n", g_config_path, g_config.errors);
+		return err != 0 || g_config.errors != 0;
+	}
+
+	if (!g_click_count_limit_specified)
 	{
-		read_config_uint(g_config_path, CLICK_COUNT_LIMIT_VALUE_NAME, &g_click_count_limit, g_click_count_limit);
+		g_click_count_limit = config_uint(&g_config, CS_CLICK_COUNT_LIMIT, g_click_count_limit);
 	}
 
+	g_lane_limit[LANE_HIGH] = config_uint(&g_config, CS_HIGH_LANE_LIMIT, DEFAULT_HIGH_LANE_LIMIT);
+	g_lane_limit[LANE_LOW] = config_uint(&g_config, CS_LOW_LANE_LIMIT, DEFAULT_LOW_LANE_LIMIT);
+
+	g_metrics.config_errors = g_config.errors;
+
+	if (trace_path != NULL && trace_open(trace_path) != 0)
+		return 1;
+
+	if ((metrics_socket != NULL || metrics_file != NULL) && metrics_start(metrics_socket, metrics_file, metrics_interval) != 0)
+		return 1;
+
+	if (control_socket != NULL && control_start(control_socket) != 0)
+		return 1;
+
+	if (journal_path != NULL && journal_open(journal_path, journal_kib) != 0)
+		return 1;
+
+	if (g_kv.path != NULL && kv_load() != 0)
+		return 1;
+
+	probes_bind();
+
+	if (replay_path != NULL)
+		return replay(replay_path, replay_repeat);
+
+	if (run_bench)
+		return bench();
+
+	if (bench_wakeup_seconds != 0)
+		return bench_wakeups(bench_wakeup_seconds);
+
+	if (soak_seconds != 0)
+		return soak(soak_seconds, soak_rate ? soak_rate : 1, soak_burst);
+
 	return run();
 }
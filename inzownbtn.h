@@ -0,0 +1,161 @@
+/*
+ * libinzownbtn, button gestures of the Inzown hardware for applications.
+ * Copyright (C) 2023 Claude Warren, https://inzown.com
+ *
+ * based on
+ * pisound-btn daemon for the Pisound button.
+ * Copyright (C) 2017  Vilniaus Blokas UAB, https://blokas.io/pisound
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; version 2 of the
+ * License.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#ifndef INZOWNBTN_H
+#define INZOWNBTN_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+enum { INZOWN_BTN_CLICK_TIMEOUT_MS = 400 }; // Presses closer than this are one multi click.
+enum { INZOWN_BTN_HOLD_TIMEOUT_MS  = INZOWN_BTN_CLICK_TIMEOUT_MS }; // Shorter presses are not holds.
+
+enum inzown_btn_action
+{
+	INZOWN_BTN_DOWN = 0, // Every time the button is pushed down.
+	INZOWN_BTN_UP,       // Every time the button is released up.
+	INZOWN_BTN_CLICK,    // The button was short-clicked one or multiple times in quick succession.
+	INZOWN_BTN_HOLD,     // The button was held, reported when it is released.
+
+	INZOWN_BTN_ACTION_COUNT
+};
+
+struct inzown_btn_event
+{
+	enum inzown_btn_action action;
+	unsigned int           clicks;    // Presses in the click window, including the held one for INZOWN_BTN_HOLD.
+	unsigned int           hold_ms;   // INZOWN_BTN_HOLD only.
+	unsigned long long     ts_ns;     // The edge or click window expiry that produced the event.
+	unsigned long long     origin_ns; // Edge that started the gesture, the first press for clicks and holds.
+	int                    button;    // The id of the machine, the GPIO number for inzown_btn_open.
+};
+
+typedef void (*inzown_btn_callback)(const struct inzown_btn_event *ev, void *user);
+
+// Action names, as used by the daemon's configuration.
+#define INZOWN_BTN_DOWN_NAME        "DOWN"
+#define INZOWN_BTN_UP_NAME          "UP"
+#define INZOWN_BTN_CLICK_NAME       "CLICK_%u"
+#define INZOWN_BTN_CLICK_OTHER_NAME "CLICK_OTHER"
+#define INZOWN_BTN_HOLD_NAME        "HOLD_%uS"
+#define INZOWN_BTN_HOLD_OTHER_NAME  "HOLD_OTHER"
+
+// Longer clicks and holds are named CLICK_OTHER and HOLD_OTHER.
+#define INZOWN_BTN_MAX_CLICK        99
+#define INZOWN_BTN_MAX_HOLD         99
+#define INZOWN_BTN_ACTION_NAME_SIZE 11
+
+// How hold times are rounded to the seconds of their names, see inzown-btn --help-time.
+enum
+{
+	INZOWN_BTN_FULL_TIME   = 1, // Both odd and even seconds, instead of only odd ones.
+	INZOWN_BTN_OFFSET_TIME = 2, // Seconds start and end half a second early.
+};
+
+unsigned int inzown_btn_hold_seconds(unsigned int hold_ms, unsigned int time_flags);
+
+// Writes the name of the action, e.g. CLICK_2 or HOLD_3S, to name.
+void inzown_btn_action_name(enum inzown_btn_action action, unsigned int clicks, unsigned int hold_ms, unsigned int time_flags,
+	char name[INZOWN_BTN_ACTION_NAME_SIZE + 1]);
+
+// The click and hold classification of one button, fed its edges and the expiries of its click window timer in
+// any clock. The callback runs synchronously from inzown_btn_machine_edge and inzown_btn_machine_timeout.
+//
+// Callers allocate the machine themselves, so its size and layout are part of the ABI of libinzownbtn.so.1: any
+// change to its fields, appending one included, bumps the SONAME. Applications may read the fields but only the
+// functions below write them.
+struct inzown_btn_machine
+{
+	unsigned long long  pressed_at;        // Milliseconds, 0 before the first press.
+	bool                timer_running;
+	bool                button_down;
+	unsigned int        num_pressed;
+	unsigned long long  gesture_start_ns;  // First press of the current click window.
+	unsigned int        click_count_limit; // 0 for no limit.
+	unsigned long long  repeated_edges;    // Edges that did not change the button state.
+	int                 id;
+	inzown_btn_callback callback;
+	void               *user;
+};
+
+void inzown_btn_machine_init(struct inzown_btn_machine *m, int id, unsigned int click_count_limit, inzown_btn_callback callback, void *user);
+
+// Returns true if the click window timer has to be started again, to expire INZOWN_BTN_CLICK_TIMEOUT_MS after ts_ns.
+bool inzown_btn_machine_edge(struct inzown_btn_machine *m, bool pressed, unsigned long long ts_ns);
+
+void inzown_btn_machine_timeout(struct inzown_btn_machine *m, unsigned long long ts_ns);
+
+// The sysfs GPIO backend. These print the reason of a failure to stderr.
+enum inzown_btn_edge
+{
+	INZOWN_BTN_EDGE_NONE    = 0,
+	INZOWN_BTN_EDGE_RISING  = 1,
+	INZOWN_BTN_EDGE_FALLING = 2,
+	INZOWN_BTN_EDGE_BOTH    = 3,
+};
+
+// Returns negative value on error, 0 if the pin is already exported, 1 if pin was just exported successfully.
+int inzown_btn_gpio_export(int pin);
+int inzown_btn_gpio_unexport(int pin);
+int inzown_btn_gpio_set_edge(int pin, enum inzown_btn_edge edge);
+int inzown_btn_gpio_set_active_low(int pin, bool state);
+// Opens the value file, signalling POLLPRI on edges. Returns -1 on error.
+int inzown_btn_gpio_open(int pin);
+int inzown_btn_gpio_close(int fd);
+
+// A button on a GPIO with its click window timer, for applications handling the gestures in process.
+struct inzown_btn_options
+{
+	int          gpio;
+	int          active_low;        // 1 or 0 to configure the pin, -1 to leave it as is.
+	unsigned int click_count_limit; // 0 for no limit.
+	bool         suspend_safe;      // EPOLLWAKEUP and CLOCK_BOOTTIME(_ALARM), as inzown-btn --suspend-safe.
+};
+
+struct inzown_btn;
+
+// GPIO 17, active sense left as is, 8 clicks.
+void inzown_btn_default_options(struct inzown_btn_options *options);
+
+// Returns NULL with errno set on failure.
+struct inzown_btn *inzown_btn_open(const struct inzown_btn_options *options, inzown_btn_callback callback, void *user);
+
+// Readable when inzown_btn_process has work to do. Poll it for POLLIN, or add it to an epoll set.
+int inzown_btn_fd(const struct inzown_btn *btn);
+
+// Handles the pending edges and click window expiries without blocking, running the callback for every event.
+// Returns 0, or -1 with errno set.
+int inzown_btn_process(struct inzown_btn *btn);
+
+// Unexports the GPIO if inzown_btn_open exported it.
+void inzown_btn_close(struct inzown_btn *btn);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // INZOWNBTN_H
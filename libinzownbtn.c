@@ -0,0 +1,547 @@
+/*
+ * libinzownbtn, button gestures of the Inzown hardware for applications.
+ * Copyright (C) 2023 Claude Warren, https://inzown.com
+ *
+ * based on
+ * pisound-btn daemon for the Pisound button.
+ * Copyright (C) 2017  Vilniaus Blokas UAB, https://blokas.io/pisound
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; version 2 of the
+ * License.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#define _GNU_SOURCE
+
+#include "inzownbtn.h"
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/timerfd.h>
+#include <sys/epoll.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+
+unsigned int inzown_btn_hold_seconds(unsigned int hold_ms, unsigned int time_flags)
+{
+	int ticks = hold_ms;
+	int result;
+
+	if (time_flags & INZOWN_BTN_OFFSET_TIME)  {
+		if (time_flags & INZOWN_BTN_FULL_TIME) {  // f+o+
+			result = (ticks+500)/1000;
+
+		} else {		// f-o+
+			int sec = (ticks)/1000;
+			result = sec+((sec+1)%2);
+		}
+	} else {
+		if (time_flags & INZOWN_BTN_FULL_TIME) { // f+o-
+			result = ticks/1000;
+		} else {		// f-o-
+			result = 1+( ((ticks-1000)/2000)* 2);
+		}
+	}
+	return result;
+}
+
+void inzown_btn_action_name(enum inzown_btn_action action, unsigned int clicks, unsigned int hold_ms, unsigned int time_flags,
+	char name[INZOWN_BTN_ACTION_NAME_SIZE + 1])
+{
+	memset(name, 0, INZOWN_BTN_ACTION_NAME_SIZE + 1);
+	switch (action)
+	{
+	case INZOWN_BTN_DOWN:
+		strcpy(name, INZOWN_BTN_DOWN_NAME);
+		break;
+	case INZOWN_BTN_UP:
+		strcpy(name, INZOWN_BTN_UP_NAME);
+		break;
+	case INZOWN_BTN_CLICK:
+		if (clicks <= INZOWN_BTN_MAX_CLICK)
+			sprintf(name, INZOWN_BTN_CLICK_NAME, clicks);
+		else
+			strcpy(name, INZOWN_BTN_CLICK_OTHER_NAME);
+		break;
+	case INZOWN_BTN_HOLD:
+	{
+		unsigned int seconds = inzown_btn_hold_seconds(hold_ms, time_flags);
+		if (seconds <= INZOWN_BTN_MAX_HOLD)
+			sprintf(name, INZOWN_BTN_HOLD_NAME, seconds);
+		else
+			strcpy(name, INZOWN_BTN_HOLD_OTHER_NAME);
+		break;
+	}
+	default:
+		break;
+	}
+}
+
+void inzown_btn_machine_init(struct inzown_btn_machine *m, int id, unsigned int click_count_limit, inzown_btn_callback callback, void *user)
+{
+	memset(m, 0, sizeof(*m));
+	m->id = id;
+	m->click_count_limit = click_count_limit;
+	m->callback = callback;
+	m->user = user;
+}
+
+static void machine_emit(struct inzown_btn_machine *m, enum inzown_btn_action action, unsigned int clicks, unsigned int hold_ms,
+	unsigned long long ts_ns, unsigned long long origin_ns)
+{
+	struct inzown_btn_event ev = { action, clicks, hold_ms, ts_ns, origin_ns, m->id };
+	m->callback(&ev, m->user);
+}
+
+bool inzown_btn_machine_edge(struct inzown_btn_machine *m, bool pressed, unsigned long long ts_ns)
+{
+	unsigned long long timestamp = ts_ns / 1000000;
+	bool restart_timer = false;
+
+	// The contacts bounced back before the edge was read, or the press started before the machine. A repeated press
+	// counts as another one, as the daemon always classified it, and a repeated release is ignored.
+	if (pressed == m->button_down)
+	{
+		++m->repeated_edges;
+		if (!pressed)
+			return false;
+	}
+
+	if (pressed)
+	{
+		m->button_down = true;
+		machine_emit(m, INZOWN_BTN_DOWN, 0, 0, ts_ns, ts_ns);
+
+		if (!m->timer_running)
+		{
+			m->num_pressed = 1;
+			m->timer_running = true;
+			m->gesture_start_ns = ts_ns;
+		}
+		else
+		{
+			if (m->click_count_limit == 0 || m->num_pressed < m->click_count_limit)
+				++m->num_pressed;
+		}
+
+		m->pressed_at = timestamp;
+		restart_timer = true;
+	}
+	else
+	{
+		m->button_down = false;
+		machine_emit(m, INZOWN_BTN_UP, 0, 0, ts_ns, ts_ns);
+
+		if (m->pressed_at != 0)
+		{
+			if (timestamp - m->pressed_at >= INZOWN_BTN_HOLD_TIMEOUT_MS)
+			{
+				machine_emit(m, INZOWN_BTN_HOLD, m->num_pressed, timestamp - m->pressed_at, ts_ns, m->gesture_start_ns);
+			}
+		}
+	}
+	return restart_timer;
+}
+
+void inzown_btn_machine_timeout(struct inzown_btn_machine *m, unsigned long long ts_ns)
+{
+	if (!m->button_down)
+		machine_emit(m, INZOWN_BTN_CLICK, m->num_pressed, 0, ts_ns, m->gesture_start_ns);
+	m->timer_running = false;
+}
+
+// Arbitrarily chosen limit, large enough for the dynamically allocated
+// bases of gpio-sim and gpio-mockup chips (512 and up on recent kernels).
+enum { MAX_GPIO_NUMBER = 9999 };
+
+static int gpio_is_pin_valid(int pin)
+{
+	return pin >= 0 && pin <= MAX_GPIO_NUMBER;
+}
+
+int inzown_btn_gpio_export(int pin)
+{
+	if (!gpio_is_pin_valid(pin))
+	{
+		fprintf(stderr, "Invalid pin number %d!\n", pin);
+		return -1;
+	}
+
+	char gpio[64];
+
+	snprintf(gpio, sizeof(gpio), "/sys/class/gpio/gpio%d", pin);
+
+	struct stat s;
+	if (stat(gpio, &s) != 0)
+	{
+		int fd = open("/sys/class/gpio/export", O_WRONLY);
+		if (fd == -1)
+		{
+			fprintf(stderr, "Failed top open /sys/class/gpio/export!\n");
+			return -1;
+		}
+		char str_pin[8];
+		snprintf(str_pin, sizeof(str_pin), "%d", pin);
+		const int n = strlen(str_pin)+1;
+		int result = write(fd, str_pin, n);
+		if (result != n)
+		{
+			fprintf(stderr, "Failed writing to /sys/class/gpio/export! Error %d.\n",  errno);
+			close(fd);
+			return -1;
+		}
+		result = close(fd);
+		if (result != 0)
+		{
+			fprintf(stderr, "Failed closing /sys/class/gpio/export! Error %d.\n", errno);
+			return -1;
+		}
+		// Give some time for the pin to appear.
+		usleep(100000);
+		return 1;
+	}
+
+	// Already exported.
+	return 0;
+}
+
+int inzown_btn_gpio_unexport(int pin)
+{
+	if (!gpio_is_pin_valid(pin))
+	{
+		fprintf(stderr, "Invalid pin number %d!\n", pin);
+		return -1;
+	}
+
+	char gpio[64];
+
+	snprintf(gpio, sizeof(gpio), "/sys/class/gpio/gpio%d", pin);
+
+	struct stat s;
+	if (stat(gpio, &s) == 0)
+	{
+		int fd = open("/sys/class/gpio/unexport", O_WRONLY);
+		if (fd == -1)
+		{
+			fprintf(stderr, "Failed top open /sys/class/gpio/unexport!\n");
+			return -1;
+		}
+		char str_pin[8];
+		snprintf(str_pin, sizeof(str_pin), "%d", pin);
+		const int n = strlen(str_pin)+1;
+		int result = write(fd, str_pin, n);
+		if (result != n)
+		{
+			fprintf(stderr, "Failed writing to /sys/class/gpio/unexport! Error %d.\n",  errno);
+			close(fd);
+			return -1;
+		}
+		result = close(fd);
+		if (result != 0)
+		{
+			fprintf(stderr, "Failed closing /sys/class/gpio/unexport! Error %d.\n", errno);
+			return -1;
+		}
+		return 0;
+	}
+
+	// Already unexported.
+	return 0;
+}
+
+int inzown_btn_gpio_set_edge(int pin, enum inzown_btn_edge edge)
+{
+	if (!gpio_is_pin_valid(pin))
+	{
+		fprintf(stderr, "Invalid pin number %d!\n", pin);
+		return -1;
+	}
+
+	char gpio[64];
+
+	snprintf(gpio, sizeof(gpio), "/sys/class/gpio/gpio%d/edge", pin);
+
+	int fd = open(gpio, O_WRONLY);
+	if (fd == -1)
+	{
+		fprintf(stderr, "Failed to open %s! Error %d.\n", gpio, errno);
+		return -1;
+	}
+
+	static const char *const edge2str[] =
+	{
+		"none",
+		"rising",
+		"falling",
+		"both",
+	};
+
+	const int n = strlen(edge2str[edge])+1;
+
+	int result = write(fd, edge2str[edge], n);
+	if (result != n)
+	{
+		fprintf(stderr, "Failed writing to %s! Error %d.\n", gpio, errno);
+		close(fd);
+		return -1;
+	}
+	int err = close(fd);
+	if (err != 0)
+	{
+		fprintf(stderr, "Failed closing %s! Error %d.\n", gpio, errno);
+		return -1;
+	}
+	return 0;
+}
+
+int inzown_btn_gpio_set_active_low(int pin, bool state)
+{
+	if (!gpio_is_pin_valid(pin))
+	{
+		fprintf(stderr, "Invalid pin number %d!\n", pin);
+		return -1;
+	}
+
+	char gpio[64];
+
+	snprintf(gpio, sizeof(gpio), "/sys/class/gpio/gpio%d/active_low", pin);
+
+	int fd = open(gpio, O_WRONLY);
+	if (fd == -1)
+	{
+		fprintf(stderr, "Failed to open %s! Error %d.\n", gpio, errno);
+		return -1;
+	}
+
+	int result = write(fd, state?"1":"0", 1);
+	if (result != 1)
+	{
+		fprintf(stderr, "Failed writing to %s! Error %d.\n", gpio, errno);
+		close(fd);
+		return -1;
+	}
+	int err = close(fd);
+	if (err != 0)
+	{
+		fprintf(stderr, "Failed closing %s! Error %d.\n", gpio, errno);
+		return -1;
+	}
+	return 0;
+}
+
+int inzown_btn_gpio_open(int pin)
+{
+	if (!gpio_is_pin_valid(pin))
+	{
+		fprintf(stderr, "Invalid pin number %d!\n", pin);
+		return -1;
+	}
+
+	char gpio[64];
+
+	snprintf(gpio, sizeof(gpio), "/sys/class/gpio/gpio%d/value", pin);
+
+	int fd = open(gpio, O_RDONLY | O_CLOEXEC);
+
+	if (fd == -1)
+	{
+		fprintf(stderr, "Failed opening %s! Error %d.\n", gpio, errno);
+	}
+
+	return fd;
+}
+
+int inzown_btn_gpio_close(int fd)
+{
+	int err = close(fd);
+	if (err != 0)
+	{
+		fprintf(stderr, "Failed closing descriptor %d! Error %d.\n", fd, err);
+		return -1;
+	}
+	return 0;
+}
+
+struct inzown_btn
+{
+	struct inzown_btn_machine machine;
+	int                       gpio;
+	bool                      exported;  // By inzown_btn_open, to be unexported by inzown_btn_close.
+	clockid_t                 clock;
+	int                       value_fd;
+	int                       timer_fd;
+	int                       epoll_fd;
+};
+
+void inzown_btn_default_options(struct inzown_btn_options *options)
+{
+	memset(options, 0, sizeof(*options));
+	options->gpio = 17;
+	options->active_low = -1;
+	options->click_count_limit = 8;
+}
+
+static unsigned long long btn_timestamp_ns(const struct inzown_btn *btn)
+{
+	struct timespec tp;
+	clock_gettime(btn->clock, &tp);
+	return tp.tv_sec * 1000000000ull + tp.tv_nsec;
+}
+
+static int btn_watch(struct inzown_btn *btn, int fd, uint32_t events)
+{
+	struct epoll_event ev;
+	memset(&ev, 0, sizeof(ev));
+	ev.events = events;
+	ev.data.fd = fd;
+	return epoll_ctl(btn->epoll_fd, EPOLL_CTL_ADD, fd, &ev);
+}
+
+struct inzown_btn *inzown_btn_open(const struct inzown_btn_options *options, inzown_btn_callback callback, void *user)
+{
+	struct inzown_btn *btn = calloc(1, sizeof(*btn));
+	if (btn == NULL)
+		return NULL;
+
+	inzown_btn_machine_init(&btn->machine, options->gpio, options->click_count_limit, callback, user);
+	btn->gpio = options->gpio;
+	btn->clock = options->suspend_safe ? CLOCK_BOOTTIME : CLOCK_MONOTONIC;
+	btn->value_fd = -1;
+	btn->timer_fd = -1;
+	btn->epoll_fd = -1;
+
+	int err = inzown_btn_gpio_export(btn->gpio);
+	if (err < 0)
+	{
+		free(btn);
+		errno = ENODEV;
+		return NULL;
+	}
+	btn->exported = err == 1;
+
+	if ((options->active_low >= 0 && inzown_btn_gpio_set_active_low(btn->gpio, options->active_low != 0) != 0) ||
+		inzown_btn_gpio_set_edge(btn->gpio, INZOWN_BTN_EDGE_BOTH) != 0 ||
+		(btn->value_fd = inzown_btn_gpio_open(btn->gpio)) == -1)
+	{
+		inzown_btn_close(btn);
+		errno = ENODEV;
+		return NULL;
+	}
+
+	if (options->suspend_safe)
+	{
+		btn->timer_fd = timerfd_create(CLOCK_BOOTTIME_ALARM, TFD_CLOEXEC | TFD_NONBLOCK);
+		if (btn->timer_fd == -1 && errno == EPERM) // No CAP_WAKE_ALARM, fire after the next resume instead.
+			btn->timer_fd = timerfd_create(CLOCK_BOOTTIME, TFD_CLOEXEC | TFD_NONBLOCK);
+	}
+	else
+		btn->timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC | TFD_NONBLOCK);
+
+	uint32_t wakeup = options->suspend_safe ? EPOLLWAKEUP : 0;
+	if (btn->timer_fd == -1 ||
+		(btn->epoll_fd = epoll_create1(EPOLL_CLOEXEC)) == -1 ||
+		btn_watch(btn, btn->value_fd, EPOLLPRI | wakeup) == -1 ||
+		btn_watch(btn, btn->timer_fd, EPOLLIN | wakeup) == -1)
+	{
+		int saved = errno;
+		inzown_btn_close(btn);
+		errno = saved;
+		return NULL;
+	}
+
+	return btn;
+}
+
+int inzown_btn_fd(const struct inzown_btn *btn)
+{
+	return btn->epoll_fd;
+}
+
+static int btn_read_edge(struct inzown_btn *btn)
+{
+	unsigned long long ts_ns = btn_timestamp_ns(btn);
+	char buff[16];
+	memset(buff, 0, sizeof(buff));
+
+	if (pread(btn->value_fd, buff, sizeof(buff) - 1, 0) <= 0)
+		return -1;
+
+	if (inzown_btn_machine_edge(&btn->machine, strtoul(buff, NULL, 10) != 0, ts_ns))
+	{
+		// The click window is measured from the edge, however long its callbacks took.
+		unsigned long long deadline = ts_ns + INZOWN_BTN_CLICK_TIMEOUT_MS * 1000000ull;
+
+		struct itimerspec its;
+		memset(&its, 0, sizeof(its));
+		its.it_value.tv_sec = deadline / 1000000000;
+		its.it_value.tv_nsec = deadline % 1000000000;
+		if (timerfd_settime(btn->timer_fd, TFD_TIMER_ABSTIME, &its, NULL) == -1)
+			return -1;
+	}
+	return 0;
+}
+
+static int btn_read_timer(struct inzown_btn *btn)
+{
+	uint64_t expirations;
+	if (read(btn->timer_fd, &expirations, sizeof(expirations)) != sizeof(expirations))
+		return errno == EAGAIN ? 0 : -1; // Rearmed by an edge since it became readable.
+
+	inzown_btn_machine_timeout(&btn->machine, btn_timestamp_ns(btn));
+	return 0;
+}
+
+int inzown_btn_process(struct inzown_btn *btn)
+{
+	struct epoll_event events[2];
+	int n = epoll_wait(btn->epoll_fd, events, 2, 0);
+	if (n == -1)
+		return errno == EINTR ? 0 : -1;
+
+	// Edges first, so that a press racing the end of the click window still counts in it.
+	int i;
+	for (i=0; i<n; ++i)
+	{
+		if (events[i].data.fd == btn->value_fd && btn_read_edge(btn) != 0)
+			return -1;
+	}
+	for (i=0; i<n; ++i)
+	{
+		if (events[i].data.fd == btn->timer_fd && btn_read_timer(btn) != 0)
+			return -1;
+	}
+	return 0;
+}
+
+void inzown_btn_close(struct inzown_btn *btn)
+{
+	if (btn == NULL)
+		return;
+
+	if (btn->epoll_fd != -1)
+		close(btn->epoll_fd);
+	if (btn->timer_fd != -1)
+		close(btn->timer_fd);
+	if (btn->value_fd != -1)
+		inzown_btn_gpio_close(btn->value_fd);
+
+	inzown_btn_gpio_set_edge(btn->gpio, INZOWN_BTN_EDGE_NONE);
+	if (btn->exported)
+		inzown_btn_gpio_unexport(btn->gpio);
+	free(btn);
+}
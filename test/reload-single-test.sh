@@ -0,0 +1,78 @@
+#!/bin/sh
+#
+# Test of @single handlers across a reload, run by make reload-test.
+#
+# Runs the daemon on the soak generator, without any GPIO, and injects actions through its control socket while a
+# slow @single handler is running:
+#  - After a reload of the same configuration, the handler still runs only once.
+#  - After a reload that puts another @single handler first in the handler table, that handler runs although the
+#    earlier one, which had its place in the old table, is still running.
+#
+# Usage: reload-single-test.sh <inzown-btn> <inzown-btn-ctl>
+
+set -u
+
+DAEMON=$(realpath "$1")
+CTL=$(realpath "$2")
+WORK=$(mktemp -d)
+SOCKET=$WORK/control
+PID=
+
+fail()
+{
+	echo "reload-test: FAIL: $*" >&2
+	exit 1
+}
+
+cleanup()
+{
+	[ -n "$PID" ] && kill "$PID" 2> /dev/null && wait "$PID" 2> /dev/null
+	rm -rf "$WORK"
+}
+trap cleanup EXIT
+trap 'exit 1' INT TERM
+
+ctl()
+{
+	"$CTL" --socket "$SOCKET" "$@" > /dev/null || fail "inzown-btn-ctl $*."
+}
+
+# Logs its name and keeps running, long enough for the whole test.
+cat > "$WORK/handler" << EOF
+#!/bin/sh
+echo "\$1" >> $WORK/log
+sleep 5
+EOF
+chmod +x "$WORK/handler"
+: > "$WORK/log"
+
+echo "CLICK_1 @single $WORK/handler one" > "$WORK/test.conf"
+
+# A steady edge a second keeps the loop busy with holds, which run nothing.
+"$DAEMON" -q --conf "$WORK/test.conf" --conf-dir "" --control-socket "$SOCKET" \
+	--soak 30 --soak-rate 1 --soak-burst 0 > "$WORK/daemon.log" 2>&1 &
+PID=$!
+
+tries=50
+while [ ! -S "$SOCKET" ]; do
+	kill -0 "$PID" 2> /dev/null || fail "the daemon exited: $(cat "$WORK/daemon.log")"
+	tries=$((tries - 1))
+	[ $tries -gt 0 ] || fail "no control socket within 5 s."
+	sleep 0.1
+done
+
+ctl inject CLICK_1
+sleep 0.5
+ctl reload
+ctl inject CLICK_1
+sleep 0.5
+[ "$(grep -c '^one$' "$WORK/log")" = 1 ] || fail "CLICK_1 ran $(grep -c '^one$' "$WORK/log") times across a reload" \
+	"of the same configuration, instead of once."
+
+echo "CLICK_2 @single $WORK/handler two" > "$WORK/test.conf"
+ctl reload
+ctl inject CLICK_2
+sleep 0.5
+grep -q '^two$' "$WORK/log" || fail "CLICK_2 did not run, it was taken for the CLICK_1 handler of before the reload."
+
+echo "reload-test: PASS"